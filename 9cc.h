@@ -8,8 +8,9 @@
 
 /* 組み込み型 */
 typedef enum {
-    TY_INT,  // int
-    TY_PTR   // pointer
+    TY_INT,  // int (4 バイト)
+    TY_PTR,  // pointer (8 バイト)
+    TY_LONG  // ポインタの差 (8 バイト)。宣言には使えない
 } Ptype;
 
 typedef struct Type Type;
@@ -20,16 +21,23 @@ struct Type {
 
 /* トークンの種類 */
 typedef enum {
-    TK_RESERVED,  // 記号
-    TK_RETURN,    // return
-    TK_IF,        // if
-    TK_ELSE,      // else
-    TK_WHILE,     // while
-    TK_FOR,       // for
-    TK_IDENT,     // 変数
-    TK_NUM,       // 整数
-    TK_TYPE,      // 型
-    TK_EOF        // EOF
+    TK_RESERVED,       // 記号
+    TK_RETURN,         // return
+    TK_IF,             // if
+    TK_ELSE,           // else
+    TK_WHILE,          // while
+    TK_FOR,            // for
+    TK_IDENT,          // 変数
+    TK_NUM,            // 整数
+    TK_TYPE,           // 型
+    TK_NOINLINE,       // noinline
+    TK_ALWAYS_INLINE,  // always_inline
+    TK_STATIC,         // static
+    TK_SWITCH,         // switch
+    TK_CASE,           // case
+    TK_DEFAULT,        // default
+    TK_BREAK,          // break
+    TK_EOF             // EOF
 } TokenKind;
 
 /* トークン */
@@ -50,6 +58,7 @@ typedef enum {
     ND_SUB,      // -
     ND_MUL,      // *
     ND_DIV,      // /
+    ND_MOD,      // %
     ND_EQ,       // ==
     ND_NE,       // !=
     ND_LT,       // <
@@ -65,15 +74,55 @@ typedef enum {
     ND_DEFFUNC,  // 関数定義
     ND_BLOCK,    // ブロック
     ND_ADDR,     // アドレス取得
-    ND_DEREF     // 参照外し
+    ND_DEREF,    // 参照外し
+    ND_INLINE,   // インライン展開された関数呼び出し
+    ND_SWITCH,   // switch
+    ND_CASE,     // case・default のラベル
+    ND_BREAK     // break
 } NodeKind;
 
+/* 関数の副作用 */
+typedef enum {
+    PURITY_NONE,      // 副作用あり、または不明
+    PURITY_READONLY,  // メモリを読むが書き込まない
+    PURITY_PURE       // 引数だけから値が決まる
+} Purity;
+
+/* 組み込み関数 */
+typedef enum {
+    BI_NONE,      // 組み込み関数ではない
+    BI_POPCOUNT,  // __builtin_popcount
+    BI_CLZ,       // __builtin_clz
+    BI_CTZ,       // __builtin_ctz
+    BI_BSWAP32,   // __builtin_bswap32
+    BI_BSWAP64,   // __builtin_bswap64
+    BI_PREFETCH,  // __builtin_prefetch
+    BI_EXPECT,    // __builtin_expect
+    BI_RDTSC      // __rdtsc
+} BuiltinKind;
+
+/* 関数の呼び出し規約 */
+typedef enum {
+    CONV_SYSV,    // System V ABI
+    CONV_FAST,    // 独自の規約: 引数を一時レジスタの順に渡す
+    CONV_WRAPPED  // 独自の規約の本体と、外部から呼ぶ System V のラッパー
+} CallConv;
+
+/* 関数のインライン展開の指定 */
+typedef enum {
+    INLINE_DEFAULT,  // 指定なし
+    INLINE_NEVER,    // noinline
+    INLINE_ALWAYS    // always_inline
+} InlineAttr;
+
 typedef struct LVar LVar;
+typedef struct VecLoop VecLoop;
 
 /* 抽象構文機のノード */
 typedef struct Node Node;
 struct Node {
     NodeKind kind;  // ノードの種類
+    Type *type;     // 式の型。式でなければ NULL
     union {
         // 数値
         struct {
@@ -83,7 +132,7 @@ struct Node {
         struct {
             char *name;
             int len;
-            int offset;  // ベースポインタからのオフセット
+            LVar *var;  // 変数の情報
         } lvar;
         // 関数
         struct {
@@ -92,6 +141,8 @@ struct Node {
             Node **params;
             int max_param;  // パラメータノードを格納できる最大数
             int num_param;  // パラメータ数
+            Node *deffunc;  // 同じプログラム内の関数定義。なければ NULL
+            BuiltinKind builtin;  // 組み込み関数なら、その種類
         } func;
         // 関数定義
         struct {
@@ -102,7 +153,22 @@ struct Node {
             int max_param;  // パラメータノードを格納できる最大数
             int num_param;  // パラメータ数
             Node *block;
+            InlineAttr inline_attr;  // インライン展開の指定
+            bool has_escape;         // アドレスを取られた変数があるか
+            bool is_static;          // static 関数か
+            Purity purity;           // 副作用
+            int num_var_reg;         // 変数に割り当てたレジスタの数
+            int local_size;          // 変数に使うスタックのバイト数
+            CallConv conv;           // 呼び出し規約
+            bool *param_used;        // パラメータを使うか。NULL なら全て使う
         } deffunc;
+        // インライン展開された関数呼び出し
+        // block の先頭でパラメータに引数を代入し、本体を実行する
+        struct {
+            char *name;
+            int len;
+            Node *block;
+        } inl;
         // 1項演算子
         struct {
             Node *expr;
@@ -129,7 +195,19 @@ struct Node {
             Node *test;
             Node *update;
             Node *body;
+            VecLoop *vec;  // ベクトル化できるなら、その情報。なければ NULL
         } cfor;
+        // switch (test) body
+        // body はブロックで、case・default (ND_CASE) はその直下に置く
+        struct {
+            Node *test;
+            Node *body;
+        } cswitch;
+        // case val: / default:
+        struct {
+            int val;
+            bool is_default;
+        } ccase;
         // ブロック
         struct {
             Node **code;
@@ -148,18 +226,160 @@ struct LVar {
     char *name;  // 変数の名前
     int len;     // 名前の長さ
     Type *type;  // 型
+    int id;      // 関数内の変数の番号 (0 から)。最適化の解析に使う
     int offset;  // RBPからのオフセット
+    int reg;     // 割り当てられたレジスタ (1～NUM_VAR_REG)。メモリ上なら 0
     LVar *next;  // 次の変数かNULL
 };
 
+/* ベクトル化したループ
+
+   for (i = ...; i < n; i = i + 8) *(dst + i) = (式);
+   の形のループを、ベクトル 1 つ分ずつ処理するループと、残りを処理する
+   元のループ (スカラーのエピローグ) に分ける。
+ */
+struct VecLoop {
+    Node *iv;            // 誘導変数 (ND_LVAR)
+    Node *store;         // 格納先 (ND_DEREF)
+    Node *value;         // 格納する値の式
+    Node **invariants;   // ループの前でベクトルに展開するループ不変の式
+    int num_invariant;
+    Node **checks;       // 実行時に重なりを調べる (格納先 - 読み出し元) の式
+    int num_check;
+    Node *vtest;         // ベクトル 1 つ分の要素が残っていれば真になる式
+    Node *vupdate;       // 誘導変数をベクトル 1 つ分進める式
+    int bytes;           // ベクトルのバイト数
+};
+
+/* ベクトル命令セット */
+typedef enum {
+    ISA_SSE2,  // -march=x86-64: 128 ビット
+    ISA_AVX2   // -march=x86-64-v3: 256 ビット
+} Isa;
+
+/* 命令スケジューリングのモデル (-mtune=...) */
+typedef enum {
+    TUNE_GENERIC,  // 最近の x86-64 の平均
+    TUNE_SKYLAKE,  // Intel Skylake
+    TUNE_ZNVER3    // AMD Zen 3
+} Tune;
+
+/* 出力するアセンブリの行の種類 */
+typedef enum {
+    LN_INSN,    // 命令
+    LN_LABEL,   // ラベル
+    LN_JMP,     // 無条件ジャンプ
+    LN_JCC,     // 条件ジャンプ
+    LN_EXIT,    // 関数から出る命令 (ret、末尾呼び出しの jmp)
+    LN_TABLE,   // ジャンプテーブルを引いた間接ジャンプ (jmp reg)
+    LN_COMMENT  // コメント
+} LineKind;
+
+/* 条件ジャンプの分岐の予測 (__builtin_expect) */
+typedef enum {
+    HINT_NONE,     // 予測なし
+    HINT_LIKELY,   // 分岐することが多い
+    HINT_UNLIKELY  // 分岐しないことが多い
+} BranchHint;
+
+/* 命令のオペランドの最大数 */
+#define MAX_OPERAND (3)
+
+/* オペランドの種類 */
+typedef enum {
+    OPR_REG,  // 汎用レジスタ
+    OPR_VEC,  // xmm・ymm レジスタ
+    OPR_IMM,  // 即値
+    OPR_MEM,  // メモリ
+    OPR_SYM,  // ラベル・関数名
+} OprKind;
+
+/* 解析したオペランド */
+typedef struct {
+    OprKind kind;
+    int reg;      // レジスタ番号 (機械語での番号)
+    int size;     // レジスタ・メモリの大きさ (バイト)。不明なら 0
+    int64_t imm;  // 即値
+    int base;     // ベースレジスタ。なければ -1
+    int index;    // インデックスレジスタ。なければ -1
+    int scale;    // インデックスに掛ける数
+    int32_t disp; // ディスプレースメント
+    char *sym;    // rip 相対で参照するラベル ([rip+sym])。なければ NULL
+} Opr;
+
+/* 出力するアセンブリの行 */
+typedef struct {
+    LineKind kind;                // 行の種類
+    char *op;                     // 命令名 (mov, jmp, ...)。コメントなら文字列
+    char *operands[MAX_OPERAND];  // 命令のオペランド
+    Opr oprs[MAX_OPERAND];        // operands を解析したもの
+    int num_operand;              // オペランドの数
+    char *label;                  // ラベルの名前。ジャンプならジャンプ先。
+                                  // LN_TABLE ならジャンプテーブルの名前
+    char **targets;               // LN_TABLE: テーブルの各要素の飛び先
+    int num_target;               // LN_TABLE: テーブルの要素数
+    BranchHint hint;              // LN_JCC: 分岐の予測
+} Line;
+
+/* 関数 1 つ分のアセンブリ */
+typedef struct {
+    Line *lines;
+    int max_line;  // 行を格納できる最大数
+    int num_line;  // 行数
+} Code;
+
+/* アセンブリの出力バッファ */
+typedef struct {
+    char *data;  // 出力する文字列
+    size_t len;  // 文字列の長さ
+    size_t cap;  // 確保した領域の大きさ
+    int fd;      // 書き出し先。-1 なら書き出さずにメモリに溜める
+} Output;
+
 /* 入力プログラム */
 extern const char *user_input;
 
+/* コンパイルオプション */
+typedef struct {
+    int inline_limit;  // -finline-limit=N: インライン展開する関数の最大サイズ
+    bool dce;          // -fno-dce で false: 不要コードを削除するか
+    bool ipa;          // -fno-ipa で false: 関数間の解析を行うか
+    bool layout;       // -fno-layout で false: 基本ブロックを並べ替えるか
+    bool vectorize;    // -fno-vectorize で false: ループをベクトル化するか
+    Isa isa;           // -march=...: 使用できるベクトル命令
+    bool popcnt;       // -march=...: popcnt 命令を使えるか
+    bool lzcnt;        // -march=...: lzcnt・tzcnt 命令を使えるか
+    bool lto;          // -flto: アセンブリの代わりに中間表現を出力するか
+    bool verbose_asm;  // -fverbose-asm: アセンブリにコメントを出力するか
+    bool peephole;     // -fno-peephole で false: 覗き穴最適化を行うか
+    bool peephole_stats;  // -fpeephole-stats: 覗き穴最適化の回数を出力するか
+    bool obj;          // -c: アセンブリの代わりにオブジェクトファイルを出力するか
+    bool run;          // --run: コンパイルしたプログラムをその場で実行するか
+    bool omit_frame_pointer;  // -fomit-frame-pointer: 葉関数でフレームを省くか
+    bool stack_reuse;  // -fno-stack-reuse で false: 変数のスロットを共有するか
+    bool size;         // -Os: 実行速度よりコードの大きさを優先するか
+    bool size_report;  // -fsize-report: 関数ごとの .text のバイト数を出力するか
+    bool schedule;     // -fno-schedule-insns で false: 命令を並べ直すか
+    bool sched_stats;  // -fsched-stats: 見積もりのサイクル数を出力するか
+    Tune tune;         // -mtune=...: 命令スケジューリングのモデル
+} Option;
+
+extern Option option;
+
+/* ローカル変数に割り当てる呼び出し先保存レジスタの数 */
+#define NUM_VAR_REG (5)
+
+/* ベクトルレジスタ (xmm0～15 / ymm0～15) の数 */
+#define NUM_VEC_REG (16)
+
 /* ブロック内の stmt 数 */
 #define MAX_CODE (10)
 
-/* 関数呼び出し時のパラメータ数 */
-#define MAX_PARAM (6)
+/* 関数呼び出し時のパラメータ数の最大 (独自の呼び出し規約で渡せる数) */
+#define MAX_PARAM (7)
+
+/* System V ABI でレジスタで渡せるパラメータ数 */
+#define MAX_ABI_PARAM (6)
 
 /* エラー出力関数 */
 void error(char *fmt, ...);
@@ -200,5 +420,131 @@ bool eof(void);
 /* パース */
 Node *parse(void);
 
+/* 名前が組み込み関数なら、その種類を返す。違えば BI_NONE */
+BuiltinKind find_builtin(const char *name, int len);
+
+/* 組み込み関数の引数の数の範囲 */
+void builtin_params(BuiltinKind kind, int *min, int *max);
+
+/* 組み込み関数の副作用 (引数を除く) */
+Purity builtin_purity(BuiltinKind kind);
+
+/* 組み込み関数の値を定数の引数から求める。求められなければ false */
+bool eval_builtin(BuiltinKind kind, int64_t *args, int64_t *val);
+
+/* int 型 */
+extern Type *int_type;
+
+/* 型の大きさ (バイト) */
+int size_of(Type *type);
+
+/* ポインタ型なら true を返す */
+bool is_pointer(Type *type);
+
+/* type へのポインタ型を作る */
+Type *pointer_to(Type *type);
+
+/* node 以下の、型が決まっていない式に型を付ける */
+void add_type(Node *node);
+
+/* プログラムを中間表現モジュールとして書き出す */
+void write_module(Node *program, FILE *out);
+
+/* path が中間表現モジュールなら true を返す */
+bool is_module_file(const char *path);
+
+/* 中間表現モジュールを読み込み、1 つのプログラムに結合する */
+Node *link_modules(char **paths, int num_path);
+
+/* 子ノードを訪れる関数 */
+typedef void (*NodeVisitor)(Node *node, void *arg);
+
+/* node の直接の子ノードについて、ソース上の順に visit(子, arg) を呼ぶ */
+void visit_children(Node *node, NodeVisitor visit, void *arg);
+
+/* 名前から関数定義を探し、プログラム内での番号を返す。なければ -1 */
+int find_func(Node *program, const char *name, int len);
+
+/* 関数間の定数伝播と副作用の解析を行う */
+void analyze_interprocedural(Node *program);
+
+/* 関数をインライン展開する */
+void inline_functions(Node *program);
+
+/* 不要なコードを削除する */
+void eliminate_dead_code(Node *program);
+
+/* node 以下でアドレスを取られた変数を探し、taken[変数の番号] を true にする */
+void find_addr_taken(Node *node, bool *taken);
+
+/* アドレスを取られないローカル変数をレジスタに昇格する */
+void promote_locals(Node *program);
+
+/* 単純なループをベクトル化する */
+void vectorize_loops(Node *program);
+
+/* レジスタに昇格しなかったローカル変数にスタックスロットを割り当てる */
+void assign_stack_slots(Node *program);
+
+/* 関数ごとに呼び出し規約を選ぶ */
+void choose_conventions(Node *program);
+
 /* 抽象構文木を下りながらコードを生成 */
 void gen(Node *node);
+
+/* プログラム全体のアセンブリを出力する */
+void gen_program(Node *program);
+
+/* アセンブリの書き出し先を fd にする。fd が -1 ならメモリに溜める */
+void set_output(int fd);
+
+/* メモリに溜めたアセンブリを返す */
+char *output_data(size_t *len);
+
+/* 出力バッファの内容を書き出す */
+void flush_output(void);
+
+/* コードの末尾に行を追加する */
+Line *add_line(Code *code, LineKind kind, char *op, char *label);
+
+/* レジスタ番号 reg の、size バイト (8, 4, 2, 1) の名前 */
+const char *reg_name(int reg, int size);
+
+/* 関数のコードを基本ブロックに分け、ジャンプを減らすように並べ替える */
+void layout_blocks(Code *code);
+
+/* 関数のコードに覗き穴最適化を行う */
+void peephole(Code *code);
+
+/* パターンごとの書き換えの回数を出力する */
+void print_peephole_stats(FILE *fp);
+
+/* 関数のコードの基本ブロックごとに命令を並べ直す */
+void schedule_insns(Code *code, const char *name, int len);
+
+/* 関数ごとの見積もりのサイクル数を出力する */
+void print_sched_stats(FILE *fp);
+
+/* 関数 1 つ分のコードを機械語にする */
+void assemble_func(const char *name, int len, bool is_static, Code *code);
+
+/* 機械語にしたプログラム全体を ELF64 の再配置可能オブジェクトにする */
+char *assemble_object(size_t *size);
+
+/* 関数ごとの .text のバイト数を出力する */
+void print_text_sizes(FILE *fp);
+
+/* 機械語にしたプログラム全体を、このプロセスで実行できるイメージにする */
+char *assemble_image(void *(*resolve)(const char *name), size_t *size);
+
+/* 関数のイメージ内でのオフセット。なければ -1 */
+long symbol_offset(const char *name);
+
+/* 実行するプログラムから呼べる関数を登録する */
+void jit_register(const char *name, void *addr);
+
+/* 共有ライブラリの関数を実行するプログラムから呼べるようにする */
+void jit_load_library(const char *path);
+
+/* 機械語にしたプログラムの main を実行し、その戻り値を返す */
+int jit_run(void);
@@ -0,0 +1,71 @@
+.intel_syntax noprefix
+.global bits
+bits:
+    nop
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rbp-8], rbx
+    movsxd rbx, edi
+    mov edi, ebx
+    mov eax, edi
+    shr eax, 1
+    and eax, 0x55555555
+    sub edi, eax
+    mov rbx, [rbp-8]
+    mov eax, edi
+    and edi, 0x33333333
+    shr eax, 2
+    and eax, 0x33333333
+    add edi, eax
+    mov eax, edi
+    shr eax, 4
+    add edi, eax
+    and edi, 0x0f0f0f0f
+    imul edi, edi, 0x01010101
+    shr edi, 24
+    mov rax, rdi
+    mov rsp, rbp
+    pop rbp
+    ret
+.global main
+main:
+    nop
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rbp-8], rbx
+    mov edi, 255
+    call func1
+    mov rdi, rax
+    movsxd rbx, edi
+    mov edi, ebx
+    mov eax, edi
+    shr eax, 1
+    and eax, 0x55555555
+    sub edi, eax
+    mov eax, edi
+    and edi, 0x33333333
+    shr eax, 2
+    and eax, 0x33333333
+    add edi, eax
+    mov eax, edi
+    shr eax, 4
+    add edi, eax
+    and edi, 0x0f0f0f0f
+    imul edi, edi, 0x01010101
+    shr edi, 24
+    push rdi
+    mov edi, 16
+    sub rsp, 8
+    call func1
+    add rsp, 8
+    mov rsi, rax
+    pop rdi
+    mov rbx, [rbp-8]
+    bsf esi, esi
+    add edi, esi
+    mov rax, rdi
+    mov rsp, rbp
+    pop rbp
+    ret
@@ -0,0 +1,67 @@
+.intel_syntax noprefix
+.global poly
+poly:
+    nop
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rbp-8], rbx
+    mov [rbp-16], r12
+    movsxd rbx, edi
+    movsxd r12, esi
+    mov edi, ebx
+    mov esi, r12d
+    imul esi, esi, 3
+    sub edi, esi
+    mov esi, ebx
+    imul esi, ebx
+    lea esi, [r12+rsi]
+    imul esi, edi
+    mov edi, esi
+    lea esi, [rbx+1]
+    lea ecx, [r12+2]
+    imul esi, ecx
+    lea ecx, [rbx+r12]
+    imul esi, ecx
+    add edi, esi
+    mov rax, rdi
+    mov rbx, [rbp-8]
+    mov r12, [rbp-16]
+    mov rsp, rbp
+    pop rbp
+    ret
+.global main
+main:
+    nop
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rbp-8], rbx
+    mov [rbp-16], r12
+    mov edi, 3
+    call func1
+    mov rdi, rax
+    movsxd rbx, edi
+    mov edi, 4
+    movsxd r12, edi
+    mov edi, ebx
+    mov esi, r12d
+    imul esi, esi, 3
+    sub edi, esi
+    mov esi, ebx
+    imul esi, ebx
+    lea esi, [r12+rsi]
+    imul esi, edi
+    mov edi, esi
+    lea esi, [rbx+1]
+    lea ecx, [r12+2]
+    imul esi, ecx
+    lea ecx, [rbx+r12]
+    imul esi, ecx
+    add edi, esi
+    mov rax, rdi
+    mov rbx, [rbp-8]
+    mov r12, [rbp-16]
+    mov rsp, rbp
+    pop rbp
+    ret
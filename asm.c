@@ -0,0 +1,1092 @@
+/* アセンブラ
+
+   コード生成が作った命令の行を機械語に変換し、ELF64 の再配置可能
+   オブジェクトファイルを作る (-c)。扱うのはコード生成が使う命令だけで、
+   エンコードは GNU as と同じものを選ぶ。
+
+   - 命令は関数ごとに、分岐以外をその場でエンコードしておく
+   - プログラム全体を変換し終えたら、分岐の長さを決める。すべての分岐を
+     短い形 (rel8) から始め、届かない分岐を長い形 (rel32) にすることを
+     変化がなくなるまで繰り返す
+   - オブジェクト内で定義されない関数の呼び出しと、static でない関数の
+     呼び出しは R_X86_64_PLT32 の再配置にする
+   - switch のジャンプテーブルは .rodata に置き、飛び先とテーブルの差を
+     32 ビットで並べる。テーブルを指す lea reg, [rip+テーブル] と
+     テーブルの要素は R_X86_64_PC32 の再配置にする
+   - --run では、オブジェクトファイルの代わりに、そのまま実行できる
+     イメージを作る。再配置はイメージ内で解決し、外部の関数は末尾の
+     間接ジャンプを経由して呼ぶ。イメージは .text、ジャンプテーブル、
+     間接ジャンプの順に並べる
+ */
+#include <elf.h>
+#include "9cc.h"
+
+/* 分岐の種類 */
+typedef enum {
+    BR_NONE,  // 分岐でない
+    BR_JMP,   // jmp
+    BR_JCC,   // 条件ジャンプ
+    BR_CALL,  // call
+} BranchKind;
+
+/* エンコードした命令 */
+typedef struct {
+    uint8_t bytes[16];  // 機械語。分岐なら決まるまで空
+    int len;            // 機械語のバイト数
+    BranchKind branch;  // 分岐の種類
+    int cc;             // 条件ジャンプの条件コード
+    char *target;       // 分岐先のラベル・関数
+    int target_insn;    // 分岐先の命令。オブジェクト内になければ -1
+    bool is_short;      // rel8 で分岐するか
+    bool need_reloc;    // 再配置にするか
+    int offset;         // .text の先頭からのオフセット
+    char *data;         // rip 相対で参照するジャンプテーブル。なければ NULL
+} Insn;
+
+/* 関数のシンボル */
+typedef struct {
+    char *name;
+    bool is_static;
+    int begin;  // 先頭の命令
+    int end;    // 末尾の命令の次
+} Symbol;
+
+/* .rodata に置くジャンプテーブル */
+typedef struct {
+    char *name;
+    char **targets;  // 各要素の飛び先のラベル
+    int num_target;
+    int offset;      // .rodata の先頭からのオフセット
+} Table;
+
+/* ラベル (関数名を含む) と、その位置の命令 */
+typedef struct {
+    char *name;
+    int insn;
+} Label;
+
+/* 変換した命令 */
+static Insn *insns = NULL;
+static int num_insn = 0;
+static int max_insn = 0;
+
+/* 関数のシンボル */
+static Symbol *symbols = NULL;
+static int num_symbol = 0;
+
+/* ジャンプテーブル */
+static Table *tables = NULL;
+static int num_table = 0;
+static int rodata_size = 0;
+
+/* ラベルのハッシュ表 (オープンアドレス法) */
+static Label *labels = NULL;
+static int num_label = 0;
+static int max_label = 0;
+
+/* 条件ジャンプ・setcc の条件コード */
+static const char *cc_names[] = {"o", "no", "b",  "ae", "e", "ne", "be", "a",
+                                 "s", "ns", "p",  "np", "l", "ge", "le", "g"};
+
+/* 文字列の先頭 len バイトを複製する */
+static char *copy_string(const char *s, int len) {
+    char *str = malloc(len + 1);
+    memcpy(str, s, len);
+    str[len] = '\0';
+    return str;
+}
+
+/* 文字列のハッシュ値 (FNV-1a) */
+static uint32_t hash(const char *s) {
+    uint32_t h = 2166136261u;
+    for (; *s != '\0'; s++) {
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    }
+    return h;
+}
+
+/* ラベルを探す。なければ、追加する場所を返す */
+static Label *find_label(const char *name) {
+    uint32_t i = hash(name) & (max_label - 1);
+    while ((labels[i].name != NULL) && (strcmp(labels[i].name, name) != 0)) {
+        i = (i + 1) & (max_label - 1);
+    }
+    return &labels[i];
+}
+
+/* ラベルを追加する */
+static void add_label(const char *name, int insn) {
+    if ((num_label + 1) * 2 > max_label) {
+        Label *old = labels;
+        int old_max = max_label;
+        max_label = (max_label == 0) ? 1024 : max_label * 2;
+        labels = calloc(max_label, sizeof(Label));
+        for (int i = 0; i < old_max; i++) {
+            if (old[i].name != NULL) {
+                *find_label(old[i].name) = old[i];
+            }
+        }
+        free(old);
+    }
+    Label *label = find_label(name);
+    if (label->name != NULL) {
+        error("ラベル %s が重複しています。", name);
+    }
+    label->name = copy_string(name, strlen(name));
+    label->insn = insn;
+    num_label++;
+}
+
+/* 命令を追加する */
+static Insn *new_insn(void) {
+    if (num_insn == max_insn) {
+        max_insn = (max_insn == 0) ? 1024 : max_insn * 2;
+        insns = realloc(insns, max_insn * sizeof(Insn));
+    }
+    Insn *insn = &insns[num_insn];
+    num_insn++;
+    memset(insn, 0, sizeof(Insn));
+    insn->target_insn = -1;
+    return insn;
+}
+
+/* 即値が符号付き 8 ビットに収まれば true を返す */
+static bool is_imm8(int64_t val) {
+    return (val >= -128) && (val <= 127);
+}
+
+/* 即値が符号付き 32 ビットに収まれば true を返す */
+static bool is_imm32(int64_t val) {
+    return (val >= INT32_MIN) && (val <= INT32_MAX);
+}
+
+/* 1 バイト追加する */
+static void put8(Insn *insn, int val) {
+    insn->bytes[insn->len] = (uint8_t)val;
+    insn->len++;
+}
+
+/* リトルエンディアンで size バイト追加する */
+static void put_le(Insn *insn, uint64_t val, int size) {
+    for (int i = 0; i < size; i++) {
+        put8(insn, (int)(val >> (i * 8)));
+    }
+}
+
+/* r/m オペランドの REX.X と REX.B */
+static int rex_xb(Opr *rm) {
+    if (rm->kind == OPR_MEM) {
+        return (((rm->index >= 8) ? 1 : 0) << 1) | ((rm->base >= 8) ? 1 : 0);
+    }
+    return (rm->reg >= 8) ? 1 : 0;
+}
+
+/* 必要なら REX プレフィックスを追加する */
+static void put_rex(Insn *insn, bool w, int reg, Opr *rm) {
+    int rex = ((w == true) ? 8 : 0) | ((reg >= 8) ? 4 : 0) | rex_xb(rm);
+    if (rex != 0) {
+        put8(insn, 0x40 | rex);
+    }
+}
+
+/* ModR/M (と SIB・ディスプレースメント) を追加する。
+   reg は ModR/M の reg フィールド (レジスタ番号か /digit)。
+ */
+static void put_modrm(Insn *insn, int reg, Opr *rm) {
+    reg &= 7;
+    if (rm->kind != OPR_MEM) {
+        put8(insn, 0xc0 | (reg << 3) | (rm->reg & 7));
+        return;
+    }
+
+    if (rm->sym != NULL) {
+        // [rip+sym]。変位はラベルの位置が決まってから埋める
+        put8(insn, (reg << 3) | 5);
+        put_le(insn, 0, 4);
+        return;
+    }
+
+    int base = rm->base;
+    int index = rm->index;
+    if (base < 0) {
+        // [index * scale + disp32]
+        int ss = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : rm->scale / 2;
+        put8(insn, (reg << 3) | 4);
+        put8(insn, (ss << 6) | (((index < 0) ? 4 : index & 7) << 3) | 5);
+        put_le(insn, (uint32_t)rm->disp, 4);
+        return;
+    }
+
+    // rbp・r13 をベースにするときは、ディスプレースメントを省略できない
+    int mod;
+    if ((rm->disp == 0) && ((base & 7) != 5)) {
+        mod = 0;
+    } else if (is_imm8(rm->disp) == true) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    // rsp・r12 をベースにするか、インデックスがあるときは SIB が要る
+    if ((index >= 0) || ((base & 7) == 4)) {
+        int ss = (rm->scale == 8) ? 3 : (rm->scale == 4) ? 2 : rm->scale / 2;
+        put8(insn, (mod << 6) | (reg << 3) | 4);
+        put8(insn, (ss << 6) | (((index < 0) ? 4 : index & 7) << 3) | (base & 7));
+    } else {
+        put8(insn, (mod << 6) | (reg << 3) | (base & 7));
+    }
+    if (mod == 1) {
+        put8(insn, rm->disp);
+    } else if (mod == 2) {
+        put_le(insn, (uint32_t)rm->disp, 4);
+    }
+}
+
+/* 通常の命令: [prefix] [REX] opcode ModR/M */
+static void put_op(Insn *insn,
+                   int prefix,
+                   bool w,
+                   int opcode,
+                   int reg,
+                   Opr *rm) {
+    if (prefix != 0) {
+        put8(insn, prefix);
+    }
+    put_rex(insn, w, reg, rm);
+    if (opcode > 0xff) {
+        put8(insn, opcode >> 8);
+    }
+    put8(insn, opcode & 0xff);
+    put_modrm(insn, reg, rm);
+}
+
+/* VEX 命令。pp は 0:なし 1:66 2:F3、map は 1:0F 2:0F38 */
+static void put_vex(Insn *insn,
+                    int pp,
+                    int map,
+                    bool w,
+                    int l,
+                    int vvvv,
+                    int opcode,
+                    int reg,
+                    Opr *rm) {
+    int r = (reg >= 8) ? 0 : 1;
+    int xb = rex_xb(rm) ^ 3;
+    int v = (~vvvv & 15) << 3;
+    if ((xb == 3) && (map == 1) && (w == false)) {
+        put8(insn, 0xc5);
+        put8(insn, (r << 7) | v | (l << 2) | pp);
+    } else {
+        put8(insn, 0xc4);
+        put8(insn, (r << 7) | (xb << 5) | map);
+        put8(insn, ((w == true) ? 0x80 : 0) | v | (l << 2) | pp);
+    }
+    put8(insn, opcode);
+    put_modrm(insn, reg, rm);
+}
+
+/* 条件コードを探す */
+static int find_cc(const char *name) {
+    for (int i = 0; i < 16; i++) {
+        if (strcmp(cc_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* 算術命令 (add, or, and, sub, xor, cmp) の /digit。違えば -1 */
+static int alu_digit(const char *op) {
+    static const char *ops[] = {"add", "or", "", "", "and", "sub", "xor", "cmp"};
+    for (int i = 0; i < 8; i++) {
+        if (strcmp(ops[i], op) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* シフト命令の /digit。違えば -1 */
+static int shift_digit(const char *op) {
+    if (strcmp(op, "shl") == 0) {
+        return 4;
+    } else if (strcmp(op, "shr") == 0) {
+        return 5;
+    } else if (strcmp(op, "sar") == 0) {
+        return 7;
+    }
+    return -1;
+}
+
+/* ビットを数える命令 ([F3] 0F xx /r) の opcode と prefix。違えば -1 */
+static int bit_opcode(const char *op, int *prefix) {
+    static const struct {
+        const char *name;
+        int prefix;
+        int opcode;
+    } ops[] = {
+        {"popcnt", 0xf3, 0xb8},
+        {"lzcnt", 0xf3, 0xbd},
+        {"tzcnt", 0xf3, 0xbc},
+        {"bsr", 0, 0xbd},
+        {"bsf", 0, 0xbc},
+    };
+    for (int i = 0; i < (int)(sizeof(ops) / sizeof(ops[0])); i++) {
+        if (strcmp(ops[i].name, op) == 0) {
+            *prefix = ops[i].prefix;
+            return ops[i].opcode;
+        }
+    }
+    return -1;
+}
+
+/* プリフェッチ命令 (0F 18 /digit) の /digit。違えば -1 */
+static int prefetch_digit(const char *op) {
+    static const char *ops[] = {
+        "prefetchnta", "prefetcht0", "prefetcht1", "prefetcht2"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(ops[i], op) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* SSE2 の 2 オペランドの命令 (66 0F xx /r) の opcode。違えば -1 */
+static int sse_opcode(const char *op) {
+    if (strcmp(op, "movdqa") == 0) {
+        return 0x6f;
+    } else if (strcmp(op, "paddd") == 0) {
+        return 0xfe;
+    } else if (strcmp(op, "psubd") == 0) {
+        return 0xfa;
+    } else if (strcmp(op, "movd") == 0) {
+        return 0x6e;
+    }
+    return -1;
+}
+
+/* 分岐を追加する */
+static void add_branch(BranchKind kind, int cc, const char *target) {
+    Insn *insn = new_insn();
+    insn->branch = kind;
+    insn->cc = cc;
+    insn->target = copy_string(target, strlen(target));
+}
+
+/* ジャンプテーブルを追加する */
+static void add_table(Line *line) {
+    tables = realloc(tables, (num_table + 1) * sizeof(Table));
+    Table *table = &tables[num_table];
+    num_table++;
+    table->name = copy_string(line->label, strlen(line->label));
+    table->targets = calloc(line->num_target, sizeof(char *));
+    for (int i = 0; i < line->num_target; i++) {
+        table->targets[i]
+            = copy_string(line->targets[i], strlen(line->targets[i]));
+    }
+    table->num_target = line->num_target;
+    table->offset = rodata_size;
+    rodata_size += 4 * line->num_target;
+}
+
+/* ジャンプテーブルを探す */
+static Table *find_table(const char *name) {
+    for (int i = 0; i < num_table; i++) {
+        if (strcmp(tables[i].name, name) == 0) {
+            return &tables[i];
+        }
+    }
+    error("ジャンプテーブル %s が見つかりません。", name);
+    return NULL;
+}
+
+/* 命令の行を機械語にする */
+static void encode(Line *line) {
+    const char *op = line->op;
+    int n = line->num_operand;
+    Opr a = (n > 0) ? line->oprs[0] : (Opr){0};
+    Opr b = (n > 1) ? line->oprs[1] : (Opr){0};
+    Opr c = (n > 2) ? line->oprs[2] : (Opr){0};
+    int digit;
+    int opcode;
+    int prefix;
+
+    // 大きさを書かないメモリは、レジスタのオペランドと同じ大きさにする
+    if ((a.kind == OPR_MEM) && (a.size == 0)) {
+        a.size = (b.kind == OPR_REG) ? b.size : 8;
+    }
+    if ((b.kind == OPR_MEM) && (b.size == 0)) {
+        b.size = (a.kind == OPR_REG) ? a.size : 8;
+    }
+    bool w = (a.size == 8);
+
+    if (line->kind == LN_TABLE) {
+        // jmp reg と、それが引くテーブル
+        put_op(new_insn(), 0, false, 0xff, 4, &a);
+        add_table(line);
+        return;
+    }
+    if ((line->kind == LN_JMP) || (line->kind == LN_JCC)) {
+        if (strcmp(op, "jmp") == 0) {
+            add_branch(BR_JMP, 0, line->label);
+        } else {
+            add_branch(BR_JCC, find_cc(op + 1), line->label);
+        }
+        return;
+    }
+    if ((strcmp(op, "call") == 0) || (strcmp(op, "jmp") == 0)) {
+        add_branch((op[0] == 'c') ? BR_CALL : BR_JMP, 0, line->operands[0]);
+        return;
+    }
+
+    Insn *insn = new_insn();
+    if (strcmp(op, "nop") == 0) {
+        put8(insn, 0x90);
+    } else if (strcmp(op, "ret") == 0) {
+        put8(insn, 0xc3);
+    } else if (strcmp(op, "leave") == 0) {
+        put8(insn, 0xc9);
+    } else if (strcmp(op, "cqo") == 0) {
+        put8(insn, 0x48);
+        put8(insn, 0x99);
+    } else if (strcmp(op, "cdq") == 0) {
+        put8(insn, 0x99);
+    } else if (strcmp(op, "vzeroupper") == 0) {
+        put8(insn, 0xc5);
+        put8(insn, 0xf8);
+        put8(insn, 0x77);
+    } else if ((strcmp(op, "push") == 0) || (strcmp(op, "pop") == 0)) {
+        if (a.kind == OPR_IMM) {
+            if (is_imm8(a.imm) == true) {
+                put8(insn, 0x6a);
+                put8(insn, (int)a.imm);
+            } else {
+                put8(insn, 0x68);
+                put_le(insn, (uint32_t)a.imm, 4);
+            }
+        } else {
+            if (a.reg >= 8) {
+                put8(insn, 0x41);
+            }
+            put8(insn, ((op[1] == 'u') ? 0x50 : 0x58) + (a.reg & 7));
+        }
+    } else if (strcmp(op, "mov") == 0) {
+        if (b.kind == OPR_IMM) {
+            if ((a.kind == OPR_REG) && (w == false)) {
+                put_rex(insn, false, -1, &a);
+                put8(insn, 0xb8 + (a.reg & 7));
+                put_le(insn, (uint32_t)b.imm, 4);
+            } else if (is_imm32(b.imm) == true) {
+                put_op(insn, 0, w, 0xc7, 0, &a);
+                put_le(insn, (uint32_t)b.imm, 4);
+            } else {
+                put_rex(insn, true, -1, &a);
+                put8(insn, 0xb8 + (a.reg & 7));
+                put_le(insn, (uint64_t)b.imm, 8);
+            }
+        } else if (b.kind == OPR_MEM) {
+            put_op(insn, 0, w, 0x8b, a.reg, &b);
+        } else {
+            put_op(insn, 0, w, 0x89, b.reg, &a);
+        }
+    } else if (strcmp(op, "movsxd") == 0) {
+        put_op(insn, 0, true, 0x63, a.reg, &b);
+    } else if (strcmp(op, "movzx") == 0) {
+        put_op(insn, 0, w, 0x0fb6, a.reg, &b);
+    } else if (strcmp(op, "lea") == 0) {
+        put_op(insn, 0, w, 0x8d, a.reg, &b);
+        insn->data = b.sym;
+    } else if ((digit = alu_digit(op)) >= 0) {
+        if (b.kind == OPR_IMM) {
+            if (is_imm8(b.imm) == true) {
+                put_op(insn, 0, w, 0x83, digit, &a);
+                put8(insn, (int)b.imm);
+            } else if ((a.kind == OPR_REG) && (a.reg == 0)) {
+                put_rex(insn, w, -1, &a);
+                put8(insn, digit * 8 + 5);
+                put_le(insn, (uint32_t)b.imm, 4);
+            } else {
+                put_op(insn, 0, w, 0x81, digit, &a);
+                put_le(insn, (uint32_t)b.imm, 4);
+            }
+        } else if (b.kind == OPR_MEM) {
+            put_op(insn, 0, w, digit * 8 + 3, a.reg, &b);
+        } else {
+            put_op(insn, 0, w, digit * 8 + 1, b.reg, &a);
+        }
+    } else if (strcmp(op, "test") == 0) {
+        put_op(insn, 0, w, 0x85, b.reg, &a);
+    } else if (strcmp(op, "imul") == 0) {
+        if (n == 1) {
+            put_op(insn, 0, w, 0xf7, 5, &a);
+        } else if (n == 2) {
+            put_op(insn, 0, w, 0x0faf, a.reg, &b);
+        } else if (is_imm8(c.imm) == true) {
+            put_op(insn, 0, w, 0x6b, a.reg, &b);
+            put8(insn, (int)c.imm);
+        } else {
+            put_op(insn, 0, w, 0x69, a.reg, &b);
+            put_le(insn, (uint32_t)c.imm, 4);
+        }
+    } else if (strcmp(op, "idiv") == 0) {
+        put_op(insn, 0, w, 0xf7, 7, &a);
+    } else if (strcmp(op, "neg") == 0) {
+        put_op(insn, 0, w, 0xf7, 3, &a);
+    } else if ((opcode = bit_opcode(op, &prefix)) >= 0) {
+        put_op(insn, prefix, w, 0x0f00 | opcode, a.reg, &b);
+    } else if (strcmp(op, "bswap") == 0) {
+        put_rex(insn, w, -1, &a);
+        put8(insn, 0x0f);
+        put8(insn, 0xc8 + (a.reg & 7));
+    } else if ((digit = prefetch_digit(op)) >= 0) {
+        put_op(insn, 0, false, 0x0f18, digit, &a);
+    } else if (strcmp(op, "rdtsc") == 0) {
+        put8(insn, 0x0f);
+        put8(insn, 0x31);
+    } else if ((digit = shift_digit(op)) >= 0) {
+        if (b.imm == 1) {
+            put_op(insn, 0, w, 0xd1, digit, &a);
+        } else {
+            put_op(insn, 0, w, 0xc1, digit, &a);
+            put8(insn, (int)b.imm);
+        }
+    } else if ((strncmp(op, "set", 3) == 0) && (find_cc(op + 3) >= 0)) {
+        put_op(insn, 0, false, 0x0f90 + find_cc(op + 3), 0, &a);
+    } else if (strcmp(op, "movdqu") == 0) {
+        if (a.kind == OPR_MEM) {
+            put_op(insn, 0xf3, false, 0x0f7f, b.reg, &a);
+        } else {
+            put_op(insn, 0xf3, false, 0x0f6f, a.reg, &b);
+        }
+    } else if ((opcode = sse_opcode(op)) >= 0) {
+        put_op(insn, 0x66, false, 0x0f00 | opcode, a.reg, &b);
+    } else if (strcmp(op, "pshufd") == 0) {
+        put_op(insn, 0x66, false, 0x0f70, a.reg, &b);
+        put8(insn, (int)c.imm);
+    } else if (strcmp(op, "vmovdqu") == 0) {
+        if (a.kind == OPR_MEM) {
+            put_vex(insn, 2, 1, false, 1, 0, 0x7f, b.reg, &a);
+        } else {
+            put_vex(insn, 2, 1, false, 1, 0, 0x6f, a.reg, &b);
+        }
+    } else if (strcmp(op, "vmovdqa") == 0) {
+        // 2 バイトの VEX で済むように、必要ならストアの形を使う
+        if ((b.reg >= 8) && (a.reg < 8)) {
+            put_vex(insn, 1, 1, false, 1, 0, 0x7f, b.reg, &a);
+        } else {
+            put_vex(insn, 1, 1, false, 1, 0, 0x6f, a.reg, &b);
+        }
+    } else if ((strcmp(op, "vpaddd") == 0) || (strcmp(op, "vpsubd") == 0)) {
+        opcode = (op[2] == 'a') ? 0xfe : 0xfa;
+        put_vex(insn, 1, 1, false, 1, b.reg, opcode, a.reg, &c);
+    } else if (strcmp(op, "vpbroadcastd") == 0) {
+        put_vex(insn, 1, 2, false, 1, 0, 0x58, a.reg, &b);
+    } else if (strcmp(op, "vmovd") == 0) {
+        put_vex(insn, 1, 1, false, 0, 0, 0x6e, a.reg, &b);
+    } else {
+        error("アセンブルできない命令です: %s", op);
+    }
+}
+
+/* 関数 1 つ分のコードを機械語にする */
+void assemble_func(const char *name, int len, bool is_static, Code *code) {
+    symbols = realloc(symbols, (num_symbol + 1) * sizeof(Symbol));
+    Symbol *sym = &symbols[num_symbol];
+    num_symbol++;
+    sym->name = copy_string(name, len);
+    sym->is_static = is_static;
+    sym->begin = num_insn;
+    add_label(sym->name, num_insn);
+
+    for (int i = 0; i < code->num_line; i++) {
+        Line *line = &code->lines[i];
+        switch (line->kind) {
+        case LN_LABEL:
+            add_label(line->label, num_insn);
+            break;
+        case LN_COMMENT:
+            break;
+        default:
+            encode(line);
+            break;
+        }
+    }
+    sym->end = num_insn;
+}
+
+/* 関数のシンボルを探す。なければ NULL */
+static Symbol *find_symbol(const char *name) {
+    for (int i = 0; i < num_symbol; i++) {
+        if (strcmp(symbols[i].name, name) == 0) {
+            return &symbols[i];
+        }
+    }
+    return NULL;
+}
+
+/* 分岐先を探し、短くできる分岐を決める。
+   オブジェクト内の関数への call は、static なら直接、static でなければ
+   (他のオブジェクトの同名の関数に置き換えられるので) 再配置にする。
+ */
+static void resolve_branches(void) {
+    for (int i = 0; i < num_insn; i++) {
+        Insn *insn = &insns[i];
+        if (insn->branch == BR_NONE) {
+            continue;
+        }
+        Label *label = find_label(insn->target);
+        if (label->name != NULL) {
+            insn->target_insn = label->insn;
+        }
+        if (insn->branch == BR_CALL) {
+            Symbol *sym = find_symbol(insn->target);
+            insn->need_reloc = (sym == NULL) || (sym->is_static == false);
+        } else if (insn->target_insn < 0) {
+            if (insn->branch == BR_JCC) {
+                error("ラベル %s が見つかりません。", insn->target);
+            }
+            insn->need_reloc = true;
+        } else {
+            insn->is_short = true;
+        }
+    }
+}
+
+/* 分岐のバイト数 */
+static int branch_len(Insn *insn) {
+    if (insn->is_short == true) {
+        return 2;
+    }
+    return (insn->branch == BR_JCC) ? 6 : 5;
+}
+
+/* 命令のオフセットを求める */
+static int layout_insns(void) {
+    int offset = 0;
+    for (int i = 0; i < num_insn; i++) {
+        Insn *insn = &insns[i];
+        insn->offset = offset;
+        offset += (insn->branch == BR_NONE) ? insn->len : branch_len(insn);
+    }
+    return offset;
+}
+
+/* 命令 i のオフセット。i が末尾なら .text の大きさ */
+static int insn_offset(int i, int size) {
+    return (i < num_insn) ? insns[i].offset : size;
+}
+
+/* 分岐の長さを決める。届かない短い分岐を長くし、変化がなくなるまで繰り返す */
+static int relax_branches(void) {
+    bool changed = true;
+    int size = 0;
+    while (changed == true) {
+        changed = false;
+        size = layout_insns();
+        for (int i = 0; i < num_insn; i++) {
+            Insn *insn = &insns[i];
+            if (insn->is_short == false) {
+                continue;
+            }
+            int disp = insn_offset(insn->target_insn, size)
+                       - (insn->offset + 2);
+            if (is_imm8(disp) == false) {
+                insn->is_short = false;
+                changed = true;
+            }
+        }
+    }
+    return size;
+}
+
+/* 出力するオブジェクトファイル */
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} Buf;
+
+/* バイト列を追加する */
+static void buf_write(Buf *buf, const void *data, size_t len) {
+    if (buf->len + len > buf->cap) {
+        while (buf->len + len > buf->cap) {
+            buf->cap = (buf->cap == 0) ? 4096 : buf->cap * 2;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+/* align バイト境界まで 0 を詰める */
+static void buf_align(Buf *buf, size_t align) {
+    static const uint8_t zero[16] = {0};
+    buf_write(buf, zero, (align - buf->len % align) % align);
+}
+
+/* 文字列表に追加し、その位置を返す */
+static uint32_t add_string(Buf *strtab, const char *s) {
+    uint32_t pos = strtab->len;
+    buf_write(strtab, s, strlen(s) + 1);
+    return pos;
+}
+
+/* 外部のシンボル */
+typedef struct {
+    char **names;
+    int num;
+} Externs;
+
+/* 外部のシンボルの番号。なければ追加する */
+static int extern_index(Externs *ext, const char *name) {
+    for (int i = 0; i < ext->num; i++) {
+        if (strcmp(ext->names[i], name) == 0) {
+            return i;
+        }
+    }
+    ext->names = realloc(ext->names, (ext->num + 1) * sizeof(char *));
+    ext->names[ext->num] = (char *)name;
+    ext->num++;
+    return ext->num - 1;
+}
+
+/* 外部の関数へ飛ぶ間接ジャンプ (jmp [rip+0] と 8 バイトのアドレス) の
+   バイト数 */
+#define STUB_SIZE 14
+
+/* オブジェクトファイルのセクション */
+enum { SEC_NULL, SEC_TEXT, SEC_RELA, SEC_RODATA, SEC_RELA_RODATA, SEC_SYMTAB,
+       SEC_STRTAB, SEC_SHSTRTAB, SEC_NOTE, NUM_SEC };
+
+/* シンボル表の .text・.rodata のセクションシンボルの番号 */
+#define SYM_TEXT (1)
+#define SYM_RODATA (2)
+
+/* イメージでの、ジャンプテーブルの先頭のオフセット */
+static int rodata_offset(int size) {
+    return (size + 3) / 4 * 4;
+}
+
+/* rip 相対でジャンプテーブルを参照する命令の、末尾 4 バイトの変位を
+   埋める。rela が NULL ならイメージ内の変位、そうでなければ再配置にする。
+ */
+static void put_data_ref(Insn *code, Buf *rela, int size) {
+    Table *table = find_table(code->data);
+    int end = code->offset + code->len;
+    code->len -= 4;
+    if (rela == NULL) {
+        put_le(code, (uint32_t)(rodata_offset(size) + table->offset - end), 4);
+        return;
+    }
+    Elf64_Rela r = {
+        .r_offset = end - 4,
+        .r_info = ELF64_R_INFO(SYM_RODATA, R_X86_64_PC32),
+        .r_addend = table->offset - 4,
+    };
+    buf_write(rela, &r, sizeof(r));
+    put_le(code, 0, 4);
+}
+
+/* .text の機械語と再配置を作る。rela が NULL ならイメージを作り、
+   再配置の代わりに、関数か末尾の間接ジャンプへの変位を埋める。
+ */
+static void build_text(Buf *text, Buf *rela, Externs *ext, int size) {
+    int *sym_index = calloc(num_symbol + 1, sizeof(int));
+    int stubs = rodata_offset(size) + rodata_size;
+
+    // シンボル表の並び: NULL, .text, .rodata, static な関数, 他の関数,
+    // 外部のシンボル
+    int n = SYM_RODATA + 1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < num_symbol; i++) {
+            if (symbols[i].is_static == (pass == 0)) {
+                sym_index[i] = n;
+                n++;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_insn; i++) {
+        Insn *insn = &insns[i];
+        if (insn->branch == BR_NONE) {
+            Insn code = *insn;
+            if (insn->data != NULL) {
+                put_data_ref(&code, rela, size);
+            }
+            buf_write(text, code.bytes, code.len);
+            continue;
+        }
+
+        Insn code = {0};
+        if (insn->branch == BR_CALL) {
+            put8(&code, 0xe8);
+        } else if (insn->branch == BR_JMP) {
+            put8(&code, (insn->is_short == true) ? 0xeb : 0xe9);
+        } else if (insn->is_short == true) {
+            put8(&code, 0x70 + insn->cc);
+        } else {
+            put8(&code, 0x0f);
+            put8(&code, 0x80 + insn->cc);
+        }
+        int end = insn->offset + branch_len(insn);
+        if ((insn->need_reloc == true) && (rela == NULL)) {
+            Symbol *sym = find_symbol(insn->target);
+            int dest = (sym != NULL)
+                           ? insn_offset(sym->begin, size)
+                           : stubs + STUB_SIZE * extern_index(ext, insn->target);
+            put_le(&code, (uint32_t)(dest - end), 4);
+        } else if (insn->need_reloc == true) {
+            Symbol *sym = find_symbol(insn->target);
+            int index = (sym != NULL)
+                            ? sym_index[sym - symbols]
+                            : n + extern_index(ext, insn->target);
+            Elf64_Rela r = {
+                .r_offset = insn->offset + code.len,
+                .r_info = ELF64_R_INFO(index, R_X86_64_PLT32),
+                .r_addend = -4,
+            };
+            buf_write(rela, &r, sizeof(r));
+            put_le(&code, 0, 4);
+        } else if (insn->is_short == true) {
+            put8(&code, insn_offset(insn->target_insn, size) - end);
+        } else {
+            put_le(&code, (uint32_t)(insn_offset(insn->target_insn, size) - end), 4);
+        }
+        buf_write(text, code.bytes, code.len);
+    }
+    free(sym_index);
+}
+
+/* ジャンプテーブルを作る。要素は飛び先とテーブルの先頭の差。
+   rela が NULL ならイメージ内の差を埋め、そうでなければ .text への
+   再配置にする。
+ */
+static void build_rodata(Buf *rodata, Buf *rela, int size) {
+    for (int i = 0; i < num_table; i++) {
+        Table *table = &tables[i];
+        for (int j = 0; j < table->num_target; j++) {
+            Label *label = find_label(table->targets[j]);
+            if (label->name == NULL) {
+                error("ラベル %s が見つかりません。", table->targets[j]);
+            }
+            int target = insn_offset(label->insn, size);
+            int32_t val = 0;
+            if (rela == NULL) {
+                val = target - (rodata_offset(size) + table->offset);
+            } else {
+                Elf64_Rela r = {
+                    .r_offset = table->offset + 4 * j,
+                    .r_info = ELF64_R_INFO(SYM_TEXT, R_X86_64_PC32),
+                    .r_addend = target + 4 * j,
+                };
+                buf_write(rela, &r, sizeof(r));
+            }
+            buf_write(rodata, &val, sizeof(val));
+        }
+    }
+}
+
+/* シンボル表を作る */
+static int build_symtab(Buf *symtab, Buf *strtab, Externs *ext, int size) {
+    Elf64_Sym null = {0};
+    buf_write(symtab, &null, sizeof(null));
+    Elf64_Sym section = {
+        .st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION),
+        .st_shndx = SEC_TEXT,
+    };
+    buf_write(symtab, &section, sizeof(section));
+    section.st_shndx = SEC_RODATA;
+    buf_write(symtab, &section, sizeof(section));
+
+    int first_global = SYM_RODATA + 1;
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < num_symbol; i++) {
+            Symbol *sym = &symbols[i];
+            if (sym->is_static != (pass == 0)) {
+                continue;
+            }
+            int begin = insn_offset(sym->begin, size);
+            Elf64_Sym s = {
+                .st_name = add_string(strtab, sym->name),
+                .st_info = ELF64_ST_INFO(
+                    (sym->is_static == true) ? STB_LOCAL : STB_GLOBAL,
+                    STT_FUNC),
+                .st_shndx = SEC_TEXT,
+                .st_value = begin,
+                .st_size = insn_offset(sym->end, size) - begin,
+            };
+            buf_write(symtab, &s, sizeof(s));
+            if (sym->is_static == true) {
+                first_global++;
+            }
+        }
+    }
+    for (int i = 0; i < ext->num; i++) {
+        Elf64_Sym s = {
+            .st_name = add_string(strtab, ext->names[i]),
+            .st_info = ELF64_ST_INFO(STB_GLOBAL, STT_NOTYPE),
+            .st_shndx = SHN_UNDEF,
+        };
+        buf_write(symtab, &s, sizeof(s));
+    }
+    return first_global;
+}
+
+/* 機械語にしたプログラム全体を ELF64 の再配置可能オブジェクトにする */
+char *assemble_object(size_t *size) {
+    Buf text = {0};
+    Buf rela = {0};
+    Buf rodata = {0};
+    Buf rela_rodata = {0};
+    Buf symtab = {0};
+    Buf strtab = {0};
+    Buf shstrtab = {0};
+    Externs ext = {NULL, 0};
+
+    resolve_branches();
+    int text_size = relax_branches();
+    build_text(&text, &rela, &ext, text_size);
+    build_rodata(&rodata, &rela_rodata, text_size);
+    buf_write(&strtab, "", 1);
+    int first_global = build_symtab(&symtab, &strtab, &ext, text_size);
+
+    // セクション: NULL, .text, .rela.text, .rodata, .rela.rodata, .symtab,
+    // .strtab, .shstrtab, .note.GNU-stack
+    Elf64_Shdr shdr[NUM_SEC];
+    memset(shdr, 0, sizeof(shdr));
+    buf_write(&shstrtab, "", 1);
+    shdr[SEC_TEXT].sh_name = add_string(&shstrtab, ".text");
+    shdr[SEC_RELA].sh_name = add_string(&shstrtab, ".rela.text");
+    shdr[SEC_RODATA].sh_name = add_string(&shstrtab, ".rodata");
+    shdr[SEC_RELA_RODATA].sh_name = add_string(&shstrtab, ".rela.rodata");
+    shdr[SEC_SYMTAB].sh_name = add_string(&shstrtab, ".symtab");
+    shdr[SEC_STRTAB].sh_name = add_string(&shstrtab, ".strtab");
+    shdr[SEC_SHSTRTAB].sh_name = add_string(&shstrtab, ".shstrtab");
+    shdr[SEC_NOTE].sh_name = add_string(&shstrtab, ".note.GNU-stack");
+
+    Buf obj = {0};
+    Elf64_Ehdr ehdr = {
+        .e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64,
+                    ELFDATA2LSB, EV_CURRENT, ELFOSABI_SYSV},
+        .e_type = ET_REL,
+        .e_machine = EM_X86_64,
+        .e_version = EV_CURRENT,
+        .e_ehsize = sizeof(Elf64_Ehdr),
+        .e_shentsize = sizeof(Elf64_Shdr),
+        .e_shnum = NUM_SEC,
+        .e_shstrndx = SEC_SHSTRTAB,
+    };
+    buf_write(&obj, &ehdr, sizeof(ehdr));
+
+    // 各セクションの中身
+    struct {
+        int sec;
+        Buf *buf;
+        uint32_t type;
+        uint64_t flags;
+        uint64_t align;
+        uint64_t entsize;
+    } contents[] = {
+        {SEC_TEXT, &text, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, 16, 0},
+        {SEC_RELA, &rela, SHT_RELA, SHF_INFO_LINK, 8, sizeof(Elf64_Rela)},
+        {SEC_RODATA, &rodata, SHT_PROGBITS, SHF_ALLOC, 4, 0},
+        {SEC_RELA_RODATA,
+         &rela_rodata,
+         SHT_RELA,
+         SHF_INFO_LINK,
+         8,
+         sizeof(Elf64_Rela)},
+        {SEC_SYMTAB, &symtab, SHT_SYMTAB, 0, 8, sizeof(Elf64_Sym)},
+        {SEC_STRTAB, &strtab, SHT_STRTAB, 0, 1, 0},
+        {SEC_SHSTRTAB, &shstrtab, SHT_STRTAB, 0, 1, 0},
+    };
+    for (int i = 0; i < (int)(sizeof(contents) / sizeof(contents[0])); i++) {
+        Elf64_Shdr *sh = &shdr[contents[i].sec];
+        buf_align(&obj, contents[i].align);
+        sh->sh_type = contents[i].type;
+        sh->sh_flags = contents[i].flags;
+        sh->sh_offset = obj.len;
+        sh->sh_size = contents[i].buf->len;
+        sh->sh_addralign = contents[i].align;
+        sh->sh_entsize = contents[i].entsize;
+        buf_write(&obj, contents[i].buf->data, contents[i].buf->len);
+    }
+    shdr[SEC_RELA].sh_link = SEC_SYMTAB;
+    shdr[SEC_RELA].sh_info = SEC_TEXT;
+    shdr[SEC_RELA_RODATA].sh_link = SEC_SYMTAB;
+    shdr[SEC_RELA_RODATA].sh_info = SEC_RODATA;
+    shdr[SEC_SYMTAB].sh_link = SEC_STRTAB;
+    shdr[SEC_SYMTAB].sh_info = first_global;
+    shdr[SEC_NOTE].sh_type = SHT_PROGBITS;
+    shdr[SEC_NOTE].sh_offset = obj.len;
+    shdr[SEC_NOTE].sh_addralign = 1;
+
+    // セクションヘッダ
+    buf_align(&obj, 8);
+    ((Elf64_Ehdr *)obj.data)->e_shoff = obj.len;
+    buf_write(&obj, shdr, sizeof(shdr));
+
+    free(text.data);
+    free(rela.data);
+    free(rodata.data);
+    free(rela_rodata.data);
+    free(symtab.data);
+    free(strtab.data);
+    free(shstrtab.data);
+    *size = obj.len;
+    return (char *)obj.data;
+}
+
+/* 機械語にしたプログラム全体を、このプロセスで実行できるイメージにする。
+   .text の後ろにジャンプテーブルを置く。外部の関数は resolve でアドレスを
+   引き、イメージの末尾に置いた間接ジャンプを経由して呼ぶ。イメージは
+   置く位置に依存しない。
+ */
+char *assemble_image(void *(*resolve)(const char *name), size_t *size) {
+    static const uint8_t jmp[] = {0xff, 0x25, 0x00, 0x00, 0x00, 0x00};
+    Buf text = {0};
+    Externs ext = {NULL, 0};
+
+    resolve_branches();
+    int text_size = relax_branches();
+    build_text(&text, NULL, &ext, text_size);
+    buf_align(&text, 4);
+    build_rodata(&text, NULL, text_size);
+    for (int i = 0; i < ext.num; i++) {
+        void *addr = resolve(ext.names[i]);
+        if (addr == NULL) {
+            error("関数 %s が見つかりません。", ext.names[i]);
+        }
+        uint64_t value = (uint64_t)(uintptr_t)addr;
+        buf_write(&text, jmp, sizeof(jmp));
+        buf_write(&text, &value, sizeof(value));
+    }
+    free(ext.names);
+    *size = text.len;
+    return (char *)text.data;
+}
+
+/* 関数ごとの .text のバイト数を出力する (-fsize-report)。
+   分岐の長さを決めてから、シンボルの先頭と末尾のオフセットの差を求める。
+ */
+void print_text_sizes(FILE *fp) {
+    resolve_branches();
+    int size = relax_branches();
+    for (int i = 0; i < num_symbol; i++) {
+        fprintf(fp,
+                "size: %6d %s\n",
+                insn_offset(symbols[i].end, size)
+                    - insn_offset(symbols[i].begin, size),
+                symbols[i].name);
+    }
+    fprintf(fp, "size: %6d total\n", size);
+}
+
+/* 関数のイメージ内でのオフセット。なければ -1 */
+long symbol_offset(const char *name) {
+    Symbol *sym = find_symbol(name);
+    if (sym == NULL) {
+        return -1;
+    }
+    return insn_offset(sym->begin, layout_insns());
+}
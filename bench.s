@@ -0,0 +1,45 @@
+.intel_syntax noprefix
+.global fib
+fib:
+    nop
+    push rbp
+    mov rbp, rsp
+    sub rsp, 16
+    mov [rbp-8], rbx
+    movsxd rbx, edi
+    cmp ebx, 2
+    jge .Lend0
+    mov edi, ebx
+    mov rbx, [rbp-8]
+    mov rax, rdi
+    mov rsp, rbp
+    pop rbp
+    ret
+.Lend0:
+    mov edi, ebx
+    sub edi, 1
+    call fib
+    mov rdi, rax
+    push rdi
+    mov edi, ebx
+    sub edi, 2
+    sub rsp, 8
+    call fib
+    add rsp, 8
+    mov rsi, rax
+    pop rdi
+    mov rbx, [rbp-8]
+    add edi, esi
+    mov rax, rdi
+    mov rsp, rbp
+    pop rbp
+    ret
+.global main
+main:
+    nop
+    push rbp
+    mov rbp, rsp
+    mov edi, 55
+    mov rsp, rbp
+    pop rbp
+    jmp func1
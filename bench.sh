@@ -0,0 +1,327 @@
+#!/bin/bash
+
+# プログラムをアセンブルして .text のバイト数を出力する
+text_size() {
+    options="$1"
+    input="$2"
+
+    ./9cc $options "$input" > bench.s || exit 1
+    gcc -c -o bench.o bench.s || exit 1
+    size -A bench.o | awk '$1 == ".text" { print $2 }'
+}
+
+# プログラムをコンパイルして実行し、実行時間 (ミリ秒) を出力する
+run_time() {
+    options="$1"
+    input="$2"
+
+    ./9cc $options "$input" > bench.s || exit 1
+    gcc -o bench bench.s test.c || exit 1
+    start=$(date +%s%N)
+    ./bench
+    end=$(date +%s%N)
+    echo $(((end - start) / 1000000))
+}
+
+# 不要コード削除で減った .text のバイト数
+bench_dce() {
+    echo "== dce: .text bytes (-fno-dce => default) =="
+
+    programs=(
+        "int main(){ int a; int b; a = 1; b = 2; a + b; a * b; if (0) { a = func1(a); } return b; }"
+        "static int dbg(int x){ return func1(x); } static int trace(int x){ return dbg(x) + dbg(x); } int main(){ int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) { s = s + i; if (0) trace(s); } return s; }"
+        "int f(int x){ if (x < 0) { return 0; func0(); x = 1; } return x; x = x + 1; } int main(){ int t; t = f(3); t = f(4); return f(5); }"
+    )
+    total_before=0
+    total_after=0
+    for input in "${programs[@]}"; do
+        before=$(text_size -fno-dce "$input")
+        after=$(text_size "" "$input")
+        total_before=$((total_before + before))
+        total_after=$((total_after + after))
+        echo "$before => $after ($((before - after)) bytes saved): $input"
+    done
+    echo "total: $total_before => $total_after ($((total_before - total_after)) bytes saved)"
+}
+
+# 定数除算: idiv と、乗算とシフトへの置き換えの比較
+bench_div() {
+    echo "== div: x / 7 + x % 7, 100M iterations (idiv => constant) =="
+
+    loop="int i; int s; s = 0; for (i = 0; i < 100000000; i = i + 1) s = s + i / DIV + i % DIV; return s;"
+    variable=$(run_time "" "int main(){ int d; d = 7; ${loop//DIV/d} }")
+    constant=$(run_time "" "int main(){ ${loop//DIV/7} }")
+    echo "$variable ms => $constant ms"
+}
+
+# 基本ブロックの配置: 静的なジャンプ命令の数と実行時間の比較
+bench_layout() {
+    echo "== layout: jumps and run time (-fno-layout => default) =="
+
+    input="int f(int x){ if (x < 10) { if (x < 5) return 1; return 2; } else if (x < 20) return 3; return 4; } int main(){ int i; int j; int s; s = 0; for (i = 0; i < 20000; i = i + 1) { j = 0; while (j < 10000) { if (j % 2 == 0) s = s + 1; else s = s + f(j); j = j + 1; } } return s; }"
+    for options in -fno-layout ""; do
+        ./9cc $options "$input" > bench.s || exit 1
+        jumps=$(grep -cE '^\s+j' bench.s)
+        echo "${options:-default}: $jumps jumps, $(run_time "$options" "$input") ms"
+    done
+}
+
+# ループのベクトル化: スカラー、SSE2、AVX2 の実行時間の比較
+bench_vec() {
+    echo "== vec: d[k] = a[k] + b[k] - 1, 4096 elements x 20000 (scalar => sse2 => avx2) =="
+
+    input="int main(){ int *a; int *b; int *d; int i; int n; int r; n = 4096; a = alloc_seq(4096, 1); b = alloc_seq(4096, 2); d = alloc_seq(4096, 0); r = 0; while (r < 20000) { for (i = 0; i < n; i = i + 1) *(d + i) = *(a + i) + *(b + i) - 1; r = r + 1; } return sum_array(d, 4096) == 2*4096*4097/2; }"
+    scalar=$(run_time -fno-vectorize "$input")
+    sse2=$(run_time -march=x86-64 "$input")
+    avx2=$(run_time -march=x86-64-v3 "$input")
+    echo "$scalar ms => $sse2 ms => $avx2 ms"
+}
+
+# 式のコード生成: 静的な命令数と実行時間。
+# 環境変数 BASELINE に別の 9cc を指定すると、それと比較する。
+bench_regs() {
+    echo "== regs: instructions and run time (${BASELINE:+$BASELINE => }./9cc) =="
+
+    programs=(
+        "int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(32) % 256; }"
+        "int main(){ int i; int s; int a; int b; s = 0; a = 3; b = 5; for (i = 0; i < 100000000; i = i + 1) s = s + (i * a + b) * (i - b) - (a * b + i) % 7; return s % 256; }"
+        "int poly(int x, int y){ return (x * x + y) * (x - y * 3) + (x + 1) * (y + 2) * (x + y); } int main(){ int i; int s; s = 0; for (i = 0; i < 50000000; i = i + 1) s = s + poly(i, i + 1); return s % 256; }"
+    )
+    for input in "${programs[@]}"; do
+        for compiler in $BASELINE ./9cc; do
+            $compiler "$input" > bench.s || exit 1
+            insns=$(grep -cE '^\s+[a-z]' bench.s)
+            gcc -o bench bench.s test.c || exit 1
+            start=$(date +%s%N)
+            ./bench
+            end=$(date +%s%N)
+            echo "$compiler: $insns insns, $(((end - start) / 1000000)) ms: ${input:0:48}..."
+        done
+    done
+}
+
+# スタックフレーム: 変数の多い関数を呼び出すプログラムの、
+# プロローグと呼び出しの命令数と実行時間 (インライン展開なし)。
+# 環境変数 BASELINE に別の 9cc を指定すると、それと比較する。
+bench_frame() {
+    echo "== frame: instructions and run time of calls (${BASELINE:+$BASELINE => }./9cc => ./9cc -fomit-frame-pointer) =="
+
+    input="int f(int a, int b){ int c; int d; int e; int g; int h; int k; c = a + b; d = c * 3; e = d - a; g = e + c; h = g * 2; k = h - d; return k + e + g; } int main(){ int i; int s; s = 0; for (i = 0; i < 50000000; i = i + 1) s = s + f(i, s) % 7; return s % 256; }"
+    for compiler in $BASELINE "./9cc" "./9cc -fomit-frame-pointer"; do
+        $compiler -finline-limit=0 "$input" > bench.s || exit 1
+        insns=$(grep -cE '^\s+[a-z]' bench.s)
+        gcc -o bench bench.s test.c || exit 1
+        start=$(date +%s%N)
+        ./bench
+        end=$(date +%s%N)
+        echo "$compiler: $insns insns, $(((end - start) / 1000000)) ms"
+    done
+}
+
+# スタックスロットの共有: スタックフレームのバイト数の合計
+bench_slots() {
+    echo "== slots: frame bytes (-fno-stack-reuse => default) =="
+
+    programs=(
+        "int f(int x){ int y; int *p; p = &y; *p = x * 2; return y + 1; } int main(){ int s; s = f(1) + f(2) + f(3) + f(4) + f(5) + f(6) + f(7) + f(8); return s; }"
+        "int main(){ int s; s = 0; { int a; int *p; p = &a; a = 1; s = s + *p; } { int b; int *q; q = &b; b = 2; s = s + *q; } if (s == 3) { int c; int *r; r = &c; c = 4; s = s + *r; } else { int d; int *t; t = &d; d = 100; s = s + *t; } return s; }"
+    )
+    for input in "${programs[@]}"; do
+        before=$(./9cc -fno-stack-reuse "$input" | awk '/sub rsp/ { s += $3 } END { print s + 0 }')
+        after=$(./9cc "$input" | awk '/sub rsp/ { s += $3 } END { print s + 0 }')
+        echo "$before => $after: ${input:0:48}..."
+    done
+}
+
+# int の大きさ: スタックフレームのバイト数の合計と、除算の多いループの実行時間。
+# 環境変数 BASELINE に別の 9cc を指定すると、それと比較する。
+bench_int() {
+    echo "== int: frame bytes and run time (${BASELINE:+$BASELINE => }./9cc) =="
+
+    input="int set(int *p, int v){ *p = v; return 0; } int f(int a){ int c; int d; int e; int g; int h; int k; set(&c, a / 7); set(&d, a % 5); set(&e, a * 3); set(&g, c - d); set(&h, e / 9); set(&k, g + h); return c + d + e + g + h + k; } int main(){ int i; int s; s = 0; for (i = 0; i < 20000000; i = i + 1) s = s + f(i) % 7; return s % 256; }"
+    for compiler in $BASELINE ./9cc; do
+        $compiler -finline-limit=0 "$input" > bench.s || exit 1
+        bytes=$(awk '/sub rsp/ { s += $3 } END { print s + 0 }' bench.s)
+        gcc -o bench bench.s test.c || exit 1
+        start=$(date +%s%N)
+        ./bench
+        end=$(date +%s%N)
+        echo "$compiler: $bytes frame bytes, $(((end - start) / 1000000)) ms"
+    done
+}
+
+# switch: 256 個の case への振り分けの実行時間 (if の連鎖 => switch)。
+# 連続した case はジャンプテーブル、間隔の空いた case は二分探索になる
+bench_switch() {
+    echo "== switch: 256-way dispatch, 20M calls (if chain => switch) =="
+
+    for step in 1 1000; do
+        cases=""
+        chain=""
+        for k in $(seq 0 255); do
+            cases+="case $((k * step)): return $((k * 37 % 101)); "
+            chain+="if (x == $((k * step))) return $((k * 37 % 101)); "
+        done
+        main="int main(){ int i; int s; s = 0; for (i = 0; i < 20000000; i = i + 1) s = s + f(i * 7 % 256 * $step); return s % 256; }"
+        chain_ms=$(run_time -finline-limit=0 "int f(int x){ $chain return 0; } $main")
+        switch_ms=$(run_time -finline-limit=0 "int f(int x){ switch (x) { $cases} return 0; } $main")
+        echo "case step $step: $chain_ms ms => $switch_ms ms"
+    done
+}
+
+# 組み込み関数: 1 のビットの数の合計 (ループで数える => __builtin_popcount)。
+# -march=x86-64 ではビット演算で数え、x86-64-v2 からは popcnt を使う
+bench_builtin() {
+    echo "== builtin: popcount of 50M values (loop => x86-64 => x86-64-v2) =="
+
+    main="int main(){ int i; int s; s = 0; for (i = 0; i < 50000000; i = i + 1) s = s + POPCOUNT(i); return s % 256; }"
+    loop="int bits(int x){ int n; n = 0; while (x != 0) { n = n + x % 2; x = x / 2; } return n; } ${main//POPCOUNT/bits}"
+    builtin="${main//POPCOUNT/__builtin_popcount}"
+    loop_ms=$(run_time "" "$loop")
+    bits_ms=$(run_time -march=x86-64 "$builtin")
+    popcnt_ms=$(run_time -march=x86-64-v2 "$builtin")
+    echo "$loop_ms ms => $bits_ms ms => $popcnt_ms ms"
+}
+
+# 呼び出し規約: 引数の多い関数呼び出しの、静的な mov 命令数と実行時間
+# (インライン展開なし)。
+# 環境変数 BASELINE に別の 9cc を指定すると、それと比較する。
+bench_conv() {
+    echo "== conv: movs and run time of calls (${BASELINE:+$BASELINE => }./9cc) =="
+
+    programs=(
+        "static int mix(int a, int b, int c, int d, int e){ return a * b + c - d * e; } int main(){ int i; int s; s = 0; for (i = 0; i < 100000000; i = i + 1) s = s + mix(i, s, i + 1, s % 7, 3); return s % 256; }"
+        "int pick(int k, int a, int b, int unused){ if (k % 3 == 0) return a; return b; } int main(){ int i; int s; s = 0; for (i = 0; i < 100000000; i = i + 1) s = s + pick(i, s, i, 42); return s % 256; }"
+    )
+    for input in "${programs[@]}"; do
+        for compiler in $BASELINE ./9cc; do
+            $compiler -finline-limit=0 "$input" > bench.s || exit 1
+            movs=$(grep -cE '^\s+mov ' bench.s)
+            gcc -o bench bench.s test.c || exit 1
+            start=$(date +%s%N)
+            ./bench
+            end=$(date +%s%N)
+            echo "$compiler: $movs movs, $(((end - start) / 1000000)) ms: ${input:0:48}..."
+        done
+    done
+}
+
+# コードの大きさ: .text のバイト数 (default => -Os)
+bench_size() {
+    echo "== size: .text bytes (default => -Os) =="
+
+    programs=(
+        "int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(10); }"
+        "static int mix(int a, int b, int c, int d, int e){ if (a < 0) return -1; if (b > 100) return 100; return a * b + c - d * e; } int main(){ int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) s = s + mix(i, s % 7, 3, func1(5), 2) + mix(s, i, 1, 2, 3); return s % 256; }"
+        "$(big_program)"
+    )
+    total_before=0
+    total_after=0
+    for input in "${programs[@]}"; do
+        before=$(text_size "" "$input")
+        after=$(text_size -Os "$input")
+        total_before=$((total_before + before))
+        total_after=$((total_after + after))
+        echo "$before => $after ($((before - after)) bytes saved): ${input:0:48}..."
+    done
+    echo "total: $total_before => $total_after ($((total_before - total_after)) bytes saved)"
+}
+
+# 命令スケジューリング: 見積もりのサイクル数と実行時間
+# (-fno-schedule-insns => default)
+bench_sched() {
+    echo "== sched: estimated cycles and run time (-fno-schedule-insns => default) =="
+
+    programs=(
+        "int f(int *p, int a, int b){ int x; int y; x = *p / a; y = *(p + 1) * b; return x + y * 3 + a * b; } int main(){ int *p; int i; int s; p = alloc_seq(2, 40); s = 0; for (i = 1; i < 50000000; i = i + 1) s = s + f(p, i, s); return s % 256; }"
+        "int poly(int x, int y){ return (x * x + y) * (x - y * 3) + (x + 1) * (y + 2) * (x + y); } int main(){ int i; int s; s = 0; for (i = 0; i < 50000000; i = i + 1) s = s + poly(i, s % 9); return s % 256; }"
+    )
+    for input in "${programs[@]}"; do
+        cycles=$(./9cc -fsched-stats "$input" 2>&1 > /dev/null | awk '$6 == "total" { print $2 " => " $4 }')
+        before=$(run_time -fno-schedule-insns "$input")
+        after=$(run_time "" "$input")
+        echo "$cycles cycles, $before ms => $after ms: ${input:0:48}..."
+    done
+}
+
+# 関数を 300 個持つ大きなプログラム
+big_program() {
+    for i in $(seq 300); do
+        echo -n "int f$i(int a, int b){ int c; c = a * $i + b / 7; while (c < a) { c = c + b % 3; if (c == $i) return a - b; } return c * (a + b) - (a - b) * $i; } "
+    done
+    echo "int main(){ return f1(1, 2); }"
+}
+
+# アセンブリの出力速度: 出力したバイト数 / コンパイル時間
+# 環境変数 BASELINE に別の 9cc を指定すると、それと比較する。
+bench_emit() {
+    echo "== emit: assembly output throughput (${BASELINE:+$BASELINE => }./9cc => ./9cc -fverbose-asm) =="
+
+    input=$(big_program)
+    for compiler in $BASELINE "./9cc" "./9cc -fverbose-asm"; do
+        $compiler "$input" > bench.s || exit 1
+        bytes=$(wc -c < bench.s)
+        start=$(date +%s%N)
+        for i in $(seq 20); do
+            $compiler "$input" > /dev/null
+        done
+        end=$(date +%s%N)
+        ns=$(((end - start) / 20))
+        echo "$compiler: $bytes bytes, $((ns / 1000)) us, $((bytes * 1000 / ns)) MB/s"
+    done
+}
+
+# 覗き穴最適化: 静的な命令数と、パターンごとの書き換えの回数
+bench_peephole() {
+    echo "== peephole: instructions (-fno-peephole => default) =="
+
+    input="int f(int a, int b){ int c; int *p; c = a; p = &c; *p = *p + b; a = c; c = a; return c * 1 + 0; } int main(){ int i; int s; s = 0; for (i = 0; i < 100; i = i + 1) { s = f(s, i) % 1000; if (s == 0) s = 1; } return s; }"
+    before=$(./9cc -fno-peephole "$input" | grep -cE '^\s+[a-z]')
+    after=$(./9cc "$input" | grep -cE '^\s+[a-z]')
+    echo "$before => $after"
+    ./9cc -fpeephole-stats "$input" > /dev/null
+}
+
+# 内蔵アセンブラ: 9cc + as と 9cc -c のオブジェクトファイルまでの時間
+bench_asm() {
+    echo "== asm: time to an object file, 20 runs (9cc + as => 9cc -c) =="
+
+    input=$(big_program)
+    start=$(date +%s%N)
+    for i in $(seq 20); do
+        ./9cc "$input" > bench.s && as -o bench.o bench.s
+    done
+    middle=$(date +%s%N)
+    for i in $(seq 20); do
+        ./9cc -c "$input" > bench.o
+    done
+    end=$(date +%s%N)
+    echo "$(((middle - start) / 20000)) us => $(((end - middle) / 20000)) us"
+}
+
+# --run: 1 つのテストの実行までの時間 (コンパイル・リンクして実行 => --run)
+bench_run() {
+    echo "== run: per-test latency, 20 runs (9cc + gcc + ./bench => 9cc --run) =="
+
+    input="int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return func1(fib(10)); }"
+    gcc -c -o test.o test.c || exit 1
+    gcc -shared -fPIC -o libtest.so test.c || exit 1
+    start=$(date +%s%N)
+    for i in $(seq 20); do
+        ./9cc "$input" > bench.s && gcc -o bench bench.s test.o && ./bench
+    done > /dev/null 2>&1
+    middle=$(date +%s%N)
+    for i in $(seq 20); do
+        ./9cc --run --run-lib=./libtest.so "$input"
+    done > /dev/null
+    end=$(date +%s%N)
+    echo "$(((middle - start) / 20000)) us => $(((end - middle) / 20000)) us"
+}
+
+benches="$@"
+if [ -z "$benches" ]; then
+    benches="dce div layout vec regs frame slots int switch builtin conv size sched emit peephole asm run"
+fi
+for bench in $benches; do
+    bench_$bench
+done
@@ -0,0 +1,109 @@
+/* 組み込み関数
+
+   次の関数は、関数呼び出し (ND_FUNC) の形のままパースし、呼び出す代わりに
+   命令を直接生成する。引数がすべて定数なら、コンパイル時に値を求める。
+
+   - __builtin_popcount(x): 1 のビットの数 (popcnt、なければビット演算)
+   - __builtin_clz(x): 上位から続く 0 のビットの数 (lzcnt、なければ bsr)
+   - __builtin_ctz(x): 下位から続く 0 のビットの数 (tzcnt、なければ bsf)
+   - __builtin_bswap32(x) / __builtin_bswap64(x): バイト順の反転 (bswap)
+   - __builtin_prefetch(p, rw, locality): p をキャッシュに読み込む
+     (prefetcht0 など)。値は 0
+   - __builtin_expect(x, c): 値は x。x が c になることが多いと分岐の配置に
+     伝える。c は定数
+   - __rdtsc(): タイムスタンプカウンタ (rdtsc)
+
+   clz と ctz の x が 0 のときの値は、GCC と同じく不定とする。
+ */
+#include "9cc.h"
+
+/* 組み込み関数の情報 */
+typedef struct {
+    const char *name;   // 関数名
+    BuiltinKind kind;   // 種類
+    int min_param;      // 引数の数の最小
+    int max_param;      // 引数の数の最大
+    Purity purity;      // 副作用。PURITY_NONE なら値を使わなくても消さない
+} Builtin;
+
+static const Builtin builtins[] = {
+    {"__builtin_popcount", BI_POPCOUNT, 1, 1, PURITY_PURE},
+    {"__builtin_clz", BI_CLZ, 1, 1, PURITY_PURE},
+    {"__builtin_ctz", BI_CTZ, 1, 1, PURITY_PURE},
+    {"__builtin_bswap32", BI_BSWAP32, 1, 1, PURITY_PURE},
+    {"__builtin_bswap64", BI_BSWAP64, 1, 1, PURITY_PURE},
+    {"__builtin_prefetch", BI_PREFETCH, 1, 3, PURITY_NONE},
+    {"__builtin_expect", BI_EXPECT, 2, 2, PURITY_PURE},
+    {"__rdtsc", BI_RDTSC, 0, 0, PURITY_NONE},
+};
+
+#define NUM_BUILTIN ((int)(sizeof(builtins) / sizeof(builtins[0])))
+
+/* 種類から組み込み関数の情報を探す */
+static const Builtin *builtin_info(BuiltinKind kind) {
+    for (int i = 0; i < NUM_BUILTIN; i++) {
+        if (builtins[i].kind == kind) {
+            return &builtins[i];
+        }
+    }
+    error("組み込み関数ではありません。");
+    return NULL;
+}
+
+/* 名前が組み込み関数なら、その種類を返す。違えば BI_NONE */
+BuiltinKind find_builtin(const char *name, int len) {
+    for (int i = 0; i < NUM_BUILTIN; i++) {
+        if (((int)strlen(builtins[i].name) == len)
+            && (memcmp(builtins[i].name, name, len) == 0)) {
+            return builtins[i].kind;
+        }
+    }
+    return BI_NONE;
+}
+
+/* 組み込み関数の引数の数の範囲 */
+void builtin_params(BuiltinKind kind, int *min, int *max) {
+    const Builtin *info = builtin_info(kind);
+    *min = info->min_param;
+    *max = info->max_param;
+}
+
+/* 組み込み関数の副作用 (引数を除く) */
+Purity builtin_purity(BuiltinKind kind) {
+    return builtin_info(kind)->purity;
+}
+
+/* 組み込み関数の値を定数の引数から求める。求められなければ false */
+bool eval_builtin(BuiltinKind kind, int64_t *args, int64_t *val) {
+    uint32_t x = (uint32_t)args[0];
+
+    switch (kind) {
+    case BI_POPCOUNT:
+        *val = __builtin_popcount(x);
+        return true;
+    case BI_CLZ:
+        if (x == 0) {
+            return false;
+        }
+        *val = __builtin_clz(x);
+        return true;
+    case BI_CTZ:
+        if (x == 0) {
+            return false;
+        }
+        *val = __builtin_ctz(x);
+        return true;
+    case BI_BSWAP32:
+        *val = (int32_t)__builtin_bswap32(x);
+        return true;
+    case BI_BSWAP64:
+        *val = (int64_t)__builtin_bswap64((uint64_t)args[0]);
+        return true;
+    case BI_EXPECT:
+        *val = args[0];
+        return true;
+    default:
+        // prefetch と rdtsc は実行時に行う
+        return false;
+    }
+}
@@ -1,4 +1,7 @@
+#include <errno.h>
+#include <inttypes.h>
 #include <stdarg.h>
+#include <unistd.h>
 #include "9cc.h"
 
 /* ラベルカウター */
@@ -6,179 +9,1757 @@ static int label_count = 0;
 
 static Node *cur_func = NULL;
 
+/* インライン展開中の関数のラベル番号。展開中でなければ -1 */
+static int inline_label = -1;
+
+/* break で抜けるループ・switch のラベル番号。なければ -1 */
+static int break_label = -1;
+
+/* プロローグの後に push して、まだ pop していない 8 バイトの個数。
+   スタックフレームの大きさは 16 の倍数なので、関数呼び出しで rsp を
+   16 の倍数に整えるには、これが奇数のときだけ 8 バイトずらせばよい。
+ */
+static int push_depth = 0;
+
+/* フレームポインタを省略するなら true。変数は rsp からのオフセットで
+   レッドゾーン (rsp の下 128 バイト) に置く。
+ */
+static bool omit_frame = false;
+
+/* レッドゾーンのバイト数 */
+#define RED_ZONE_SIZE 128
+
+/* 生成中のステートメントの値 (tmp_regs[0]) が使われるなら true。
+   値を使うのは、関数やインライン展開した本体の末尾に到達したときだけ。
+ */
+static bool value_used = true;
+
+/* 第1～6引数に使用するレジスタ */
+static const char *regs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+
+/* ローカル変数に割り当てる呼び出し先保存レジスタ (LVar の reg が添字) */
+static const char *var_regs[NUM_VAR_REG + 1]
+    = {NULL, "rbx", "r12", "r13", "r14", "r15"};
+
+/* 式の計算に使う一時レジスタの数 */
+#define NUM_TMP_REG (7)
+
+/* 式の計算に使う一時レジスタ (呼び出し元保存)。
+   深さ d の式の値を tmp_regs[d] に求める。rax と rdx は除算・乗算と
+   戻り値に使うので含めない。並びは引数レジスタへ順に移せるようにしてある。
+ */
+static const char *tmp_regs[NUM_TMP_REG]
+    = {"rdi", "rsi", "rcx", "r8", "r9", "r10", "r11"};
+
+/* 汎用レジスタの名前。添字はレジスタ番号 (機械語での番号) と、
+   大きさ 8・4・2・1 バイトの順
+ */
+static const char *reg_names[][4] = {
+    {"rax", "eax", "ax", "al"},      {"rcx", "ecx", "cx", "cl"},
+    {"rdx", "edx", "dx", "dl"},      {"rbx", "ebx", "bx", "bl"},
+    {"rsp", "esp", "sp", "spl"},     {"rbp", "ebp", "bp", "bpl"},
+    {"rsi", "esi", "si", "sil"},     {"rdi", "edi", "di", "dil"},
+    {"r8", "r8d", "r8w", "r8b"},     {"r9", "r9d", "r9w", "r9b"},
+    {"r10", "r10d", "r10w", "r10b"}, {"r11", "r11d", "r11w", "r11b"},
+    {"r12", "r12d", "r12w", "r12b"}, {"r13", "r13d", "r13w", "r13b"},
+    {"r14", "r14d", "r14w", "r14b"}, {"r15", "r15d", "r15w", "r15b"},
+};
+
+#define NUM_REG_NAME ((int)(sizeof(reg_names) / sizeof(reg_names[0])))
+
+/* レジスタの大きさ (バイト)。添字は reg_names の列 */
+static const int reg_sizes[] = {8, 4, 2, 1};
+
+/* 名前 (先頭 len バイト) がレジスタなら、その番号と *size にバイト数を
+   返す。違えば -1
+ */
+static int find_reg(const char *name, int len, int *size) {
+    for (int i = 0; i < NUM_REG_NAME; i++) {
+        for (int n = 0; n < 4; n++) {
+            if ((strlen(reg_names[i][n]) == (size_t)len)
+                && (strncmp(reg_names[i][n], name, len) == 0)) {
+                *size = reg_sizes[n];
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+/* レジスタ番号 reg の、size バイト (8, 4, 2, 1) の名前 */
+const char *reg_name(int reg, int size) {
+    for (int n = 0; n < 4; n++) {
+        if (reg_sizes[n] == size) {
+            return reg_names[reg][n];
+        }
+    }
+    error("レジスタの大きさが不正です: %d", size);
+    return NULL;
+}
+
+/* レジスタ reg (64 ビットか 32 ビットの名前) の、size バイトの名前 */
+static const char *sized_reg(const char *reg, int size) {
+    int reg_size;
+    int r = find_reg(reg, strlen(reg), &reg_size);
+    if ((r < 0) || (reg_size < 4)) {
+        error("レジスタではありません: %s", reg);
+    }
+    return reg_names[r][(size == 8) ? 0 : 1];
+}
+
+/* 関数呼び出しを含む式の Sethi–Ullman 数。
+   呼び出しの前後では一時レジスタを退避するので、呼び出しを含む式を
+   先に計算させるために大きな値にする。
+ */
+#define NEED_CALL (NUM_TMP_REG + 1)
+
+/* 行を格納する領域を拡張するときに増やす行数 */
+#define LINE_CHUNK (256)
+
+/* 行の文字列を格納する領域 1 つの大きさ */
+#define TEXT_CHUNK (64 * 1024)
+
+/* 1 行の文字列の最大の長さ */
+#define MAX_TEXT (1024)
+
+/* 出力バッファがこの大きさを超えたら書き出す */
+#define FLUSH_SIZE (1024 * 1024)
+
+/* 生成中の関数のコード */
+static Code code = {NULL, 0, 0};
+
+/* 行の文字列を格納する領域。関数 1 つ分を生成し終えたら再利用する */
+typedef struct TextChunk TextChunk;
+struct TextChunk {
+    TextChunk *next;
+    size_t used;
+    char data[TEXT_CHUNK];
+};
+static TextChunk *text_head = NULL;
+static TextChunk *text_cur = NULL;
+
+/* アセンブリの出力バッファ */
+static Output out = {NULL, 0, 0, STDOUT_FILENO};
+
+/* コードの末尾に行を追加する。オペランドは空にする */
+Line *add_line(Code *code, LineKind kind, char *op, char *label) {
+    if (code->max_line == code->num_line) {
+        code->max_line += LINE_CHUNK;
+        code->lines
+            = (Line *)realloc(code->lines, code->max_line * sizeof(Line));
+        if (code->lines == NULL) {
+            error("コードを %d 行に拡張できません。", code->max_line);
+        }
+    }
+    Line *line = &code->lines[code->num_line];
+    line->kind = kind;
+    line->op = op;
+    line->num_operand = 0;
+    line->label = label;
+    line->targets = NULL;
+    line->num_target = 0;
+    line->hint = HINT_NONE;
+    code->num_line++;
+    return line;
+}
+
+/* 行の文字列を書き込む領域を返す。MAX_TEXT バイトは書き込める */
+static char *text_space(void) {
+    if (text_cur == NULL) {
+        text_cur = text_head = calloc(1, sizeof(TextChunk));
+    } else if (text_cur->used + MAX_TEXT > TEXT_CHUNK) {
+        if (text_cur->next == NULL) {
+            text_cur->next = calloc(1, sizeof(TextChunk));
+        }
+        text_cur = text_cur->next;
+        text_cur->used = 0;
+    }
+    return &text_cur->data[text_cur->used];
+}
+
+/* 行の文字列をすべて捨て、領域を再利用する */
+static void reset_text(void) {
+    text_cur = text_head;
+    if (text_cur != NULL) {
+        text_cur->used = 0;
+    }
+}
+
+/* 整数を 10 進の文字列にして buf に書き込み、その長さを返す */
+static int format_int(char *buf, int64_t val) {
+    char digits[20];
+    uint64_t u = (val < 0) ? -(uint64_t)val : (uint64_t)val;
+    int n = 0;
+    do {
+        digits[n] = '0' + (u % 10);
+        n++;
+        u /= 10;
+    } while (u != 0);
+
+    int len = 0;
+    if (val < 0) {
+        buf[len] = '-';
+        len++;
+    }
+    while (n > 0) {
+        n--;
+        buf[len] = digits[n];
+        len++;
+    }
+    return len;
+}
+
+/* 書式に従って文字列を作る。
+   コード生成で使う %d, %s, %.*s, %ld (PRId64), %% だけを扱う。
+ */
+static char *vformat(const char *format, va_list ap) {
+    char *str = text_space();
+    int len = 0;
+
+    for (const char *p = format; *p != '\0'; p++) {
+        const char *s = NULL;
+        int n = 0;
+        if (len + 21 >= MAX_TEXT) {
+            error("アセンブリの行が長すぎます。");
+        }
+        if (*p != '%') {
+            str[len] = *p;
+            len++;
+            continue;
+        }
+        p++;
+        if (*p == 'd') {
+            len += format_int(&str[len], va_arg(ap, int));
+            continue;
+        } else if (*p == 'l') {
+            p++;
+            len += format_int(&str[len], va_arg(ap, int64_t));
+            continue;
+        } else if (*p == 's') {
+            s = va_arg(ap, const char *);
+            n = strlen(s);
+        } else if (strncmp(p, ".*s", 3) == 0) {
+            p += 2;
+            n = va_arg(ap, int);
+            s = va_arg(ap, const char *);
+        } else if (*p == '%') {
+            s = "%";
+            n = 1;
+        } else {
+            error("未対応の書式です: %%%c", *p);
+        }
+        if (len + n >= MAX_TEXT) {
+            error("アセンブリの行が長すぎます。");
+        }
+        memcpy(&str[len], s, n);
+        len += n;
+    }
+    str[len] = '\0';
+    text_cur->used += len + 1;
+    return str;
+}
+
+/* 書式に従って文字列を作る */
+static char *format(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char *str = vformat(fmt, ap);
+    va_end(ap);
+    return str;
+}
+
+/* 出力バッファの内容を書き出す */
+void flush_output(void) {
+    if (out.fd < 0) {
+        return;
+    }
+    size_t done = 0;
+    while (done < out.len) {
+        ssize_t n = write(out.fd, out.data + done, out.len - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error("アセンブリを書き出せません: %s", strerror(errno));
+        }
+        done += n;
+    }
+    out.len = 0;
+}
+
+/* アセンブリの書き出し先を fd にする。fd が -1 ならメモリに溜める */
+void set_output(int fd) {
+    flush_output();
+    out.fd = fd;
+}
+
+/* メモリに溜めたアセンブリを返す。返した領域は次の出力まで有効 */
+char *output_data(size_t *len) {
+    *len = out.len;
+    return out.data;
+}
+
+/* 出力バッファに n バイト追加する */
+static void out_write(const char *s, size_t n) {
+    if (out.len + n > out.cap) {
+        while (out.len + n > out.cap) {
+            out.cap = (out.cap == 0) ? FLUSH_SIZE * 2 : out.cap * 2;
+        }
+        out.data = realloc(out.data, out.cap);
+        if (out.data == NULL) {
+            error("出力バッファを %zu バイトに拡張できません。", out.cap);
+        }
+    }
+    memcpy(out.data + out.len, s, n);
+    out.len += n;
+}
+
+/* 出力バッファに文字列を追加する */
+static void out_str(const char *s) {
+    out_write(s, strlen(s));
+}
+
+/* メモリのオペランド [base + index * scale + disp] を解析する */
+static void decode_mem(Opr *opr, const char *s) {
+    opr->kind = OPR_MEM;
+    opr->base = -1;
+    opr->index = -1;
+    opr->scale = 1;
+
+    const char *p = s + 1;
+    int sign = 1;
+    while (*p != ']') {
+        if (*p == ' ') {
+            p++;
+        } else if ((*p == '+') || (*p == '-')) {
+            sign = (*p == '-') ? -1 : 1;
+            p++;
+        } else if (isdigit(*p)) {
+            char *end;
+            opr->disp += sign * (int32_t)strtol(p, &end, 0);
+            p = end;
+        } else if (*p == '.') {
+            // ラベルはアセンブラが再配置に使うので、行の文字列とは別に持つ
+            int len = strcspn(p, "]+-");
+            opr->sym = calloc(len + 1, 1);
+            memcpy(opr->sym, p, len);
+            p += len;
+        } else if (strncmp(p, "rip", 3) == 0) {
+            p += 3;
+        } else {
+            int len = 0;
+            while (isalnum(p[len])) {
+                len++;
+            }
+            int size;
+            int reg = find_reg(p, len, &size);
+            if ((reg < 0) || (size != 8)) {
+                error("レジスタではありません: %.*s", len, p);
+            }
+            p += len;
+            if (*p == '*') {
+                opr->index = reg;
+                opr->scale = (int)strtol(p + 1, (char **)&p, 10);
+            } else if (opr->base < 0) {
+                opr->base = reg;
+            } else {
+                opr->index = reg;
+            }
+        }
+    }
+}
+
+/* オペランドの文字列を解析する */
+static Opr decode_operand(const char *s) {
+    Opr opr = {0};
+    const char *ptr = strstr(s, "PTR ");
+    if (ptr != NULL) {
+        opr.size = (strncmp(s, "DWORD", 5) == 0) ? 4 : 8;
+        s = ptr + 4;
+    }
+
+    int reg;
+    int size;
+    if (s[0] == '[') {
+        decode_mem(&opr, s);
+    } else if ((reg = find_reg(s, strlen(s), &size)) >= 0) {
+        opr.kind = OPR_REG;
+        opr.reg = reg;
+        opr.size = size;
+    } else if ((strncmp(s, "xmm", 3) == 0) || (strncmp(s, "ymm", 3) == 0)) {
+        opr.kind = OPR_VEC;
+        opr.reg = atoi(s + 3);
+        opr.size = (s[0] == 'x') ? 16 : 32;
+    } else if (isdigit(s[0]) || (s[0] == '-')) {
+        opr.kind = OPR_IMM;
+        opr.imm = strtoll(s, NULL, 0);
+    } else {
+        opr.kind = OPR_SYM;
+    }
+    return opr;
+}
+
+/* 命令の文字列を命令名とオペランドに分けて、行を追加する。
+   文字列は "op opr1, opr2, ..." の形で、区切りを '\0' で置き換える。
+ */
+static void add_insn(LineKind kind, char *text) {
+    Line *line = add_line(&code, kind, text, NULL);
+    char *p = strchr(text, ' ');
+    while (p != NULL) {
+        if (line->num_operand == MAX_OPERAND) {
+            error("オペランドが多すぎます: %s", text);
+        }
+        *p = '\0';
+        p++;
+        line->operands[line->num_operand] = p;
+        line->num_operand++;
+        p = strstr(p, ", ");
+        if (p != NULL) {
+            *p = '\0';
+            p++;
+        }
+    }
+    for (int i = 0; i < line->num_operand; i++) {
+        line->oprs[i] = decode_operand(line->operands[i]);
+    }
+}
+
+/* 命令 */
+static void emit(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    add_insn(LN_INSN, vformat(format, ap));
+    va_end(ap);
+}
+
+/* 関数から出る命令 */
+static void emit_exit(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    add_insn(LN_EXIT, vformat(format, ap));
+    va_end(ap);
+}
+
+/* ラベル */
+static void emit_label(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    add_line(&code, LN_LABEL, NULL, vformat(format, ap));
+    va_end(ap);
+}
+
+/* ジャンプ。op が jmp なら無条件ジャンプ、それ以外は条件ジャンプ */
+static Line *emit_jump(const char *op, const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    LineKind kind = (strcmp(op, "jmp") == 0) ? LN_JMP : LN_JCC;
+    Line *line = add_line(&code, kind, (char *)op, vformat(format, ap));
+    va_end(ap);
+    return line;
+}
+
+/* ジャンプテーブル name を引いた rax への間接ジャンプ。
+   テーブルの要素 i の飛び先は targets[i]
+ */
+static void emit_table(char *name, char **targets, int num_target) {
+    Line *line = add_line(&code, LN_TABLE, "jmp", name);
+    line->operands[0] = "rax";
+    line->oprs[0] = decode_operand("rax");
+    line->num_operand = 1;
+    line->targets = targets;
+    line->num_target = num_target;
+}
+
+/* コメント。-fverbose-asm のときだけ出力する */
 static void comment(const char *format, ...) {
+    if (option.verbose_asm == false) {
+        return;
+    }
     va_list ap;
-    printf("# ");
     va_start(ap, format);
-    vprintf(format, ap);
+    add_line(&code, LN_COMMENT, vformat(format, ap), NULL);
     va_end(ap);
 }
 
-/* NULL */
-static void gen_null(Node *node) {
-    printf("    push 0xcc\n");
-}
-
-/* 整数 */
-static void gen_num(Node *node) {
-    comment("num: %d\n", node->v.num.val);
-    printf("    push %d\n", node->v.num.val);
-}
-
-/* 足し算 */
-static void gen_add(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    add rax, rdi\n");
-    printf("    push rax\n");
-}
-
-/* 引き算 */
-static void gen_sub(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    sub rax, rdi\n");
-    printf("    push rax\n");
-}
-
-/* 掛け算 */
-static void gen_mul(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    imul rax, rdi\n");
-    printf("    push rax\n");
-}
-
-/* 割り算 */
-static void gen_div(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    cqo\n");
-    printf("    idiv rdi\n");
-    printf("    push rax\n");
-}
-
-/* 比較演算子 */
-static void gen_eq(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, rdi\n");
-    printf("    sete al\n");
-    printf("    movzb rax, al\n");
-    printf("    push rax\n");
-}
-
-/* 比較演算子 */
-static void gen_ne(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, rdi\n");
-    printf("    setne al\n");
-    printf("    movzb rax, al\n");
-    printf("    push rax\n");
-}
-
-/* 比較演算子 */
-static void gen_lt(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, rdi\n");
-    printf("    setl al\n");
-    printf("    movzb rax, al\n");
-    printf("    push rax\n");
-}
-
-/* 比較演算子 */
-static void gen_le(Node *node) {
-    gen(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, rdi\n");
-    printf("    setle al\n");
-    printf("    movzb rax, al\n");
-    printf("    push rax\n");
-}
-
-/* 変数のアドレス */
-static void gen_lvar_addr(Node *node) {
-    if (node->kind != ND_LVAR) {
-        error("代入の左辺値が変数ではありません。");
+/* コードを出力バッファに追加する */
+static void print_code(Code *code) {
+    for (int i = 0; i < code->num_line; i++) {
+        Line *line = &code->lines[i];
+        switch (line->kind) {
+        case LN_INSN:
+        case LN_EXIT:
+            out_write("    ", 4);
+            out_str(line->op);
+            for (int j = 0; j < line->num_operand; j++) {
+                out_write((j == 0) ? " " : ", ", (j == 0) ? 1 : 2);
+                out_str(line->operands[j]);
+            }
+            break;
+        case LN_LABEL:
+            out_str(line->label);
+            out_write(":", 1);
+            break;
+        case LN_JMP:
+        case LN_JCC:
+            out_write("    ", 4);
+            out_str(line->op);
+            out_write(" ", 1);
+            out_str(line->label);
+            break;
+        case LN_TABLE:
+            // 間接ジャンプの後ろに、飛び先との差を並べたテーブルを置く
+            out_write("    jmp ", 8);
+            out_str(line->operands[0]);
+            out_str("\n    .section .rodata\n    .p2align 2\n");
+            out_str(line->label);
+            out_write(":\n", 2);
+            for (int j = 0; j < line->num_target; j++) {
+                out_str("    .long ");
+                out_str(line->targets[j]);
+                out_write("-", 1);
+                out_str(line->label);
+                out_write("\n", 1);
+            }
+            out_str("    .text");
+            break;
+        case LN_COMMENT:
+            out_write("# ", 2);
+            out_str(line->op);
+            break;
+        }
+        out_write("\n", 1);
+    }
+    if (out.len >= FLUSH_SIZE) {
+        flush_output();
+    }
+}
+
+/* 定数 d (|d| >= 2 で 2 のべき乗でない) で bits ビットの整数を割るための
+   マジックナンバーとシフト量を求める。
+   商は (x * magic) の上位 bits ビットを補正して shift だけ算術右シフトし、
+   負なら 1 を足したものになる (Hacker's Delight 10-1 節)。
+   計算は bits ビットの符号なし整数として行う。
+ */
+static void div_magic(int64_t d, int bits, int64_t *magic, int *shift) {
+    const uint64_t mask = (bits == 64) ? UINT64_MAX
+                                       : ((uint64_t)1 << bits) - 1;
+    const uint64_t two = (uint64_t)1 << (bits - 1);
+    uint64_t ad = ((d < 0) ? -(uint64_t)d : (uint64_t)d) & mask;
+    uint64_t t = two + (((uint64_t)d & mask) >> (bits - 1));
+    uint64_t anc = t - 1 - t % ad;  // |nc|
+    uint64_t q1 = two / anc;
+    uint64_t r1 = two - q1 * anc;
+    uint64_t q2 = two / ad;
+    uint64_t r2 = two - q2 * ad;
+    uint64_t delta;
+    int p = bits - 1;
+
+    do {
+        p++;
+        q1 = (2 * q1) & mask;
+        r1 = (2 * r1) & mask;
+        if (r1 >= anc) {
+            q1 = (q1 + 1) & mask;
+            r1 -= anc;
+        }
+        q2 = (2 * q2) & mask;
+        r2 = (2 * r2) & mask;
+        if (r2 >= ad) {
+            q2 = (q2 + 1) & mask;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while ((q1 < delta) || ((q1 == delta) && (r1 == 0)));
+
+    uint64_t m = (q2 + 1) & mask;
+    if (d < 0) {
+        m = -m & mask;
+    }
+    // bits ビットの符号付き整数として読む
+    *magic = (bits == 64) ? (int64_t)m : (int64_t)(int32_t)(uint32_t)m;
+    *shift = p - bits;
+}
+
+/* 2 のべき乗なら指数を、そうでなければ -1 を返す */
+static int log2_exact(uint64_t n) {
+    if ((n == 0) || ((n & (n - 1)) != 0)) {
+        return -1;
+    }
+    int k = 0;
+    while (n > 1) {
+        n >>= 1;
+        k++;
+    }
+    return k;
+}
+
+/* size バイトのレジスタ reg を 0 以外の定数 d で割った商を rax (eax) に
+   求める。idiv の代わりに、乗算とシフトで 0 方向に丸めた商を求める。
+   reg は変えず、rdx を破壊する。
+ */
+static void gen_div_const(const char *reg, int d, int size) {
+    const char *ax = sized_reg("rax", size);
+    const char *dx = sized_reg("rdx", size);
+    int bits = size * 8;
+    uint64_t ad = (d < 0) ? -(uint64_t)(int64_t)d : (uint64_t)d;
+    int k = log2_exact(ad);
+
+    comment("div by constant: %d", d);
+    if (k >= 0) {
+        // 負の数は 2^k - 1 を足してからシフトし、0 方向に丸める
+        emit("mov %s, %s", ax, reg);
+        if (k > 0) {
+            emit("sar %s, %d", ax, bits - 1);
+            emit("shr %s, %d", ax, bits - k);
+            emit("add %s, %s", ax, reg);
+            emit("sar %s, %d", ax, k);
+        }
+        if (d < 0) {
+            emit("neg %s", ax);
+        }
+    } else {
+        // 負の除数のマジックナンバーは負で、商の符号も補正済みになる
+        int64_t magic;
+        int shift;
+        div_magic(d, bits, &magic, &shift);
+        emit("mov %s, %" PRId64, ax, magic);
+        emit("imul %s", reg);
+        if ((d > 0) && (magic < 0)) {
+            emit("add %s, %s", dx, reg);
+        } else if ((d < 0) && (magic > 0)) {
+            emit("sub %s, %s", dx, reg);
+        }
+        if (shift > 0) {
+            emit("sar %s, %d", dx, shift);
+        }
+        emit("mov %s, %s", ax, dx);
+        emit("shr %s, %d", ax, bits - 1);
+        emit("add %s, %s", ax, dx);
+    }
+}
+
+/* 除数が 0 以外の定数なら true を返す */
+static bool is_const_divisor(Node *node) {
+    return (node->kind == ND_NUM) && (node->v.num.val != 0);
+}
+
+/* 深さ d の式の値を求める一時レジスタ */
+static const char *tmp(int d) {
+    if (d >= NUM_TMP_REG) {
+        error("一時レジスタが足りません。");
+    }
+    return tmp_regs[d];
+}
+
+/* 変数のアドレスのベースにするレジスタ */
+static const char *frame_reg(void) {
+    return (omit_frame == true) ? "rsp" : "rbp";
+}
+
+/* 式の値のバイト数 */
+static int node_size(Node *node) {
+    return size_of(node->type);
+}
+
+/* メモリのオペランド mem ("[...]") に大きさを付ける */
+static char *sized_mem(const char *mem, int size) {
+    return format("%s PTR %s", (size == 8) ? "QWORD" : "DWORD", mem);
+}
+
+/* 変数の場所 (レジスタかメモリ)。大きさは変数の型の大きさ */
+static char *var_operand(LVar *var) {
+    int size = size_of(var->type);
+    if (var->reg != 0) {
+        return (char *)sized_reg(var_regs[var->reg], size);
+    }
+    return sized_mem(format("[%s-%d]", frame_reg(), var->offset), size);
+}
+
+/* レジスタ reg の値を変数に格納する。
+   レジスタに割り当てた int の変数は、64 ビットに符号拡張して格納する。
+   こうしておくと、ポインタに足すインデックスにそのまま使える。
+ */
+static void gen_store_var(LVar *var, const char *reg) {
+    int size = size_of(var->type);
+    if ((var->reg != 0) && (size == 4)) {
+        emit("movsxd %s, %s", var_regs[var->reg], sized_reg(reg, 4));
+        return;
+    }
+    emit("mov %s, %s", var_operand(var), sized_reg(reg, size));
+}
+
+/* レジスタに割り当てた変数なら true を返す */
+static bool is_reg_var(Node *node) {
+    return (node->kind == ND_LVAR) && (node->v.lvar.var->reg != 0);
+}
+
+/* 比較演算子なら true を返す */
+static bool is_compare(Node *node) {
+    return (node->kind == ND_EQ) || (node->kind == ND_NE)
+           || (node->kind == ND_LT) || (node->kind == ND_LE);
+}
+
+/* 2 項演算子を計算するバイト数。比較は両辺の大きい方で比べる */
+static int op_size(Node *node) {
+    if (is_compare(node) == true) {
+        int lhs = node_size(node->v.op2.lhs);
+        int rhs = node_size(node->v.op2.rhs);
+        return (lhs > rhs) ? lhs : rhs;
+    }
+    return node_size(node);
+}
+
+/* メモリのアドレス [base + index * scale + disp] */
+typedef struct {
+    Node *base;   // ベースの式
+    Node *index;  // インデックスの式。なければ NULL
+    int scale;    // インデックスに掛ける数 (1, 2, 4, 8)
+    int disp;     // ディスプレースメント
+} Address;
+
+/* index * scale の形 (scale が 1, 2, 4, 8 の定数) なら、scale を返す。
+   違えば 0 を返す。
+ */
+static int match_scale(Node *node, Node **index) {
+    if (node->kind != ND_MUL) {
+        return 0;
+    }
+    Node *lhs = node->v.op2.lhs;
+    Node *rhs = node->v.op2.rhs;
+    if (lhs->kind == ND_NUM) {
+        Node *tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+    }
+    if (rhs->kind != ND_NUM) {
+        return 0;
+    }
+    int scale = rhs->v.num.val;
+    if ((scale != 1) && (scale != 2) && (scale != 4) && (scale != 8)) {
+        return 0;
+    }
+    *index = lhs;
+    return scale;
+}
+
+/* 式から定数の加減算を取り除き、その合計を *disp に scale 倍して足す。
+   ディスプレースメントが 32 ビットに収まらなくなるなら取り除かない。
+ */
+static Node *strip_disp(Node *node, int scale, int *disp) {
+    for (;;) {
+        Node *rest;
+        long val;
+        if ((node->kind == ND_ADD) && (node->v.op2.rhs->kind == ND_NUM)) {
+            rest = node->v.op2.lhs;
+            val = node->v.op2.rhs->v.num.val;
+        } else if ((node->kind == ND_ADD)
+                   && (node->v.op2.lhs->kind == ND_NUM)) {
+            rest = node->v.op2.rhs;
+            val = node->v.op2.lhs->v.num.val;
+        } else if ((node->kind == ND_SUB)
+                   && (node->v.op2.rhs->kind == ND_NUM)) {
+            rest = node->v.op2.lhs;
+            val = -(long)node->v.op2.rhs->v.num.val;
+        } else {
+            return node;
+        }
+        long sum = *disp + val * scale;
+        if ((sum < INT32_MIN) || (INT32_MAX < sum)) {
+            return node;
+        }
+        *disp = sum;
+        node = rest;
+    }
+}
+
+/* アドレスの式を base + index * scale + disp に分解する */
+static Address match_address(Node *node) {
+    Address addr = {NULL, NULL, 1, 0};
+    node = strip_disp(node, 1, &addr.disp);
+    if (node->kind != ND_ADD) {
+        addr.base = node;
+        return addr;
+    }
+
+    Node *lhs = node->v.op2.lhs;
+    Node *rhs = node->v.op2.rhs;
+    Node *index;
+    int scale;
+    if ((scale = match_scale(rhs, &index)) != 0) {
+        addr.base = lhs;
+    } else if ((scale = match_scale(lhs, &index)) != 0) {
+        addr.base = rhs;
+    } else {
+        // レジスタの変数をベースにすると、インデックスだけ計算すればよい
+        bool swap = (is_reg_var(lhs) == false) && (is_reg_var(rhs) == true);
+        addr.base = (swap == true) ? rhs : lhs;
+        index = (swap == true) ? lhs : rhs;
+        scale = 1;
+    }
+    addr.base = strip_disp(addr.base, 1, &addr.disp);
+    addr.index = strip_disp(index, scale, &addr.disp);
+    addr.scale = scale;
+    return addr;
+}
+
+/* アドレスのベースとインデックスのうち、計算が要るものの数 */
+static int address_calcs(Address *addr) {
+    int n = (is_reg_var(addr->base) == true) ? 0 : 1;
+    if ((addr->index != NULL) && (is_reg_var(addr->index) == false)) {
+        n++;
+    }
+    return n;
+}
+
+/* ベースとインデックスのレジスタ名からメモリのオペランドを作る */
+static char *address_operand(Address *addr,
+                             const char *base,
+                             const char *index) {
+    char *mem = format("[%s", base);
+    if (index != NULL) {
+        mem = (addr->scale == 1) ? format("%s+%s", mem, index)
+                                 : format("%s+%s*%d", mem, index, addr->scale);
+    }
+    if (addr->disp > 0) {
+        mem = format("%s+%d", mem, addr->disp);
+    } else if (addr->disp < 0) {
+        mem = format("%s-%d", mem, -addr->disp);
+    }
+    return format("%s]", mem);
+}
+
+/* 計算せずに書けるアドレス (ベースとインデックスがレジスタの変数) の
+   参照外しなら true を返す
+ */
+static bool is_mem_operand(Node *node) {
+    if (node->kind != ND_DEREF) {
+        return false;
+    }
+    Address addr = match_address(node->v.op1.expr);
+    return address_calcs(&addr) == 0;
+}
+
+/* 計算せずに size バイトの命令のオペランドに書ける式 (整数・変数・
+   レジスタの変数が指すメモリ) なら true を返す。
+   レジスタの int の変数は符号拡張してあるので、8 バイトとしても使える。
+ */
+static bool is_operand(Node *node, int size) {
+    if ((node->kind == ND_NUM) || (is_reg_var(node) == true)) {
+        return true;
+    }
+    return ((node->kind == ND_LVAR) || (is_mem_operand(node) == true))
+           && (node_size(node) == size);
+}
+
+/* 整数・変数・メモリを size バイトのオペランドの文字列にする */
+static char *operand(Node *node, int size) {
+    if (node->kind == ND_NUM) {
+        return format("%d", node->v.num.val);
+    }
+    if (node->kind == ND_DEREF) {
+        Address addr = match_address(node->v.op1.expr);
+        char *mem = address_operand(
+            &addr,
+            var_regs[addr.base->v.lvar.var->reg],
+            (addr.index != NULL) ? var_regs[addr.index->v.lvar.var->reg]
+                                 : NULL);
+        return sized_mem(mem, size);
+    }
+    if (is_reg_var(node) == true) {
+        return (char *)sized_reg(var_regs[node->v.lvar.var->reg], size);
+    }
+    return var_operand(node->v.lvar.var);
+}
+
+/* 2 項演算子の右辺を、計算せずにオペランドとして使えれば true を返す */
+static bool rhs_is_operand(Node *node) {
+    Node *rhs = node->v.op2.rhs;
+    if ((node->kind == ND_DIV) || (node->kind == ND_MOD)) {
+        // idiv は即値を取れないが、定数の除数は乗算に置き換える
+        return (is_const_divisor(rhs) == true)
+               || ((rhs->kind != ND_NUM)
+                   && (is_operand(rhs, op_size(node)) == true));
+    }
+    return is_operand(rhs, op_size(node));
+}
+
+/* 両辺の Sethi–Ullman 数から、2 項演算子の Sethi–Ullman 数を求める */
+static int need2(int lhs, int rhs) {
+    int n = (lhs == rhs) ? lhs + 1 : ((lhs > rhs) ? lhs : rhs);
+    return (n > NEED_CALL) ? NEED_CALL : n;
+}
+
+static int need(Node *node);
+
+/* ベースとインデックスを計算するのに一時レジスタが足りれば true を返す */
+static bool can_fold_address(Address *addr, int d) {
+    return d + address_calcs(addr) <= NUM_TMP_REG;
+}
+
+/* アドレスのベースとインデックスの計算に必要な一時レジスタの数 */
+static int need_address(Address *addr) {
+    int base = (is_reg_var(addr->base) == true) ? 0 : need(addr->base);
+    int index = ((addr->index == NULL) || (is_reg_var(addr->index) == true))
+                    ? 0
+                    : need(addr->index);
+    if ((base > 0) && (index > 0)) {
+        return need2(base, index);
+    }
+    return (base > index) ? base : index;
+}
+
+/* 加算を lea 1 命令にすると命令が減るなら true を返す。
+   インデックスを scale 倍するか、ディスプレースメントも足すか、
+   ベースがレジスタの変数 (mov が要らない) ならよい。
+ */
+static bool use_lea(Node *node) {
+    if (node->kind != ND_ADD) {
+        return false;
+    }
+    Address addr = match_address(node);
+    if (addr.index == NULL) {
+        return (is_reg_var(addr.base) == true) && (addr.disp != 0);
+    }
+    return (addr.scale != 1) || (addr.disp != 0)
+           || (is_reg_var(addr.base) == true);
+}
+
+/* 式の Sethi–Ullman 数: 計算に必要な一時レジスタの数 */
+static int need(Node *node) {
+    if (node == NULL) {
+        return 1;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+        if (use_lea(node) == true) {
+            Address addr = match_address(node);
+            int n = need_address(&addr);
+            return (n > 0) ? n : 1;
+        }
+        // fall through
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        if (rhs_is_operand(node) == true) {
+            return need(node->v.op2.lhs);
+        }
+        return need2(need(node->v.op2.lhs), need(node->v.op2.rhs));
+    case ND_ASSIGN:
+        if (node->v.op2.lhs->kind == ND_LVAR) {
+            return need(node->v.op2.rhs);
+        }
+        {
+            // 値を求めてから、残りのレジスタでアドレスを計算する
+            Address addr = match_address(node->v.op2.lhs->v.op1.expr);
+            int value = need(node->v.op2.rhs);
+            int n = need_address(&addr);
+            if ((n > 0) && (n + 1 > value)) {
+                value = n + 1;
+            }
+            return (value > NEED_CALL) ? NEED_CALL : value;
+        }
+    case ND_DEREF: {
+        Address addr = match_address(node->v.op1.expr);
+        int n = need_address(&addr);
+        return (n > 0) ? n : 1;
+    }
+    case ND_FUNC:
+        if (node->v.func.builtin != BI_NONE) {
+            // 組み込み関数は呼び出さず、引数 0 のレジスタで計算する
+            return (node->v.func.num_param > 0)
+                       ? need(node->v.func.params[0])
+                       : 1;
+        }
+        return NEED_CALL;
+    case ND_INLINE:
+        return NEED_CALL;
+    default:
+        return 1;
+    }
+}
+
+static void gen_expr(Node *node, int d);
+
+/* 整数の定数。
+   -Os では、0 以外の 1 バイトに収まる値を push と pop で置く。mov r32, imm32
+   の 5 バイト (r8～r15 は 6 バイト) が 3 バイト (4 バイト) になる。上位
+   32 ビットは符号拡張されるが、int の値の上位は使うときに movsxd で
+   作り直すので問題ない。フレームのない関数では、push がレッドゾーンの
+   変数を壊すので使わない。
+ */
+static void gen_num(Node *node, int d) {
+    int val = node->v.num.val;
+    if ((option.size == true) && (omit_frame == false) && (val != 0)
+        && (-128 <= val) && (val <= 127)) {
+        emit("push %d", val);
+        emit("pop %s", tmp(d));
+        return;
+    }
+    emit("mov %s, %d", sized_reg(tmp(d), node_size(node)), val);
+}
+
+/* 一時レジスタ tmp_regs[0]～[d-1] をスタックに退避する */
+static void save_tmps(int d) {
+    for (int i = 0; i < d; i++) {
+        emit("push %s", tmp(i));
+    }
+    push_depth += d;
+}
+
+/* save_tmps() で退避した一時レジスタを復元する */
+static void restore_tmps(int d) {
+    for (int i = d - 1; i >= 0; i--) {
+        emit("pop %s", tmp(i));
+    }
+    push_depth -= d;
+}
+
+/* 式の値を size バイトの値として一時レジスタ tmp(d) に求める。
+   int の値を 8 バイトで使う (ポインタに足す) なら符号拡張する。
+ */
+static void gen_expr_size(Node *node, int d, int size) {
+    gen_expr(node, d);
+    if ((size == 8) && (node_size(node) == 4)) {
+        emit("movsxd %s, %s", tmp(d), sized_reg(tmp(d), 4));
+    }
+}
+
+/* 2 項演算子の両辺を size バイトの値として計算し、左辺の値を *lhs の
+   レジスタに、右辺を *rhs のオペランドに置く。レジスタ名は size バイトの
+   名前にする。
+   一時レジスタが足りれば、必要なレジスタの多い方を先に計算する
+   (Sethi–Ullman)。足りなければ左辺をスタックに退避し、rax に戻す。
+ */
+static void gen_operands(Node *lhs_node,
+                         Node *rhs_node,
+                         bool rhs_operand,
+                         int size,
+                         int d,
+                         const char **lhs,
+                         const char **rhs) {
+    if (rhs_operand == true) {
+        gen_expr_size(lhs_node, d, size);
+        *lhs = sized_reg(tmp(d), size);
+        *rhs = operand(rhs_node, size);
+    } else if (d + 1 < NUM_TMP_REG) {
+        if (need(rhs_node) > need(lhs_node)) {
+            gen_expr_size(rhs_node, d, size);
+            gen_expr_size(lhs_node, d + 1, size);
+            *lhs = sized_reg(tmp(d + 1), size);
+            *rhs = sized_reg(tmp(d), size);
+        } else {
+            gen_expr_size(lhs_node, d, size);
+            gen_expr_size(rhs_node, d + 1, size);
+            *lhs = sized_reg(tmp(d), size);
+            *rhs = sized_reg(tmp(d + 1), size);
+        }
+    } else {
+        comment("spill");
+        gen_expr_size(lhs_node, d, size);
+        emit("push %s", tmp(d));
+        push_depth++;
+        gen_expr_size(rhs_node, d, size);
+        emit("pop rax");
+        push_depth--;
+        *lhs = sized_reg("rax", size);
+        *rhs = sized_reg(tmp(d), size);
+    }
+}
+
+/* アドレスの式を計算し、メモリのオペランド [base + index * scale + disp]
+   にする。レジスタの変数はそのままベース・インデックスに使い、それ以外を
+   一時レジスタ tmp(d) (と tmp(d + 1)) に計算する。ポインタに足す int の
+   値は符号拡張する。
+ */
+static char *gen_address(Node *node, int d) {
+    Address addr = match_address(node);
+    int size = node_size(node);
+    if (can_fold_address(&addr, d) == false) {
+        // 一時レジスタが足りなければ、アドレス全体を計算する
+        gen_expr(node, d);
+        return format("[%s]", tmp(d));
+    }
+
+    bool calc_base = (is_reg_var(addr.base) == false);
+    bool calc_index = (addr.index != NULL)
+                      && (is_reg_var(addr.index) == false);
+    const char *base = (calc_base == true)
+                           ? NULL
+                           : var_regs[addr.base->v.lvar.var->reg];
+    const char *index = ((addr.index == NULL) || (calc_index == true))
+                            ? NULL
+                            : var_regs[addr.index->v.lvar.var->reg];
+    if ((calc_base == true) && (calc_index == true)) {
+        if (need(addr.index) > need(addr.base)) {
+            gen_expr_size(addr.index, d, size);
+            gen_expr_size(addr.base, d + 1, size);
+            index = tmp(d);
+            base = tmp(d + 1);
+        } else {
+            gen_expr_size(addr.base, d, size);
+            gen_expr_size(addr.index, d + 1, size);
+            base = tmp(d);
+            index = tmp(d + 1);
+        }
+    } else if (calc_base == true) {
+        gen_expr_size(addr.base, d, size);
+        base = tmp(d);
+    } else if (calc_index == true) {
+        gen_expr_size(addr.index, d, size);
+        index = tmp(d);
+    }
+    return address_operand(&addr, base, index);
+}
+
+/* 定数による割り算・剰余 */
+static void gen_div_mod_const(Node *node, int d) {
+    int divisor = node->v.op2.rhs->v.num.val;
+    int size = node_size(node);
+    const char *reg = sized_reg(tmp(d), size);
+    const char *ax = sized_reg("rax", size);
+    gen_expr_size(node->v.op2.lhs, d, size);
+    gen_div_const(reg, divisor, size);
+    if (node->kind == ND_DIV) {
+        emit("mov %s, %s", reg, ax);
+    } else {
+        emit("imul %s, %s, %d", ax, ax, divisor);
+        emit("sub %s, %s", reg, ax);
+    }
+}
+
+/* 比較演算子の条件コード。[0] が真、[1] が偽の条件 */
+static const char *cond_codes[][2] = {
+    [ND_EQ] = {"e", "ne"},
+    [ND_NE] = {"ne", "e"},
+    [ND_LT] = {"l", "ge"},
+    [ND_LE] = {"le", "g"},
+};
+
+/* 2 項演算子 */
+static void gen_op2(Node *node, int d) {
+    const char *lhs;
+    const char *rhs;
+
+    if (((node->kind == ND_DIV) || (node->kind == ND_MOD))
+        && (is_const_divisor(node->v.op2.rhs) == true)) {
+        gen_div_mod_const(node, d);
+        return;
+    }
+    if (use_lea(node) == true) {
+        Address addr = match_address(node);
+        if (can_fold_address(&addr, d) == true) {
+            char *mem = gen_address(node, d);
+            emit("lea %s, %s", sized_reg(tmp(d), node_size(node)), mem);
+            return;
+        }
+    }
+
+    int size = op_size(node);
+    gen_operands(node->v.op2.lhs,
+                 node->v.op2.rhs,
+                 rhs_is_operand(node),
+                 size,
+                 d,
+                 &lhs,
+                 &rhs);
+    switch (node->kind) {
+    case ND_ADD:
+        emit("add %s, %s", lhs, rhs);
+        break;
+    case ND_SUB:
+        emit("sub %s, %s", lhs, rhs);
+        break;
+    case ND_MUL:
+        if (node->v.op2.rhs->kind == ND_NUM) {
+            emit("imul %s, %s, %s", lhs, lhs, rhs);
+        } else {
+            emit("imul %s, %s", lhs, rhs);
+        }
+        break;
+    case ND_DIV:
+    case ND_MOD: {
+        const char *ax = sized_reg("rax", size);
+        if (strcmp(lhs, ax) != 0) {
+            emit("mov %s, %s", ax, lhs);
+        }
+        emit((size == 8) ? "cqo" : "cdq");
+        emit("idiv %s", rhs);
+        emit("mov %s, %s",
+             lhs,
+             sized_reg((node->kind == ND_DIV) ? "rax" : "rdx", size));
+        break;
+    }
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        // 比較の結果は int
+        emit("cmp %s, %s", lhs, rhs);
+        emit("set%s al", cond_codes[node->kind][0]);
+        lhs = sized_reg(lhs, 4);
+        emit("movzx %s, al", lhs);
+        break;
+    default:
+        error("2 項演算子ではありません。");
+        break;
+    }
+    const char *dest = sized_reg(tmp(d), node_size(node));
+    if (strcmp(lhs, dest) != 0) {
+        emit("mov %s, %s", dest, sized_reg(lhs, node_size(node)));
+    }
+}
+
+/* 変数 */
+static void gen_lvar(Node *node, int d) {
+    comment("lvar: %.*s", node->v.lvar.len, node->v.lvar.name);
+    emit("mov %s, %s",
+         sized_reg(tmp(d), node_size(node)),
+         var_operand(node->v.lvar.var));
+}
+
+/* アドレス取得 */
+static void gen_addr(Node *node, int d) {
+    Node *expr = node->v.op1.expr;
+    if (expr->kind != ND_LVAR) {
+        error("アドレスを取れるのは変数だけです。");
+    }
+    if (expr->v.lvar.var->reg != 0) {
+        error("レジスタ上の変数 %.*s のアドレスは取れません。",
+              expr->v.lvar.len,
+              expr->v.lvar.name);
+    }
+    comment("&%.*s", expr->v.lvar.len, expr->v.lvar.name);
+    emit("lea %s, [%s-%d]", tmp(d), frame_reg(), expr->v.lvar.var->offset);
+}
+
+/* 参照外し */
+static void gen_deref(Node *node, int d) {
+    int size = node_size(node);
+    char *mem = gen_address(node->v.op1.expr, d);
+    emit("mov %s, %s", sized_reg(tmp(d), size), sized_mem(mem, size));
+}
+
+/* 代入。左辺の型の大きさで格納する。
+   型の違う値は変換しない (関数の戻り値のポインタは rax にそのまま入っている)。
+ */
+static void gen_assign(Node *node, int d) {
+    Node *lhs = node->v.op2.lhs;
+    int size = node_size(lhs);
+    if (lhs->kind == ND_LVAR) {
+        gen_expr(node->v.op2.rhs, d);
+        comment("assign: %.*s", lhs->v.lvar.len, lhs->v.lvar.name);
+        gen_store_var(lhs->v.lvar.var, tmp(d));
+        return;
+    }
+    if (lhs->kind != ND_DEREF) {
+        error("代入の左辺値が変数ではありません。");
+    }
+
+    // *addr = value
+    // 値を tmp(d) に求めてから、残りのレジスタでアドレスを計算する
+    Address dest = match_address(lhs->v.op1.expr);
+    if (can_fold_address(&dest, d + 1) == true) {
+        gen_expr(node->v.op2.rhs, d);
+        comment("assign");
+        char *mem = gen_address(lhs->v.op1.expr, d + 1);
+        emit("mov %s, %s", sized_mem(mem, size), sized_reg(tmp(d), size));
+        return;
+    }
+    const char *addr;
+    const char *value;
+    gen_operands(
+        lhs->v.op1.expr, node->v.op2.rhs, false, 8, d, &addr, &value);
+    comment("assign");
+    emit("mov %s, %s",
+         sized_mem(format("[%s]", addr), size),
+         sized_reg(value, size));
+    if (strcmp(value, tmp(d)) != 0) {
+        emit("mov %s, %s", tmp(d), value);
+    }
+}
+
+/* 関数が独自の呼び出し規約 (引数を一時レジスタの順に渡す) なら true */
+static bool is_fast_conv(Node *deffunc) {
+    return (deffunc != NULL) && (deffunc->v.deffunc.conv != CONV_SYSV);
+}
+
+/* 関数がパラメータ i を受け取る (プロローグで格納する) レジスタ */
+static const char *param_reg(Node *deffunc, int i) {
+    return (is_fast_conv(deffunc) == true) ? tmp_regs[i] : regs[i];
+}
+
+/* 関数がパラメータ i を使うなら true を返す */
+static bool is_param_used(Node *deffunc, int i) {
+    if (i >= deffunc->v.deffunc.num_param) {
+        return false;
+    }
+    return (deffunc->v.deffunc.param_used == NULL)
+           || (deffunc->v.deffunc.param_used[i] == true);
+}
+
+/* 使わないパラメータに渡す、計算しなくてよい引数 (定数や変数) なら true */
+static bool is_unused_arg(Node *deffunc, int i, Node *arg) {
+    return (is_param_used(deffunc, i) == false)
+           && ((arg->kind == ND_NUM) || (arg->kind == ND_LVAR));
+}
+
+/* 呼び出す関数のシンボル。ラッパーを付けた関数は、本体を直接呼ぶ */
+static char *callee_name(Node *node) {
+    Node *deffunc = node->v.func.deffunc;
+    if ((deffunc != NULL) && (deffunc->v.deffunc.conv == CONV_WRAPPED)) {
+        return format("%.*s.internal", node->v.func.len, node->v.func.name);
+    }
+    return format("%.*s", node->v.func.len, node->v.func.name);
+}
+
+/* 関数呼び出しの引数を計算し、引数レジスタに置く */
+static void gen_args(Node *node) {
+    int i;
+    int num_param = node->v.func.num_param;
+    Node *deffunc = node->v.func.deffunc;
+
+    // 引数 i を tmp_regs[i] に求める。後の引数の計算で関数を呼び出すときは、
+    // 先に求めた引数が退避される。
+    for (i = 0; i < num_param; i++) {
+        // 独自の規約では、使わないパラメータに定数や変数を渡さない
+        if ((is_fast_conv(deffunc) == true)
+            && (is_unused_arg(deffunc, i, node->v.func.params[i]) == true)) {
+            continue;
+        }
+        gen_expr(node->v.func.params[i], i);
+    }
+    if (is_fast_conv(deffunc) == true) {
+        // 独自の規約では、計算した一時レジスタのまま渡す
+        return;
+    }
+    // regs[i] は tmp_regs[i] か、移し終えた tmp_regs[i - 1] か、
+    // 一時レジスタでない rdx なので、前から順に移せば移す前の値を壊さない
+    for (i = 0; i < num_param; i++) {
+        if (strcmp(tmp(i), regs[i]) != 0) {
+            emit("mov %s, %s", regs[i], tmp(i));
+        }
+    }
+}
+
+/* 関数呼び出し */
+static void gen_call_func(Node *node, int d) {
+    comment("func: %.*s", node->v.func.len, node->v.func.name);
+    save_tmps(d);
+    gen_args(node);
+    // 関数呼び出しのまえに、rspを16の倍数に整える。
+    // -Os では、4 バイトの sub・add の代わりに 1 バイトの push・pop を使う。
+    // pop 先の rdx は、呼び出しの後は使っていない。
+    bool pad = (push_depth % 2) != 0;
+    if (pad == true) {
+        emit((option.size == true) ? "push rax" : "sub rsp, 8");
+    }
+    emit("call %s", callee_name(node));
+    if (pad == true) {
+        emit((option.size == true) ? "pop rdx" : "add rsp, 8");
+    }
+    emit("mov %s, rax", tmp(d));
+    restore_tmps(d);
+}
+
+/* popcnt のない CPU での、32 ビットのレジスタ reg の 1 のビットの数。
+   2・4・8 ビットごとのビット数を並列に足し、最後に乗算で各バイトを合計する。
+ */
+static void gen_popcount_bits(const char *reg) {
+    emit("mov eax, %s", reg);
+    emit("shr eax, 1");
+    emit("and eax, 0x55555555");
+    emit("sub %s, eax", reg);
+    emit("mov eax, %s", reg);
+    emit("and %s, 0x33333333", reg);
+    emit("shr eax, 2");
+    emit("and eax, 0x33333333");
+    emit("add %s, eax", reg);
+    emit("mov eax, %s", reg);
+    emit("shr eax, 4");
+    emit("add %s, eax", reg);
+    emit("and %s, 0x0f0f0f0f", reg);
+    emit("imul %s, %s, 0x01010101", reg, reg);
+    emit("shr %s, 24", reg);
+}
+
+/* 組み込み関数。呼び出さずに、tmp(d) で値を計算する */
+static void gen_builtin(Node *node, int d) {
+    // locality 0～3 のプリフェッチ命令
+    static const char *prefetch_ops[] = {
+        "prefetchnta", "prefetcht2", "prefetcht1", "prefetcht0"};
+    Node **params = node->v.func.params;
+    const char *reg = sized_reg(tmp(d), 4);
+
+    comment("builtin: %.*s", node->v.func.len, node->v.func.name);
+    switch (node->v.func.builtin) {
+    case BI_POPCOUNT:
+        gen_expr(params[0], d);
+        if (option.popcnt == true) {
+            emit("popcnt %s, %s", reg, reg);
+        } else {
+            gen_popcount_bits(reg);
+        }
+        break;
+    case BI_CLZ:
+        // bsr は最上位の 1 のビットの位置を返すので、31 から引く
+        gen_expr(params[0], d);
+        if (option.lzcnt == true) {
+            emit("lzcnt %s, %s", reg, reg);
+        } else {
+            emit("bsr %s, %s", reg, reg);
+            emit("xor %s, 31", reg);
+        }
+        break;
+    case BI_CTZ:
+        gen_expr(params[0], d);
+        emit("%s %s, %s", (option.lzcnt == true) ? "tzcnt" : "bsf", reg, reg);
+        break;
+    case BI_BSWAP32:
+        gen_expr(params[0], d);
+        emit("bswap %s", reg);
+        break;
+    case BI_BSWAP64:
+        gen_expr_size(params[0], d, 8);
+        emit("bswap %s", tmp(d));
+        break;
+    case BI_PREFETCH: {
+        int locality = (node->v.func.num_param == 3) ? params[2]->v.num.val
+                                                     : 3;
+        gen_expr_size(params[0], d, 8);
+        emit("%s [%s]", prefetch_ops[locality], tmp(d));
+        emit("mov %s, 0", reg);
+        break;
+    }
+    case BI_EXPECT:
+        gen_expr(params[0], d);
+        break;
+    case BI_RDTSC:
+        // rdtsc は値を edx:eax に返す
+        emit("rdtsc");
+        emit("shl rdx, 32");
+        emit("or rax, rdx");
+        emit("mov %s, rax", tmp(d));
+        break;
+    default:
+        error("組み込み関数ではありません。");
+        break;
     }
-    comment("lvar: %.*s \n", node->v.lvar.len, node->v.lvar.name);
-    printf("    mov rax, rbp\n");
-    printf("    sub rax, %d\n", node->v.lvar.offset);
-    printf("    push rax\n");
 }
 
-/* 変数 */
-static void gen_lvar(Node *node) {
-    gen_lvar_addr(node);
-    printf("    pop rax\n");
-    printf("    mov rax, [rax]\n");
-    printf("    push rax\n");
+/* インライン展開された関数呼び出し */
+static void gen_inline(Node *node, int d) {
+    int cnt = label_count;
+    label_count++;
+
+    int prev_label = inline_label;
+    inline_label = cnt;
+
+    // 展開した本体はステートメントとして一時レジスタを使うので退避する
+    comment("inline: %.*s -->", node->v.inl.len, node->v.inl.name);
+    save_tmps(d);
+    bool prev_used = value_used;
+    value_used = true;
+    gen(node->v.inl.block);
+    value_used = prev_used;
+    // return でも末尾への到達でも、値は tmp_regs[0] にある
+    emit_label(".Linline_end%d", cnt);
+    if (d > 0) {
+        emit("mov %s, %s", tmp(d), tmp(0));
+    }
+    restore_tmps(d);
+    comment("inline: %.*s <--", node->v.inl.len, node->v.inl.name);
+
+    inline_label = prev_label;
+}
+
+/* 式の値を一時レジスタ tmp_regs[d] に求める。
+   tmp_regs[0]～[d-1] は計算中の値を保持しているので壊さない。
+ */
+static void gen_expr(Node *node, int d) {
+    if (node == NULL) {
+        emit("mov %s, 0xcc", tmp(d));
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_NULL:
+        emit("mov %s, 0xcc", tmp(d));
+        break;
+    case ND_NUM:
+        gen_num(node, d);
+        break;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        gen_op2(node, d);
+        break;
+    case ND_LVAR:
+        gen_lvar(node, d);
+        break;
+    case ND_ASSIGN:
+        gen_assign(node, d);
+        break;
+    case ND_FUNC:
+        if (node->v.func.builtin != BI_NONE) {
+            gen_builtin(node, d);
+        } else {
+            gen_call_func(node, d);
+        }
+        break;
+    case ND_ADDR:
+        gen_addr(node, d);
+        break;
+    case ND_DEREF:
+        gen_deref(node, d);
+        break;
+    case ND_INLINE:
+        gen_inline(node, d);
+        break;
+    default:
+        error("式ではないノードです。");
+        break;
+    }
+}
+
+/* 変数の領域のバイト数。レジスタの退避先を 8 の倍数の位置に置くため、
+   8 の倍数に切り上げる。
+ */
+static int locals_size(Node *deffunc) {
+    return (deffunc->v.deffunc.local_size + 7) / 8 * 8;
+}
+
+/* スタックフレーム (変数と、変数に割り当てたレジスタの退避先) の
+   バイト数。関数の入口で push rbp した後の rsp は 16 の倍数なので、
+   これを 16 の倍数にしておけば、関数の中の rsp の位置はコンパイル時に
+   分かる。
+ */
+static int frame_size(Node *deffunc) {
+    int size = locals_size(deffunc) + deffunc->v.deffunc.num_var_reg * 8;
+    return (size + 15) / 16 * 16;
+}
+
+/* 変数に割り当てたレジスタの退避先の rbp (rsp) からのオフセット */
+static int saved_reg_offset(Node *deffunc, int reg) {
+    return locals_size(deffunc) + reg * 8;
+}
+
+/* 変数に割り当てたレジスタを復元する */
+static void gen_restore_regs(Node *deffunc) {
+    for (int reg = 1; reg <= deffunc->v.deffunc.num_var_reg; reg++) {
+        emit("mov %s, [%s-%d]",
+             var_regs[reg],
+             frame_reg(),
+             saved_reg_offset(deffunc, reg));
+    }
+}
+
+/* 変数に割り当てたレジスタを復元し、スタックフレームを破棄する */
+static void gen_leave(Node *deffunc) {
+    gen_restore_regs(deffunc);
+    if ((omit_frame == false) && (option.size == true)) {
+        emit("leave");
+    } else if (omit_frame == false) {
+        emit("mov rsp, rbp");
+        emit("pop rbp");
+    }
 }
 
-/* 代入 */
-static void gen_assign(Node *node) {
-    gen_lvar_addr(node->v.op2.lhs);
-    gen(node->v.op2.rhs);
-    comment("assign\n");
-    printf("    pop rdi\n");
-    printf("    pop rax\n");
-    printf("    mov [rax], rdi\n");
-    printf("    push rdi\n");
+/* 末尾呼び出し: return func(...); */
+static void gen_tail_call(Node *node) {
+    int i;
+    Node *deffunc = cur_func;
+
+    comment("tail call: %.*s", node->v.func.len, node->v.func.name);
+    if ((node->v.func.len == deffunc->v.deffunc.len)
+        && (memcmp(node->v.func.name,
+                   deffunc->v.deffunc.name,
+                   node->v.func.len)
+            == 0)
+        && (node->v.func.num_param == deffunc->v.deffunc.num_param)) {
+        // 自己再帰: パラメータを書き換えて関数の先頭へ戻るループにする。
+        // 引数はすべて計算してから書き換える。
+        for (i = 0; i < node->v.func.num_param; i++) {
+            if (is_unused_arg(deffunc, i, node->v.func.params[i]) == false) {
+                gen_expr(node->v.func.params[i], i);
+            }
+        }
+        for (i = 0; i < node->v.func.num_param; i++) {
+            if (is_param_used(deffunc, i) == true) {
+                gen_store_var(deffunc->v.deffunc.params[i], tmp(i));
+            }
+        }
+        emit_jump("jmp",
+                  ".Lbody_%.*s",
+                  deffunc->v.deffunc.len,
+                  deffunc->v.deffunc.name);
+        return;
+    }
+
+    // 他の関数: スタックフレームを破棄してから jmp する。
+    // 呼び出し先は、この関数の呼び出し元へ直接戻る。
+    gen_args(node);
+    gen_leave(deffunc);
+    emit_exit("jmp %s", callee_name(node));
 }
 
 /* return */
 static void gen_return(Node *node) {
-    gen(node->v.op1.expr);
-    comment("return\n");
-    printf("    pop rax\n");
-    /*
-    printf("    mov rsp, rbp\n");
-    printf("    pop rbp\n");
-    printf("    ret\n");
-     */
-    printf("    jmp .Lret_%.*s\n",
-           cur_func->v.deffunc.len,
-           cur_func->v.deffunc.name);
+    // インライン展開された関数の return は、関数の末尾ではない。
+    // アドレスを取られた変数があれば、呼び出し先がそれを使うかもしれない
+    // ので、スタックフレームを残して普通に呼び出す。
+    if ((inline_label < 0) && (node->v.op1.expr->kind == ND_FUNC)
+        && (node->v.op1.expr->v.func.builtin == BI_NONE)
+        && (cur_func->v.deffunc.has_escape == false)) {
+        gen_tail_call(node->v.op1.expr);
+        return;
+    }
+
+    gen_expr(node->v.op1.expr, 0);
+    comment("return");
+    if (inline_label >= 0) {
+        // インライン展開された関数からは、展開先の末尾へ抜ける
+        emit_jump("jmp", ".Linline_end%d", inline_label);
+        return;
+    }
+    emit("mov rax, %s", tmp(0));
+    emit_jump("jmp",
+              ".Lret_%.*s",
+              cur_func->v.deffunc.len,
+              cur_func->v.deffunc.name);
 }
 
 /* if */
+/* 条件式 test を評価し、その真偽が jump_if と同じなら label へ分岐する。
+   比較演算子なら cmp のフラグで直接分岐し、値 (0 か 1) は作らない。
+   keep_value が true なら、分岐するときの tmp_regs[0] を条件の値にする。
+ */
+static void gen_branch(Node *test,
+                       bool jump_if,
+                       bool keep_value,
+                       const char *label) {
+    // __builtin_expect(x, c) は x で分岐し、分岐するかどうかの予測を
+    // 条件ジャンプに付ける
+    BranchHint hint = HINT_NONE;
+    if ((test->kind == ND_FUNC) && (test->v.func.builtin == BI_EXPECT)) {
+        bool expected = (test->v.func.params[1]->v.num.val != 0);
+        hint = (expected == jump_if) ? HINT_LIKELY : HINT_UNLIKELY;
+        test = test->v.func.params[0];
+    }
+
+    if (is_compare(test) == true) {
+        Node *lhs_node = test->v.op2.lhs;
+        Node *rhs_node = test->v.op2.rhs;
+        const char *lhs;
+        const char *rhs;
+        int size = op_size(test);
+        if (((lhs_node->kind == ND_LVAR) || (is_mem_operand(lhs_node) == true))
+            && (node_size(lhs_node) == size)
+            && ((rhs_node->kind == ND_NUM) || (is_reg_var(rhs_node) == true)
+                || ((is_reg_var(lhs_node) == true)
+                    && (is_operand(rhs_node, size) == true)))) {
+            // 変数・メモリをそのまま比べる
+            lhs = operand(lhs_node, size);
+            rhs = operand(rhs_node, size);
+        } else {
+            gen_operands(lhs_node,
+                         rhs_node,
+                         rhs_is_operand(test),
+                         size,
+                         0,
+                         &lhs,
+                         &rhs);
+        }
+        emit("cmp %s, %s", lhs, rhs);
+        if (keep_value == true) {
+            // mov はフラグを変えない
+            emit("mov %s, %d", tmp(0), (jump_if == true) ? 1 : 0);
+        }
+        Line *jump = emit_jump(
+            format("j%s", cond_codes[test->kind][(jump_if == true) ? 0 : 1]),
+            "%s",
+            label);
+        jump->hint = hint;
+        return;
+    }
+    gen_expr(test, 0);
+    emit("cmp %s, 0", sized_reg(tmp(0), node_size(test)));
+    Line *jump = emit_jump((jump_if == true) ? "jne" : "je", "%s", label);
+    jump->hint = hint;
+}
+
 static void gen_if(Node *node) {
     int cnt = label_count;
     label_count++;
 
-    comment("if - test -->\n");
-    gen(node->v.cif.test);
-    comment("if - test <--\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, 0\n");
-    printf("    je .Lelse%d\n", cnt);
-    comment("if - tbody -->\n");
+    comment("if - test -->");
+    if (node->v.cif.ebody == NULL) {
+        // else がなければ、偽のときは then-body を飛び越えるだけにする
+        // 値は then-body の値か、偽のときは条件の値 (0)。
+        gen_branch(node->v.cif.test,
+                   false,
+                   value_used,
+                   format(".Lend%d", cnt));
+        comment("if - test <--");
+        comment("if - tbody -->");
+        gen(node->v.cif.tbody);
+        comment("if - tbody <--");
+        emit_label(".Lend%d", cnt);
+        return;
+    }
+    gen_branch(node->v.cif.test, false, false, format(".Lelse%d", cnt));
+    comment("if - test <--");
+    comment("if - tbody -->");
     gen(node->v.cif.tbody);
-    comment("if - tbody <--\n");
-    printf("    jmp .Lend%d\n", cnt);
-    printf(".Lelse%d:\n", cnt);
-    comment("if - ebody -->\n");
+    comment("if - tbody <--");
+    emit_jump("jmp", ".Lend%d", cnt);
+    emit_label(".Lelse%d", cnt);
+    comment("if - ebody -->");
     gen(node->v.cif.ebody);
-    comment("if - ebody <--\n");
-    printf(".Lend%d:\n", cnt);
+    comment("if - ebody <--");
+    emit_label(".Lend%d", cnt);
+}
+
+/* ループの条件が常に真なら true を返す。条件の省略 (NULL) も真 */
+static bool is_always_true(Node *test) {
+    return (test == NULL)
+           || ((test->kind == ND_NUM) && (test->v.num.val != 0));
+}
+
+/* ループの条件を評価し、真なら .Lbegin へ戻る。
+   条件を末尾に置くことで、1 周あたりの分岐を後方への条件ジャンプ
+   1 つにする (ループの回転)。
+ */
+static void gen_loop_test(Node *test, int cnt) {
+    emit_label(".Ltest%d", cnt);
+    if (is_always_true(test) == true) {
+        emit_jump("jmp", ".Lbegin%d", cnt);
+        return;
+    }
+    comment("loop - test -->");
+    gen_branch(test, true, false, format(".Lbegin%d", cnt));
+    comment("loop - test <--");
+}
+
+/* ループ・switch を抜ける .Lbreak を置く。値が使われるなら、抜けたときの
+   値 (0) を置く。条件で分岐するときや break では値を作らないため。
+ */
+static void gen_break_label(int cnt) {
+    emit_label(".Lbreak%d", cnt);
+    if (value_used == true) {
+        emit("mov %s, 0", tmp(0));
+    }
 }
 
 /* while */
@@ -186,22 +1767,111 @@ static void gen_while(Node *node) {
     int cnt = label_count;
     label_count++;
 
-    comment("while\n");
-    printf(".Lbegin%d:\n", cnt);
-    comment("while - test -->\n");
-    gen(node->v.cwhile.test);
-    comment("while - test <--\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, 0\n");
-    printf("    je .Lbreak%d\n", cnt);
-    comment("while - body -->\n");
+    comment("while");
+    if (is_always_true(node->v.cwhile.test) == false) {
+        emit_jump("jmp", ".Ltest%d", cnt);
+    }
+    emit_label(".Lbegin%d", cnt);
+    comment("while - body -->");
+    bool prev_used = value_used;
+    int prev_break = break_label;
+    value_used = false;
+    break_label = cnt;
     gen(node->v.cwhile.body);
-    comment("while - body <--\n");
-    printf("    pop rax\n");
-    printf("    jmp .Lbegin%d\n", cnt);
-    printf(".Lbreak%d:\n", cnt);
-    gen(NULL);  // dummy push
-    printf(".Lend%d:\n", cnt);
+    value_used = prev_used;
+    break_label = prev_break;
+    comment("while - body <--");
+    gen_loop_test(node->v.cwhile.test, cnt);
+    gen_break_label(cnt);
+}
+
+/* ループ不変の式を格納したベクトルレジスタの番号。なければ -1。
+   ループ不変の式は、番号の大きいレジスタから順に割り当てる。
+ */
+static int find_vec_invariant(VecLoop *vec, Node *node) {
+    for (int i = 0; i < vec->num_invariant; i++) {
+        if (vec->invariants[i] == node) {
+            return NUM_VEC_REG - 1 - i;
+        }
+    }
+    return -1;
+}
+
+/* ベクトル化した値の式を計算し、ベクトルレジスタ d に求める。
+   d より大きい番号のレジスタを一時的に使う。
+ */
+static void gen_vec_expr(VecLoop *vec, Node *node, int d) {
+    bool avx = (option.isa == ISA_AVX2);
+    int r = find_vec_invariant(vec, node);
+    if (r >= 0) {
+        emit(avx ? "vmovdqa ymm%d, ymm%d" : "movdqa xmm%d, xmm%d", d, r);
+        return;
+    }
+    if (node->kind == ND_DEREF) {
+        char *mem = gen_address(node->v.op1.expr, 0);
+        emit(avx ? "vmovdqu ymm%d, %s" : "movdqu xmm%d, %s", d, mem);
+        return;
+    }
+
+    gen_vec_expr(vec, node->v.op2.lhs, d);
+    r = find_vec_invariant(vec, node->v.op2.rhs);
+    if (r < 0) {
+        r = d + 1;
+        gen_vec_expr(vec, node->v.op2.rhs, r);
+    }
+    const char *op = (node->kind == ND_ADD) ? "paddd" : "psubd";
+    if (avx == true) {
+        emit("v%s ymm%d, ymm%d, ymm%d", op, d, d, r);
+    } else {
+        emit("%s xmm%d, xmm%d", op, d, r);
+    }
+}
+
+/* ベクトル化したループ。
+   ベクトル 1 つ分ずつ処理し、残りは後に続く元のループで処理する。
+   格納先と読み出し元が重なっていれば、元のループだけを実行する。
+ */
+static void gen_vec_loop(VecLoop *vec, int cnt) {
+    bool avx = (option.isa == ISA_AVX2);
+    int i;
+
+    comment("vectorized loop -->");
+
+    // 0 < (格納先 - 読み出し元) < ベクトルのバイト数 なら重なっている
+    for (i = 0; i < vec->num_check; i++) {
+        gen_expr(vec->checks[i], 0);
+        emit("sub %s, 1", tmp(0));
+        emit("cmp %s, %d", tmp(0), vec->bytes - 1);
+        emit_jump("jb", ".Lscalar%d", cnt);
+    }
+
+    // ループ不変の式は、ループの前に全要素へ展開しておく
+    for (i = 0; i < vec->num_invariant; i++) {
+        int r = find_vec_invariant(vec, vec->invariants[i]);
+        gen_expr(vec->invariants[i], 0);
+        if (avx == true) {
+            emit("vmovd xmm%d, %s", r, sized_reg(tmp(0), 4));
+            emit("vpbroadcastd ymm%d, xmm%d", r, r);
+        } else {
+            emit("movd xmm%d, %s", r, sized_reg(tmp(0), 4));
+            emit("pshufd xmm%d, xmm%d, 0", r, r);
+        }
+    }
+
+    emit_jump("jmp", ".Lvtest%d", cnt);
+    emit_label(".Lvbody%d", cnt);
+    gen_vec_expr(vec, vec->value, 0);
+    char *mem = gen_address(vec->store->v.op1.expr, 0);
+    emit(avx ? "vmovdqu %s, ymm0" : "movdqu %s, xmm0", mem);
+    gen_expr(vec->vupdate, 0);
+    emit_label(".Lvtest%d", cnt);
+    gen_branch(vec->vtest, true, false, format(".Lvbody%d", cnt));
+    emit_label(".Lscalar%d", cnt);
+    if (avx == true) {
+        emit("vzeroupper");
+    }
+
+    comment("vectorized loop <--");
 }
 
 /* for */
@@ -209,183 +1879,412 @@ static void gen_for(Node *node) {
     int cnt = label_count;
     label_count++;
 
-    comment("for - init -->\n");
+    // ループの中のステートメントの値は使われない
+    bool prev_used = value_used;
+    value_used = false;
+    comment("for - init -->");
     gen(node->v.cfor.init);
-    comment("for - init <--\n");
-    printf("    pop rax\n");
-    printf(".Lbegin%d:\n", cnt);
-    comment("for - test -->\n");
-    gen(node->v.cfor.test);
-    comment("for - test <--\n");
-    printf("    pop rax\n");
-    printf("    cmp rax, 0\n");
-    printf("    je .Lbreak%d\n", cnt);
-    comment("for - body -->\n");
+    comment("for - init <--");
+    if (node->v.cfor.vec != NULL) {
+        gen_vec_loop(node->v.cfor.vec, cnt);
+    }
+    if (is_always_true(node->v.cfor.test) == false) {
+        emit_jump("jmp", ".Ltest%d", cnt);
+    }
+    emit_label(".Lbegin%d", cnt);
+    comment("for - body -->");
+    int prev_break = break_label;
+    break_label = cnt;
     gen(node->v.cfor.body);
-    comment("for - body <--\n");
-    printf("    pop rax\n");
-    comment("for - update -->\n");
+    break_label = prev_break;
+    comment("for - body <--");
+    comment("for - update -->");
     gen(node->v.cfor.update);
-    comment("for - update <--\n");
-    printf("    pop rax\n");
-    printf("    jmp .Lbegin%d\n", cnt);
-    printf(".Lbreak%d:\n", cnt);
-    gen(NULL);  // dummy push
-    printf(".Lend%d:\n", cnt);
+    comment("for - update <--");
+    gen_loop_test(node->v.cfor.test, cnt);
+    value_used = prev_used;
+    gen_break_label(cnt);
 }
 
-/* 関数呼び出し */
-static void gen_call_func(Node *node) {
-    int i;
-    const char *regs[] = {"rdi",
-                          "rsi",
-                          "rdx",
-                          "rcx",
-                          "r8",
-                          "r9"};  // 第1～6引数に使用するレジスタ
-
-    comment("func: %.*s\n", node->v.func.len, node->v.func.name);
-    for (i = 0; i < node->v.func.num_param; i++) {
-        gen(node->v.func.params[i]);
-    }
-    for (i = (node->v.func.num_param - 1); i >= 0; i--) {
-        printf("    pop %s\n", regs[i]);
-    }
-    // 関数呼び出しのまえに、rspを16の倍数に整える
-    printf("    push r12\n");
-    printf("    mov r12, rsp\n");
-    printf("    and r12, 0xf\n");
-    printf("    sub rsp, r12\n");
-    printf("    call %.*s\n", node->v.func.len, node->v.func.name);
-    printf("    add rsp, r12\n");
-    printf("    pop r12\n");
-    printf("    push rax\n");
-}
-
-/* 関数定義 */
-static void gen_define_func(Node *deffunc) {
-    int i;
-    const char *regs[] = {"rdi",
-                          "rsi",
-                          "rdx",
-                          "rcx",
-                          "r8",
-                          "r9"};  // 第1～6引数に使用するレジスタ
+/* ジャンプテーブルにする case の最小の個数 */
+#define MIN_TABLE_CASE (4)
 
-    cur_func = deffunc;
+/* ジャンプテーブルの最大の要素数 */
+#define MAX_TABLE_SIZE (4096)
+
+/* ジャンプテーブルにする区間の、case の値の最小の密度 (%) */
+#define MIN_TABLE_DENSITY (40)
+
+/* 線形に比べる case の最大の個数 */
+#define MAX_LINEAR_CASE (3)
+
+/* switch の case の値と、その位置 (本体のステートメントの番号) */
+typedef struct {
+    int val;
+    int pos;
+} SwitchCase;
+
+/* 1 回で振り分ける case の区間 (並べた case の first から last まで)。
+   first と last が同じなら比較 1 つ、違えばジャンプテーブルで振り分ける
+ */
+typedef struct {
+    int first;
+    int last;
+} SwitchCluster;
+
+/* 生成中の switch */
+typedef struct {
+    int cnt;                  // ラベル番号
+    SwitchCase *cases;        // 値の順に並べた case
+    SwitchCluster *clusters;  // 値の順に並べた区間
+    int num_cluster;
+    const char *reg;          // test の値のレジスタ
+    int size;                 // test の値のバイト数
+    char *default_label;      // 一致しないときの飛び先
+} Switch;
+
+static int compare_case(const void *a, const void *b) {
+    int x = ((const SwitchCase *)a)->val;
+    int y = ((const SwitchCase *)b)->val;
+    return (x > y) - (x < y);
+}
+
+/* case のラベル */
+static char *case_label(Switch *sw, int pos) {
+    return format(".Lcase%d_%d", sw->cnt, pos);
+}
+
+/* 並べた case を区間に分ける。先頭から順に、MIN_TABLE_CASE 個以上の case を
+   MIN_TABLE_DENSITY % 以上の密度で含む最長の区間をジャンプテーブルにし、
+   そうできない case は 1 つずつの区間にする。
+ */
+static void cluster_cases(Switch *sw, int num_case) {
+    sw->clusters = calloc(num_case, sizeof(SwitchCluster));
+    sw->num_cluster = 0;
+    int i = 0;
+    while (i < num_case) {
+        int last = i;
+        // lo - INT32_MIN は 32 ビットに収まらないので、テーブルにしない
+        for (int j = i + MIN_TABLE_CASE - 1;
+             (j < num_case) && (sw->cases[i].val > INT32_MIN);
+             j++) {
+            int64_t range
+                = (int64_t)sw->cases[j].val - sw->cases[i].val + 1;
+            if (range > MAX_TABLE_SIZE) {
+                break;
+            }
+            if ((j - i + 1) * 100 >= range * MIN_TABLE_DENSITY) {
+                last = j;
+            }
+        }
+        sw->clusters[sw->num_cluster] = (SwitchCluster){i, last};
+        sw->num_cluster++;
+        i = last + 1;
+    }
+}
+
+/* 区間をジャンプテーブルで振り分ける。区間の外なら default へ飛ぶ。
+   テーブルには飛び先とテーブルの差を 32 ビットで置く。
+ */
+static void gen_switch_table(Switch *sw, SwitchCluster *cl) {
+    int lo = sw->cases[cl->first].val;
+    int num = sw->cases[cl->last].val - lo + 1;
+    char *name = format(".Ltable%d_%d", sw->cnt, cl->first);
+    char **targets = calloc(num, sizeof(char *));
+    for (int i = 0; i < num; i++) {
+        targets[i] = sw->default_label;
+    }
+    for (int i = cl->first; i <= cl->last; i++) {
+        targets[sw->cases[i].val - lo] = case_label(sw, sw->cases[i].pos);
+    }
+
+    // 値 - lo を符号なしで比べて、範囲外をまとめて default へ飛ばす
+    const char *index = sized_reg("rax", sw->size);
+    if (lo == 0) {
+        emit("mov %s, %s", index, sw->reg);
+    } else if (lo > 0) {
+        emit("lea %s, [%s-%d]", index, tmp(0), lo);
+    } else {
+        emit("lea %s, [%s+%d]", index, tmp(0), -lo);
+    }
+    emit("cmp %s, %d", index, num - 1);
+    emit_jump("ja", "%s", sw->default_label);
+    emit("lea rdx, [rip+%s]", name);
+    emit("movsxd rax, DWORD PTR [rdx+rax*4]");
+    emit("add rax, rdx");
+    emit_table(name, targets, num);
+}
+
+/* 区間 [lo, hi) の case へ振り分ける。区間が少なければ順に比べ、
+   多ければ真ん中の区間の最小値と比べて二分探索する。
+   cmp_lo が true なら、フラグは区間 lo の最小値と比べた結果になっている。
+ */
+static void gen_switch_tree(Switch *sw, int lo, int hi, bool cmp_lo) {
+    if ((hi - lo == 1) && (sw->clusters[lo].first != sw->clusters[lo].last)) {
+        gen_switch_table(sw, &sw->clusters[lo]);
+        return;
+    }
+    bool linear = (hi - lo <= MAX_LINEAR_CASE);
+    for (int i = lo; (linear == true) && (i < hi); i++) {
+        linear = (sw->clusters[i].first == sw->clusters[i].last);
+    }
+    if (linear == true) {
+        for (int i = lo; i < hi; i++) {
+            SwitchCase *c = &sw->cases[sw->clusters[i].first];
+            if ((i > lo) || (cmp_lo == false)) {
+                emit("cmp %s, %d", sw->reg, c->val);
+            }
+            emit_jump("je", "%s", case_label(sw, c->pos));
+        }
+        emit_jump("jmp", "%s", sw->default_label);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    emit("cmp %s, %d", sw->reg, sw->cases[sw->clusters[mid].first].val);
+    emit_jump("jl", ".Lsw%d_%d", sw->cnt, mid);
+    gen_switch_tree(sw, mid, hi, true);
+    emit_label(".Lsw%d_%d", sw->cnt, mid);
+    gen_switch_tree(sw, lo, mid, false);
+}
+
+/* switch。
+   case の値を並べて、密な区間はジャンプテーブル、それ以外は比較にし、
+   区間を二分探索して振り分ける。本体は case・default の位置にラベルを
+   置いて、そのまま順に生成する (フォールスルーする)。
+ */
+static void gen_switch(Node *node) {
+    Node *body = node->v.cswitch.body;
+    Switch sw;
+    sw.cnt = label_count;
+    label_count++;
+
+    // case の値を集めて並べる。default がなければ switch の後ろへ飛ぶ
+    sw.cases = calloc(body->v.block.num_code + 1, sizeof(SwitchCase));
+    sw.default_label = format(".Lbreak%d", sw.cnt);
+    int num_case = 0;
+    for (int i = 0; i < body->v.block.num_code; i++) {
+        Node *stmt = body->v.block.code[i];
+        if (stmt->kind != ND_CASE) {
+            continue;
+        }
+        if (stmt->v.ccase.is_default == true) {
+            sw.default_label = case_label(&sw, i);
+        } else {
+            sw.cases[num_case] = (SwitchCase){stmt->v.ccase.val, i};
+            num_case++;
+        }
+    }
+    qsort(sw.cases, num_case, sizeof(SwitchCase), compare_case);
+    cluster_cases(&sw, num_case);
+
+    comment("switch - test -->");
+    Node *test = node->v.cswitch.test;
+    gen_expr(test, 0);
+    sw.size = node_size(test);
+    sw.reg = sized_reg(tmp(0), sw.size);
+    comment("switch - test <--");
+    gen_switch_tree(&sw, 0, sw.num_cluster, false);
+
+    comment("switch - body -->");
+    bool prev_used = value_used;
+    int prev_break = break_label;
+    value_used = false;
+    break_label = sw.cnt;
+    for (int i = 0; i < body->v.block.num_code; i++) {
+        Node *stmt = body->v.block.code[i];
+        if (stmt->kind == ND_CASE) {
+            emit_label("%s", case_label(&sw, i));
+        } else {
+            gen(stmt);
+        }
+    }
+    value_used = prev_used;
+    break_label = prev_break;
+    comment("switch - body <--");
+    gen_break_label(sw.cnt);
+    free(sw.cases);
+    free(sw.clusters);
+}
+
+/* アセンブリを出力せず、アセンブラで機械語にするなら true を返す */
+static bool to_machine_code(void) {
+    return (option.obj == true) || (option.run == true);
+}
 
-    // 関数名
-    printf("%.*s:\n", deffunc->v.deffunc.len, deffunc->v.deffunc.name);
-    printf("    nop\n");  // アセンブリデバッグでブレイクポイントを貼るためのnp
+/* 関数の本体 (プロローグからエピローグまで) のコードを生成する */
+static void gen_func_body(Node *deffunc) {
+    int i;
+
+    code.num_line = 0;
+    push_depth = 0;
+    if ((omit_frame == false) && (option.size == false)) {
+        emit("nop");  // アセンブリデバッグでブレイクポイントを貼るためのnp
+    }
 
     // プロローグ
-    comment("prologue\n");
+    comment("prologue");
+    if (omit_frame == false) {
+        // レジスタを退避
+        emit("push rbp");
+        emit("mov rbp, rsp");
+
+        // スタックフレームを確保
+        int size = frame_size(deffunc);
+        if (size > 0) {
+            emit("sub rsp, %d", size);
+        }
+    }
 
-    // レジスタを退避
-    printf("    push rbp\n");
-    printf("    mov rbp, rsp\n");
+    // 変数に割り当てるレジスタを退避
+    for (i = 1; i <= deffunc->v.deffunc.num_var_reg; i++) {
+        emit("mov [%s-%d], %s",
+             frame_reg(),
+             saved_reg_offset(deffunc, i),
+             var_regs[i]);
+    }
 
-    // パラメータを変数領域にセット
+    // パラメータを変数の場所にセット。使わないパラメータは格納しない
     for (i = 0; i < deffunc->v.deffunc.num_param; i++) {
-        printf("    push %s\n", regs[i]);
+        if (is_param_used(deffunc, i) == true) {
+            gen_store_var(deffunc->v.deffunc.params[i],
+                          param_reg(deffunc, i));
+        }
     }
 
-    // 変数の領域を確保
-    for (; i < deffunc->v.deffunc.block->v.block.total_local; i++) {
-        printf("    push 0xcc\n");
-    }
-    printf("\n");
+    // 自己再帰の末尾呼び出しはここへ戻る
+    emit_label(".Lbody_%.*s", deffunc->v.deffunc.len, deffunc->v.deffunc.name);
 
     // ブロック内のコードを生成
+    value_used = true;
     gen(deffunc->v.deffunc.block);
+    // return せずに末尾に到達したときは、最後のステートメントの値を返す
+    emit("mov rax, %s", tmp(0));
 
     // エピローグ
-    comment("epilogue\n");
-    printf(".Lret_%.*s:\n", deffunc->v.deffunc.len, deffunc->v.deffunc.name);
-    printf("    mov rsp, rbp\n");
-    printf("    pop rbp\n");
-    printf("    ret\n");
+    comment("epilogue");
+    emit_label(".Lret_%.*s", deffunc->v.deffunc.len, deffunc->v.deffunc.name);
+    gen_leave(deffunc);
+    emit_exit("ret");
 }
 
-/* ブロック */
-static void gen_block(Node *block) {
-    if (block->v.block.num_code > 0) {
-        int i = 0;
-        while (1) {
-            gen(block->v.block.code[i]);
-            i++;
-            if (i >= block->v.block.num_code) {
-                break;
-            }
-            // ステートメントごとに、そのステートメントが push した値を pop
-            // する。 しかし、ブロックの最後のステートメントは、次の gen() で
-            // pop される。
-            printf("    pop rax\n");
+/* コードに、スタックフレームが要る命令 (関数呼び出し・push・
+   末尾呼び出し) があれば true を返す。push はレッドゾーンを上書きする。
+ */
+static bool needs_frame(Code *code) {
+    for (int i = 0; i < code->num_line; i++) {
+        Line *line = &code->lines[i];
+        if ((line->kind == LN_INSN)
+            && ((strcmp(line->op, "call") == 0)
+                || (strcmp(line->op, "push") == 0))) {
+            return true;
+        }
+        if ((line->kind == LN_EXIT) && (strcmp(line->op, "jmp") == 0)) {
+            return true;
         }
     }
+    return false;
 }
 
-/* アドレス取得 */
-static void gen_addr(Node *node) {
-    comment("&{var}\n");
-    gen_lvar_addr(node->v.op1.expr);
+/* 関数のコードを出力するか、機械語にする */
+static void output_func(const char *name, int len, bool is_static) {
+    if ((to_machine_code() == true) || (option.size_report == true)) {
+        // -fsize-report では、大きさを求めるためにアセンブリも機械語にする
+        assemble_func(name, len, is_static, &code);
+    }
+    if (to_machine_code() == false) {
+        if (is_static == false) {
+            out_str(".global ");
+            out_write(name, len);
+            out_write("\n", 1);
+        }
+        out_write(name, len);
+        out_write(":\n", 2);
+        print_code(&code);
+    }
+    code.num_line = 0;
 }
 
-/* 参照外し */
-static void gen_deref(Node *node) {
-    comment("*{var} (1/2)\n");
-    gen(node->v.op1.expr);
-    comment("*{var} (2/2)\n");
-    printf("    pop rax\n");
-    printf("    mov rax, [rax]\n");
-    printf("    push rax\n");
+/* 外部から System V ABI で呼ばれるラッパー。引数を独自の規約の
+   レジスタへ移し、直後に置く本体へフォールスルーする。
+   regs[i + 1] は tmp_regs[i] なので、後ろの引数から移せば移す前の値を
+   壊さない。
+ */
+static void gen_wrapper(Node *deffunc) {
+    code.num_line = 0;
+    comment("wrapper: System V => internal");
+    for (int i = deffunc->v.deffunc.num_param - 1; i >= 0; i--) {
+        if ((is_param_used(deffunc, i) == true)
+            && (strcmp(regs[i], tmp_regs[i]) != 0)) {
+            emit("mov %s, %s", tmp_regs[i], regs[i]);
+        }
+    }
+    output_func(deffunc->v.deffunc.name, deffunc->v.deffunc.len, false);
+}
+
+/* 関数定義。
+   -fomit-frame-pointer なら、変数がレッドゾーンに収まる関数をまず
+   フレームなしで生成し、関数呼び出しなどがあれば (葉関数でなければ)
+   フレームを作って生成し直す。
+ */
+static void gen_define_func(Node *deffunc) {
+    cur_func = deffunc;
+
+    // 関数名。ラッパーを付けるなら、本体は static な別のシンボルにする
+    char *name = deffunc->v.deffunc.name;
+    int len = deffunc->v.deffunc.len;
+    bool is_static = deffunc->v.deffunc.is_static;
+    if (deffunc->v.deffunc.conv == CONV_WRAPPED) {
+        gen_wrapper(deffunc);
+        name = format("%.*s.internal", len, name);
+        len = strlen(name);
+        is_static = true;
+    }
+
+    int frame = locals_size(deffunc) + deffunc->v.deffunc.num_var_reg * 8;
+    omit_frame = (option.omit_frame_pointer == true)
+                 && (frame <= RED_ZONE_SIZE);
+    int first_label = label_count;
+    gen_func_body(deffunc);
+    if ((omit_frame == true) && (needs_frame(&code) == true)) {
+        omit_frame = false;
+        label_count = first_label;
+        gen_func_body(deffunc);
+    }
+    omit_frame = false;
+
+    if (option.layout == true) {
+        layout_blocks(&code);
+    }
+    peephole(&code);
+    if (option.schedule == true) {
+        schedule_insns(&code, name, len);
+    }
+    output_func(name, len, is_static);
+    reset_text();
+}
+
+/* ブロック */
+static void gen_block(Node *block) {
+    // 値が使われるのは最後のステートメントだけ
+    bool prev_used = value_used;
+    for (int i = 0; i < block->v.block.num_code; i++) {
+        value_used = (prev_used == true) && (i == block->v.block.num_code - 1);
+        gen(block->v.block.code[i]);
+    }
+    value_used = prev_used;
 }
 
-/* 抽象構文木を下りながらコードを生成 */
+/* 抽象構文木を下りながらコードを生成する。
+   式のステートメントは、値を一時レジスタ tmp_regs[0] に残す。
+   ブロックの値は最後のステートメントの値になる。
+ */
 void gen(Node *node) {
     if (node == NULL) {
-        // 式が無いときに何もpushしないと、次のpopでスタックがアンダーフローするため、ダミーpushする。
-        printf("    push 0xcc\n");
         return;
     }
 
     switch (node->kind) {
-    case ND_NULL:
-        gen_null(node);
-        break;
-    case ND_NUM:
-        gen_num(node);
-        break;
-    case ND_ADD:
-        gen_add(node);
-        break;
-    case ND_SUB:
-        gen_sub(node);
-        break;
-    case ND_MUL:
-        gen_mul(node);
-        break;
-    case ND_DIV:
-        gen_div(node);
-        break;
-    case ND_EQ:
-        gen_eq(node);
-        break;
-    case ND_NE:
-        gen_ne(node);
-        break;
-    case ND_LT:
-        gen_lt(node);
-        break;
-    case ND_LE:
-        gen_le(node);
-        break;
-    case ND_LVAR:
-        gen_lvar(node);
-        break;
-    case ND_ASSIGN:
-        gen_assign(node);
-        break;
     case ND_RETURN:
         gen_return(node);
         break;
@@ -398,24 +2297,47 @@ void gen(Node *node) {
     case ND_FOR:
         gen_for(node);
         break;
+    case ND_SWITCH:
+        gen_switch(node);
+        break;
+    case ND_BREAK:
+        emit_jump("jmp", ".Lbreak%d", break_label);
+        break;
     case ND_BLOCK:
         gen_block(node);
         break;
-    case ND_FUNC:
-        gen_call_func(node);
-        break;
     case ND_DEFFUNC:
         gen_define_func(node);
         break;
-    case ND_ADDR:
-        gen_addr(node);
-        break;
-    case ND_DEREF:
-        gen_deref(node);
+    case ND_NULL:
+        // 変数の宣言などの空のステートメントは、値を使うときだけ値を置く
+        if (value_used == true) {
+            gen_expr(node, 0);
+        }
         break;
     default:
-        error("未定義のノードです。");
+        gen_expr(node, 0);
         break;
     }
-    printf("\n");
-}
\ No newline at end of file
+}
+
+/* プログラム全体のアセンブリを出力する */
+void gen_program(Node *program) {
+    if (option.run == true) {
+        // --run: 機械語にするだけで、実行は jit_run で行う
+        gen(program);
+        return;
+    }
+    if (option.obj == true) {
+        // -c: アセンブラを通さずにオブジェクトファイルを出力する
+        gen(program);
+        size_t size;
+        char *obj = assemble_object(&size);
+        out_write(obj, size);
+        free(obj);
+    } else {
+        out_str(".intel_syntax noprefix\n");
+        gen(program);
+    }
+    flush_output();
+}
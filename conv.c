@@ -0,0 +1,125 @@
+/* 呼び出し規約の選択
+
+   同じプログラム内から呼び出される関数は、System V ABI に従わなくても
+   よいので、コード生成に都合のよい独自の規約 (CONV_FAST) にする。
+
+   - 引数は、呼び出し元が引数の式を計算する一時レジスタ (rdi, rsi, rcx,
+     r8, r9, r10, r11) にそのまま置く。System V の引数レジスタ (rdx, rcx,
+     r8, r9) へ移し替える mov が要らず、引数を MAX_PARAM 個まで渡せる
+   - 関数の中で使わないパラメータには、定数や変数を渡さない
+
+   static 関数は常に独自の規約にする。static でない関数は、プログラム内
+   から呼び出されるときだけ独自の規約にする。使うパラメータのレジスタが
+   System V と違えば、本体は「関数名.internal」という static なシンボルに
+   して、外部から呼ぶための System V のラッパーを関数名で直前に置く
+   (CONV_WRAPPED)。ラッパーは引数を移し替えて本体へフォールスルーする。
+   どの規約でも、使わないパラメータはプロローグで変数に格納しない。
+ */
+#include "9cc.h"
+
+/* System V と独自の規約で引数レジスタが同じになるパラメータの数 (rdi, rsi) */
+#define NUM_SAME_ARG_REG (2)
+
+/* 調べている関数のパラメータの使用 */
+static LVar **params = NULL;
+static int num_param = 0;
+static bool *used = NULL;
+
+/* プログラム内の関数ごとの、プログラム内からの呼び出しの数 */
+static Node *cur_program = NULL;
+static int *num_calls = NULL;
+
+/* 関数定義のプログラム内での番号。なければ -1 */
+static int func_index(Node *deffunc) {
+    for (int i = 0; i < cur_program->v.block.num_code; i++) {
+        if (cur_program->v.block.code[i] == deffunc) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* node 以下の、パラメータの使用と関数の呼び出しを調べる */
+static void scan_node(Node *node, void *arg) {
+    visit_children(node, scan_node, arg);
+
+    switch (node->kind) {
+    case ND_LVAR:
+        for (int i = 0; i < num_param; i++) {
+            if (node->v.lvar.var == params[i]) {
+                used[i] = true;
+            }
+        }
+        break;
+    case ND_FOR:
+        if (node->v.cfor.vec != NULL) {
+            VecLoop *vec = node->v.cfor.vec;
+            for (int i = 0; i < vec->num_invariant; i++) {
+                scan_node(vec->invariants[i], arg);
+            }
+            for (int i = 0; i < vec->num_check; i++) {
+                scan_node(vec->checks[i], arg);
+            }
+            scan_node(vec->vtest, arg);
+        }
+        break;
+    case ND_FUNC: {
+        if (node->v.func.builtin != BI_NONE) {
+            break;
+        }
+        int idx = func_index(node->v.func.deffunc);
+        if (idx >= 0) {
+            num_calls[idx]++;
+        } else if (node->v.func.num_param > MAX_ABI_PARAM) {
+            error("外部の関数 %.*s に %d 個を超える引数は渡せません。",
+                  node->v.func.len,
+                  node->v.func.name,
+                  MAX_ABI_PARAM);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* 関数の呼び出し規約を決める */
+static CallConv choose_conv(Node *deffunc, int calls) {
+    if (deffunc->v.deffunc.is_static == true) {
+        return CONV_FAST;
+    }
+    if (calls == 0) {
+        return CONV_SYSV;
+    }
+    for (int i = NUM_SAME_ARG_REG; i < deffunc->v.deffunc.num_param; i++) {
+        if (deffunc->v.deffunc.param_used[i] == true) {
+            return CONV_WRAPPED;
+        }
+    }
+    return CONV_FAST;
+}
+
+/* 関数ごとに呼び出し規約を選ぶ */
+void choose_conventions(Node *program) {
+    int num_func = program->v.block.num_code;
+    cur_program = program;
+    num_calls = calloc(num_func + 1, sizeof(int));
+
+    for (int f = 0; f < num_func; f++) {
+        Node *deffunc = program->v.block.code[f];
+        params = deffunc->v.deffunc.params;
+        num_param = deffunc->v.deffunc.num_param;
+        used = calloc(num_param + 1, sizeof(bool));
+        scan_node(deffunc->v.deffunc.block, NULL);
+        deffunc->v.deffunc.param_used = used;
+    }
+    for (int f = 0; f < num_func; f++) {
+        Node *deffunc = program->v.block.code[f];
+        deffunc->v.deffunc.conv = choose_conv(deffunc, num_calls[f]);
+    }
+
+    free(num_calls);
+    num_calls = NULL;
+    params = NULL;
+    used = NULL;
+}
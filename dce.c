@@ -0,0 +1,559 @@
+/* 不要コードの削除
+
+   - return や break の後ろなど、到達できないステートメントを削除する。
+     switch の本体では、次の case・default までを削除する。
+   - 条件が定数の if / while / for を、実行される側だけに置き換える。
+   - 副作用のない式だけのステートメントを削除する。メモリに書き込まない
+     関数の呼び出しも、副作用のない式として扱う。
+   - 変数の生存解析を行い、その後で読まれないローカル変数への代入を
+     右辺の式だけに置き換える。アドレスを取られた変数は対象外。
+   - 非 static 関数から呼ばれない static 関数を削除する。
+
+   ブロックの最後のステートメントの値は、return が無いときの関数の戻り値に
+   なるので、最後のステートメントは削除しない。
+ */
+#include "9cc.h"
+
+/* 何かを削除したら true */
+static bool changed = false;
+
+/* 解析中の関数のローカル変数の個数 */
+static int num_var = 0;
+
+/* アドレスを取られた変数 */
+static bool *addr_taken = NULL;
+
+/* return の直後に生存している変数 */
+static bool *ret_live = NULL;
+
+/* break の直後 (ループ・switch の後ろ) で生存している変数 */
+static bool *break_live = NULL;
+
+/* 解析中の switch の、case・default の位置で生存している変数 */
+static bool *case_live = NULL;
+
+/* 式が副作用を持てば true を返す */
+static bool has_side_effect(Node *node) {
+    if (node == NULL) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case ND_NULL:
+    case ND_NUM:
+    case ND_LVAR:
+        return false;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return has_side_effect(node->v.op2.lhs)
+               || has_side_effect(node->v.op2.rhs);
+    case ND_ADDR:
+    case ND_DEREF:
+        return has_side_effect(node->v.op1.expr);
+    case ND_FUNC:
+        // メモリに書き込まない関数は、引数にだけ副作用がありうる
+        if (node->v.func.builtin != BI_NONE) {
+            if (builtin_purity(node->v.func.builtin) == PURITY_NONE) {
+                return true;
+            }
+        } else if ((node->v.func.deffunc == NULL)
+                   || (node->v.func.deffunc->v.deffunc.purity
+                       == PURITY_NONE)) {
+            return true;
+        }
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            if (has_side_effect(node->v.func.params[i]) == true) {
+                return true;
+            }
+        }
+        return false;
+    default:
+        return true;
+    }
+}
+
+/* 値を使わない式から、副作用のある部分だけを取り出す。
+   副作用がなければ NULL を返す。
+ */
+static Node *strip_unused(Node *node) {
+    if (has_side_effect(node) == false) {
+        return NULL;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        if (has_side_effect(node->v.op2.lhs) == false) {
+            return strip_unused(node->v.op2.rhs);
+        }
+        if (has_side_effect(node->v.op2.rhs) == false) {
+            return strip_unused(node->v.op2.lhs);
+        }
+        return node;
+    case ND_ADDR:
+    case ND_DEREF:
+        return strip_unused(node->v.op1.expr);
+    default:
+        return node;
+    }
+}
+
+/* ステートメントの後ろへ実行が進みうるなら true を返す */
+static bool falls_through(Node *node) {
+    if (node == NULL) {
+        return true;
+    }
+
+    switch (node->kind) {
+    case ND_RETURN:
+    case ND_BREAK:
+        return false;
+    case ND_IF:
+        return (node->v.cif.ebody == NULL)
+               || falls_through(node->v.cif.tbody)
+               || falls_through(node->v.cif.ebody);
+    case ND_BLOCK:
+        for (int i = 0; i < node->v.block.num_code; i++) {
+            if (falls_through(node->v.block.code[i]) == false) {
+                return false;
+            }
+        }
+        return true;
+    default:
+        return true;
+    }
+}
+
+static void dce_stmt(Node *node);
+
+/* ブロック内の不要なステートメントを削除する */
+static void dce_block(Node *block) {
+    int num = 0;
+    bool dead = false;
+    for (int i = 0; i < block->v.block.num_code; i++) {
+        Node *stmt = block->v.block.code[i];
+        bool last = (i == block->v.block.num_code - 1);
+
+        // 到達できないステートメント (case・default からは到達できる)
+        if (stmt->kind == ND_CASE) {
+            dead = false;
+        } else if (dead == true) {
+            changed = true;
+            continue;
+        }
+
+        dce_stmt(stmt);
+        if (last == false) {
+            // 値を使わないステートメント
+            if (stmt->kind == ND_NULL) {
+                changed = true;
+                continue;
+            }
+            Node *effect = strip_unused(stmt);
+            if (effect == NULL) {
+                changed = true;
+                continue;
+            }
+            if (effect != stmt) {
+                *stmt = *effect;
+                changed = true;
+            }
+        }
+        block->v.block.code[num] = stmt;
+        num++;
+
+        if (falls_through(stmt) == false) {
+            dead = true;
+        }
+    }
+    block->v.block.num_code = num;
+}
+
+/* ノードを NULL ノードに置き換える */
+static void replace_with_null(Node *node) {
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_NULL;
+}
+
+/* ステートメントを簡単化する */
+static void dce_stmt(Node *node) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_IF: {
+        Node *test = node->v.cif.test;
+        if (test->kind == ND_NUM) {
+            Node *body = (test->v.num.val != 0) ? node->v.cif.tbody
+                                                : node->v.cif.ebody;
+            if (body == NULL) {
+                replace_with_null(node);
+            } else {
+                *node = *body;
+                dce_stmt(node);
+            }
+            changed = true;
+            break;
+        }
+        dce_stmt(node->v.cif.tbody);
+        dce_stmt(node->v.cif.ebody);
+        break;
+    }
+    case ND_WHILE: {
+        Node *test = node->v.cwhile.test;
+        if ((test->kind == ND_NUM) && (test->v.num.val == 0)) {
+            replace_with_null(node);
+            changed = true;
+            break;
+        }
+        dce_stmt(node->v.cwhile.body);
+        break;
+    }
+    case ND_FOR: {
+        Node *test = node->v.cfor.test;
+        if ((test != NULL) && (test->kind == ND_NUM)
+            && (test->v.num.val == 0)) {
+            Node *init = node->v.cfor.init;
+            if (init == NULL) {
+                replace_with_null(node);
+            } else {
+                *node = *init;
+            }
+            changed = true;
+            break;
+        }
+        dce_stmt(node->v.cfor.body);
+        break;
+    }
+    case ND_SWITCH:
+        dce_block(node->v.cswitch.body);
+        break;
+    case ND_BLOCK:
+        dce_block(node);
+        break;
+    default:
+        break;
+    }
+}
+
+/* find_addr_taken の走査 */
+static void visit_addr_taken(Node *node, void *taken) {
+    if ((node->kind == ND_ADDR) && (node->v.op1.expr->kind == ND_LVAR)) {
+        ((bool *)taken)[node->v.op1.expr->v.lvar.var->id] = true;
+    }
+    visit_children(node, visit_addr_taken, taken);
+}
+
+/* node 以下でアドレスを取られた変数を探し、taken[変数の番号] を true にする */
+void find_addr_taken(Node *node, bool *taken) {
+    if (node != NULL) {
+        visit_addr_taken(node, taken);
+    }
+}
+
+/* 生存変数の集合を作成する */
+static bool *live_new(bool *src) {
+    bool *live = calloc(num_var + 1, sizeof(bool));
+    if (src != NULL) {
+        memcpy(live, src, num_var * sizeof(bool));
+    }
+    return live;
+}
+
+/* 生存変数の集合 dst に src を加える */
+static void live_union(bool *dst, bool *src) {
+    for (int i = 0; i < num_var; i++) {
+        dst[i] = dst[i] || src[i];
+    }
+}
+
+static void live_node(Node *node, bool *live, bool apply);
+
+/* switch の本体に default があれば true を返す */
+static bool has_default(Node *body) {
+    for (int i = 0; i < body->v.block.num_code; i++) {
+        Node *node = body->v.block.code[i];
+        if ((node->kind == ND_CASE) && (node->v.ccase.is_default == true)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ループの先頭で生存している変数を求める。
+   ループは test → body → update → test … と回り、test が偽のとき out へ抜ける。
+   test が NULL なら return 以外で抜けない。
+ */
+static void live_loop(Node *test,
+                      Node *body,
+                      Node *update,
+                      bool *live,
+                      bool apply) {
+    bool *head = live_new(NULL);
+    bool *after_test = live_new(NULL);
+    bool *prev_break_live = break_live;
+    break_live = live_new(live);
+
+    // 先頭の生存変数が変化しなくなるまで繰り返す
+    while (1) {
+        memcpy(after_test, head, num_var * sizeof(bool));
+        live_node(update, after_test, false);
+        live_node(body, after_test, false);
+        if (test != NULL) {
+            live_union(after_test, live);
+        }
+
+        bool *next = live_new(after_test);
+        live_node(test, next, false);
+        bool same = (memcmp(next, head, num_var * sizeof(bool)) == 0);
+        free(head);
+        head = next;
+        if (same == true) {
+            break;
+        }
+    }
+
+    if (apply == true) {
+        bool *tmp = live_new(head);
+        live_node(update, tmp, true);
+        live_node(body, tmp, true);
+        free(tmp);
+        tmp = live_new(after_test);
+        live_node(test, tmp, true);
+        free(tmp);
+    }
+
+    memcpy(live, head, num_var * sizeof(bool));
+    free(head);
+    free(after_test);
+    free(break_live);
+    break_live = prev_break_live;
+}
+
+/* 後ろから前へ生存解析を行う。
+   live には node の直後で生存している変数を渡し、直前で生存している変数が
+   返る。apply が true なら、読まれない変数への代入を削除する。
+ */
+static void live_node(Node *node, bool *live, bool apply) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_LVAR:
+        live[node->v.lvar.var->id] = true;
+        break;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        live_node(node->v.op2.rhs, live, apply);
+        live_node(node->v.op2.lhs, live, apply);
+        break;
+    case ND_ASSIGN: {
+        Node *lhs = node->v.op2.lhs;
+        if (lhs->kind == ND_LVAR) {
+            int idx = lhs->v.lvar.var->id;
+            if (addr_taken[idx] == false) {
+                if ((apply == true) && (live[idx] == false)) {
+                    // 読まれない代入は、右辺の式だけにする
+                    *node = *node->v.op2.rhs;
+                    changed = true;
+                    live_node(node, live, apply);
+                    break;
+                }
+                live[idx] = false;
+            }
+            live_node(node->v.op2.rhs, live, apply);
+        } else {
+            live_node(node->v.op2.rhs, live, apply);
+            live_node(lhs, live, apply);
+        }
+        break;
+    }
+    case ND_ADDR:
+        if (node->v.op1.expr->kind != ND_LVAR) {
+            live_node(node->v.op1.expr, live, apply);
+        }
+        break;
+    case ND_DEREF:
+        live_node(node->v.op1.expr, live, apply);
+        break;
+    case ND_RETURN:
+        memcpy(live, ret_live, num_var * sizeof(bool));
+        live_node(node->v.op1.expr, live, apply);
+        break;
+    case ND_BREAK:
+        memcpy(live, break_live, num_var * sizeof(bool));
+        break;
+    case ND_CASE:
+        live_union(case_live, live);
+        break;
+    case ND_SWITCH: {
+        // test の後は、いずれかの case・default へ飛ぶ。
+        // default がなければ switch の後ろへも飛ぶ。
+        bool *prev_break_live = break_live;
+        bool *prev_case_live = case_live;
+        break_live = live_new(live);
+        case_live = live_new(NULL);
+        Node *body = node->v.cswitch.body;
+        live_node(body, live, apply);
+        memcpy(live, case_live, num_var * sizeof(bool));
+        if (has_default(body) == false) {
+            live_union(live, break_live);
+        }
+        free(break_live);
+        free(case_live);
+        break_live = prev_break_live;
+        case_live = prev_case_live;
+        live_node(node->v.cswitch.test, live, apply);
+        break;
+    }
+    case ND_IF: {
+        bool *ebody = live_new(live);
+        live_node(node->v.cif.tbody, live, apply);
+        live_node(node->v.cif.ebody, ebody, apply);
+        live_union(live, ebody);
+        free(ebody);
+        live_node(node->v.cif.test, live, apply);
+        break;
+    }
+    case ND_WHILE:
+        live_loop(node->v.cwhile.test, node->v.cwhile.body, NULL, live, apply);
+        break;
+    case ND_FOR:
+        live_loop(node->v.cfor.test,
+                  node->v.cfor.body,
+                  node->v.cfor.update,
+                  live,
+                  apply);
+        live_node(node->v.cfor.init, live, apply);
+        break;
+    case ND_BLOCK:
+        for (int i = node->v.block.num_code - 1; i >= 0; i--) {
+            live_node(node->v.block.code[i], live, apply);
+        }
+        break;
+    case ND_FUNC:
+        for (int i = node->v.func.num_param - 1; i >= 0; i--) {
+            live_node(node->v.func.params[i], live, apply);
+        }
+        break;
+    case ND_INLINE: {
+        // インライン展開された関数の return は、展開先の末尾へ抜ける
+        bool *prev_ret_live = ret_live;
+        ret_live = live_new(live);
+        live_node(node->v.inl.block, live, apply);
+        free(ret_live);
+        ret_live = prev_ret_live;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/* 関数内の不要コードを削除する */
+static void dce_func(Node *deffunc) {
+    Node *block = deffunc->v.deffunc.block;
+
+    num_var = block->v.block.total_local;
+    addr_taken = calloc(num_var + 1, sizeof(bool));
+    find_addr_taken(block, addr_taken);
+
+    do {
+        changed = false;
+        dce_stmt(block);
+
+        ret_live = live_new(NULL);
+        bool *live = live_new(NULL);
+        live_node(block, live, true);
+        free(live);
+        free(ret_live);
+        ret_live = NULL;
+    } while (changed == true);
+
+    free(addr_taken);
+    addr_taken = NULL;
+}
+
+/* 削除を調べているプログラム */
+static Node *cur_program = NULL;
+
+static void mark_used_func(int idx, bool *used);
+
+/* node 以下から呼ばれる関数に印を付ける */
+static void mark_calls(Node *node, void *used) {
+    if (node->kind == ND_FUNC) {
+        int idx = find_func(cur_program, node->v.func.name, node->v.func.len);
+        if (idx >= 0) {
+            mark_used_func(idx, used);
+        }
+    }
+    visit_children(node, mark_calls, used);
+}
+
+/* 関数とそこから呼ばれる関数に印を付ける */
+static void mark_used_func(int idx, bool *used) {
+    if (used[idx] == true) {
+        return;
+    }
+    used[idx] = true;
+    mark_calls(cur_program->v.block.code[idx]->v.deffunc.block, used);
+}
+
+/* 呼ばれない static 関数を削除する */
+static void remove_unused_funcs(Node *program) {
+    int num_func = program->v.block.num_code;
+    bool *used = calloc(num_func + 1, sizeof(bool));
+    cur_program = program;
+
+    for (int i = 0; i < num_func; i++) {
+        if (program->v.block.code[i]->v.deffunc.is_static == false) {
+            mark_used_func(i, used);
+        }
+    }
+
+    int num = 0;
+    for (int i = 0; i < num_func; i++) {
+        if (used[i] == true) {
+            program->v.block.code[num] = program->v.block.code[i];
+            num++;
+        }
+    }
+    program->v.block.num_code = num;
+    free(used);
+    cur_program = NULL;
+}
+
+/* 不要なコードを削除する */
+void eliminate_dead_code(Node *program) {
+    if (option.dce == false) {
+        return;
+    }
+
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        dce_func(program->v.block.code[i]);
+    }
+    remove_unused_funcs(program);
+}
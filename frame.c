@@ -0,0 +1,63 @@
+/* スタックスロットの割り当て
+
+   レジスタに昇格しなかったローカル変数に、スタックフレーム上のスロット
+   (rbp からのオフセット) を割り当てる。
+   ブロックの変数の寿命はそのブロックの中だけなので、兄弟のブロック
+   (2 つの for の本体や、if の両側、インライン展開した本体など) の変数は
+   同じスロットを共有できる。ブロックの変数は親ブロックの変数の後ろに
+   置き、子ブロックはどれも同じ位置から割り当てる。
+   変数は型の大きさ (int は 4 バイト、ポインタは 8 バイト) の境界に置く。
+   ブロックの中では大きい変数から順に詰めて、境界合わせの隙間を作らない。
+
+   -fno-stack-reuse なら共有せず、変数ごとにスロットを使う。
+ */
+#include "9cc.h"
+
+/* 割り当てたバイト数 (関数内の最大) */
+static int max_size = 0;
+
+static void assign_node(Node *node, void *first);
+
+/* ブロックの変数に first バイト目の後ろからスロットを割り当て、
+   子ブロックはその後ろから割り当てる
+ */
+static void assign_block(Node *block, int first) {
+    // -fno-stack-reuse なら、それまでに割り当てたスロットの後ろに置く
+    int n = (option.stack_reuse == true) ? first : max_size;
+    for (int size = 8; size >= 4; size /= 2) {
+        for (LVar *var = block->v.block.locals; var != NULL;
+             var = var->next) {
+            if ((var->reg == 0) && (size_of(var->type) == size)) {
+                n = (n + size + size - 1) / size * size;
+                var->offset = n;
+            }
+        }
+    }
+    if (n > max_size) {
+        max_size = n;
+    }
+    visit_children(block, assign_node, &n);
+}
+
+/* node 以下のブロックに、*first バイト目の後ろからスロットを割り当てる */
+static void assign_node(Node *node, void *first) {
+    if (node->kind == ND_BLOCK) {
+        assign_block(node, *(int *)first);
+        return;
+    }
+    visit_children(node, assign_node, first);
+}
+
+/* 関数の変数にスロットを割り当てる */
+static void assign_func(Node *deffunc) {
+    max_size = 0;
+    assign_block(deffunc->v.deffunc.block, 0);
+    deffunc->v.deffunc.local_size = max_size;
+}
+
+/* レジスタに昇格しなかったローカル変数にスタックスロットを割り当てる */
+void assign_stack_slots(Node *program) {
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        assign_func(program->v.block.code[i]);
+    }
+}
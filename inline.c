@@ -0,0 +1,422 @@
+/* 関数のインライン展開
+
+   同じプログラム内で定義された関数 (ND_DEFFUNC) の呼び出し (ND_FUNC) を、
+   呼び出し先の本体 (ND_INLINE) に置き換える。
+
+   - コールグラフを作り、呼び出される側から順に (ボトムアップに) 展開する。
+   - 再帰呼び出しのサイクルに含まれる関数は展開しない。
+   - 関数本体のノード数 (サイズ) と呼び出し箇所の数からコストを見積もる。
+     サイズが -finline-limit 以下か、呼び出し箇所が 1 つだけでサイズが
+     その 2 倍以下の関数を展開する。
+   - noinline の関数は展開せず、always_inline の関数は常に展開する。
+   - 呼び出し先のローカル変数 (パラメータを含む) は、呼び出し元の
+     スタックフレームに新しい領域を確保して付け替える。
+ */
+#include "9cc.h"
+
+/* -finline-limit のデフォルト値 */
+#define DEFAULT_INLINE_LIMIT (40)
+
+/* -Os での -finline-limit のデフォルト値。呼び出しと同じくらいの大きさの
+   関数だけを展開する
+ */
+#define SIZE_INLINE_LIMIT (8)
+
+/* コールグラフのノード */
+typedef struct Func Func;
+struct Func {
+    Node *deffunc;    // 関数定義
+    Func **callees;   // 呼び出す関数
+    int num_callee;   // 呼び出す関数の数
+    int num_call;     // 呼び出される箇所の数
+    bool recursive;   // 再帰呼び出しのサイクルに含まれるか
+    bool visited;     // ボトムアップ走査で訪問済みか
+};
+
+/* 変数の付け替え表 */
+typedef struct {
+    LVar **from;
+    LVar **to;
+    int num;
+    int max;
+} VarMap;
+
+/* プログラム内の関数 (添字はプログラム内での番号) */
+static Node *cur_program = NULL;
+static Func *funcs = NULL;
+static int num_func = 0;
+
+/* 名前から関数を探す。見つからなければ NULL を返す */
+static Func *lookup_func(const char *name, int len) {
+    int idx = find_func(cur_program, name, len);
+    return (idx >= 0) ? &funcs[idx] : NULL;
+}
+
+/* node_size の走査 */
+static void count_nodes(Node *node, void *size) {
+    (*(int *)size)++;
+    visit_children(node, count_nodes, size);
+}
+
+/* ノードの数を数える */
+static int node_size(Node *node) {
+    int size = 0;
+    if (node != NULL) {
+        count_nodes(node, &size);
+    }
+    return size;
+}
+
+/* コールグラフに辺を追加する */
+static void func_add_callee(Func *caller, Func *callee) {
+    for (int i = 0; i < caller->num_callee; i++) {
+        if (caller->callees[i] == callee) {
+            return;
+        }
+    }
+    caller->callees = realloc(caller->callees,
+                              (caller->num_callee + 1) * sizeof(Func *));
+    if (caller->callees == NULL) {
+        error("コールグラフを拡張できません。");
+    }
+    caller->callees[caller->num_callee] = callee;
+    caller->num_callee++;
+}
+
+/* node 以下の関数呼び出しをコールグラフに登録する */
+static void collect_calls(Node *node, void *caller) {
+    visit_children(node, collect_calls, caller);
+    if (node->kind != ND_FUNC) {
+        return;
+    }
+    Func *callee = lookup_func(node->v.func.name, node->v.func.len);
+    if (callee != NULL) {
+        callee->num_call++;
+        func_add_callee(caller, callee);
+    }
+}
+
+/* from から target に到達できれば true を返す */
+static bool reachable(Func *from, Func *target, bool *seen) {
+    for (int i = 0; i < from->num_callee; i++) {
+        Func *callee = from->callees[i];
+        if (callee == target) {
+            return true;
+        }
+        int idx = callee - funcs;
+        if (seen[idx] == false) {
+            seen[idx] = true;
+            if (reachable(callee, target, seen) == true) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* コールグラフを作成し、再帰呼び出しを検出する */
+static void build_call_graph(Node *program) {
+    cur_program = program;
+    num_func = program->v.block.num_code;
+    funcs = calloc(num_func, sizeof(Func));
+    for (int i = 0; i < num_func; i++) {
+        funcs[i].deffunc = program->v.block.code[i];
+    }
+
+    for (int i = 0; i < num_func; i++) {
+        collect_calls(funcs[i].deffunc->v.deffunc.block, &funcs[i]);
+    }
+
+    bool *seen = calloc(num_func, sizeof(bool));
+    for (int i = 0; i < num_func; i++) {
+        memset(seen, 0, num_func * sizeof(bool));
+        funcs[i].recursive = reachable(&funcs[i], &funcs[i], seen);
+    }
+    free(seen);
+}
+
+/* 付け替え表に変数を登録する */
+static void varmap_add(VarMap *map, LVar *from, LVar *to) {
+    if (map->max == map->num) {
+        map->max += MAX_CODE;
+        map->from = realloc(map->from, map->max * sizeof(LVar *));
+        map->to = realloc(map->to, map->max * sizeof(LVar *));
+        if ((map->from == NULL) || (map->to == NULL)) {
+            error("変数の付け替え表を %d に拡張できません。", map->max);
+        }
+    }
+    map->from[map->num] = from;
+    map->to[map->num] = to;
+    map->num++;
+}
+
+/* 付け替え後の変数を返す。表になければ元の変数を返す */
+static LVar *varmap_find(VarMap *map, LVar *from) {
+    for (int i = 0; i < map->num; i++) {
+        if (map->from[i] == from) {
+            return map->to[i];
+        }
+    }
+    return from;
+}
+
+static Node *clone_node(Node *node, Node *pblock, int base, VarMap *map);
+
+/* ブロックを複製する。
+   ローカル変数は番号を base だけずらして複製する。
+ */
+static Node *clone_block(Node *block, Node *pblock, int base, VarMap *map) {
+    Node *copy = calloc(1, sizeof(Node));
+    *copy = *block;
+    copy->v.block.pblock = pblock;
+
+    // ローカル変数 (宣言の逆順のリスト)
+    LVar head = {0};
+    LVar *tail = &head;
+    for (LVar *var = block->v.block.locals; var != NULL; var = var->next) {
+        LVar *nvar = calloc(1, sizeof(LVar));
+        *nvar = *var;
+        nvar->id = var->id + base;
+        nvar->next = NULL;
+        tail->next = nvar;
+        tail = nvar;
+        varmap_add(map, var, nvar);
+    }
+    copy->v.block.locals = head.next;
+
+    copy->v.block.code = calloc(block->v.block.num_code + 1, sizeof(Node *));
+    copy->v.block.max_code = block->v.block.num_code + 1;
+    for (int i = 0; i < block->v.block.num_code; i++) {
+        copy->v.block.code[i]
+            = clone_node(block->v.block.code[i], copy, base, map);
+    }
+    return copy;
+}
+
+/* ノードを複製する */
+static Node *clone_node(Node *node, Node *pblock, int base, VarMap *map) {
+    if (node == NULL) {
+        return NULL;
+    }
+    if (node->kind == ND_BLOCK) {
+        return clone_block(node, pblock, base, map);
+    }
+
+    Node *copy = calloc(1, sizeof(Node));
+    *copy = *node;
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_ASSIGN:
+        copy->v.op2.lhs = clone_node(node->v.op2.lhs, pblock, base, map);
+        copy->v.op2.rhs = clone_node(node->v.op2.rhs, pblock, base, map);
+        break;
+    case ND_RETURN:
+    case ND_ADDR:
+    case ND_DEREF:
+        copy->v.op1.expr = clone_node(node->v.op1.expr, pblock, base, map);
+        break;
+    case ND_IF:
+        copy->v.cif.test = clone_node(node->v.cif.test, pblock, base, map);
+        copy->v.cif.tbody = clone_node(node->v.cif.tbody, pblock, base, map);
+        copy->v.cif.ebody = clone_node(node->v.cif.ebody, pblock, base, map);
+        break;
+    case ND_WHILE:
+        copy->v.cwhile.test
+            = clone_node(node->v.cwhile.test, pblock, base, map);
+        copy->v.cwhile.body
+            = clone_node(node->v.cwhile.body, pblock, base, map);
+        break;
+    case ND_FOR:
+        copy->v.cfor.init = clone_node(node->v.cfor.init, pblock, base, map);
+        copy->v.cfor.test = clone_node(node->v.cfor.test, pblock, base, map);
+        copy->v.cfor.update
+            = clone_node(node->v.cfor.update, pblock, base, map);
+        copy->v.cfor.body = clone_node(node->v.cfor.body, pblock, base, map);
+        break;
+    case ND_SWITCH:
+        copy->v.cswitch.test
+            = clone_node(node->v.cswitch.test, pblock, base, map);
+        copy->v.cswitch.body
+            = clone_node(node->v.cswitch.body, pblock, base, map);
+        break;
+    case ND_FUNC:
+        copy->v.func.params = calloc(node->v.func.max_param, sizeof(Node *));
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            copy->v.func.params[i]
+                = clone_node(node->v.func.params[i], pblock, base, map);
+        }
+        break;
+    case ND_INLINE:
+        copy->v.inl.block = clone_node(node->v.inl.block, pblock, base, map);
+        break;
+    case ND_LVAR:
+        copy->v.lvar.var = varmap_find(map, node->v.lvar.var);
+        break;
+    default:
+        break;
+    }
+    return copy;
+}
+
+/* 最上位のブロックを返す */
+static Node *top_block(Node *block) {
+    while (block->v.block.pblock != NULL) {
+        block = block->v.block.pblock;
+    }
+    return block;
+}
+
+/* 呼び出し先を展開するか判定する */
+static bool should_inline(Func *caller, Func *callee, Node *call) {
+    Node *deffunc = callee->deffunc;
+
+    if ((callee == caller) || (callee->recursive == true)) {
+        return false;
+    }
+    if (call->v.func.num_param != deffunc->v.deffunc.num_param) {
+        return false;
+    }
+    if (deffunc->v.deffunc.inline_attr == INLINE_NEVER) {
+        return false;
+    }
+    if (deffunc->v.deffunc.inline_attr == INLINE_ALWAYS) {
+        return true;
+    }
+
+    int size = node_size(deffunc->v.deffunc.block);
+    if (size <= option.inline_limit) {
+        return true;
+    }
+    // 呼び出し箇所が 1 つだけなら、展開してもコードはほとんど増えない
+    if ((callee->num_call == 1) && (size <= option.inline_limit * 2)) {
+        return true;
+    }
+    return false;
+}
+
+/* 関数呼び出しノード call を、block 内で callee の本体に置き換える */
+static void inline_call(Node *call, Node *block, Func *callee) {
+    Node *deffunc = callee->deffunc;
+    Node *body = deffunc->v.deffunc.block;
+    Node *top = top_block(block);
+
+    // 呼び出し先の変数に、呼び出し元の変数の後ろの番号を付ける
+    int base = top->v.block.total_local;
+    VarMap map = {0};
+    Node *copy = clone_block(body, block, base, &map);
+    for (Node *b = block; b != NULL; b = b->v.block.pblock) {
+        b->v.block.total_local += body->v.block.total_local;
+    }
+
+    // 先頭で引数をパラメータに代入する
+    int num_param = deffunc->v.deffunc.num_param;
+    int num_code = num_param + copy->v.block.num_code;
+    Node **code = calloc(num_code + 1, sizeof(Node *));
+    for (int i = 0; i < num_param; i++) {
+        Node *param = calloc(1, sizeof(Node));
+        LVar *var = varmap_find(&map, deffunc->v.deffunc.params[i]);
+        param->kind = ND_LVAR;
+        param->type = var->type;
+        param->v.lvar.name = var->name;
+        param->v.lvar.len = var->len;
+        param->v.lvar.var = var;
+
+        Node *assign = calloc(1, sizeof(Node));
+        assign->kind = ND_ASSIGN;
+        assign->type = var->type;
+        assign->v.op2.lhs = param;
+        assign->v.op2.rhs = call->v.func.params[i];
+        code[i] = assign;
+    }
+    memcpy(&code[num_param],
+           copy->v.block.code,
+           copy->v.block.num_code * sizeof(Node *));
+    copy->v.block.code = code;
+    copy->v.block.num_code = num_code;
+    copy->v.block.max_code = num_code + 1;
+
+    free(map.from);
+    free(map.to);
+
+    char *name = call->v.func.name;
+    int len = call->v.func.len;
+    call->kind = ND_INLINE;
+    call->v.inl.name = name;
+    call->v.inl.len = len;
+    call->v.inl.block = copy;
+}
+
+/* 展開する呼び出しの場所 */
+typedef struct {
+    Func *caller;   // 呼び出し元の関数
+    Node *block;    // 呼び出しを含むブロック
+} CallSite;
+
+/* node 以下の関数呼び出しを展開する */
+static void inline_node(Node *node, void *arg) {
+    CallSite *site = arg;
+
+    if (node->kind == ND_BLOCK) {
+        CallSite inner = {site->caller, node};
+        visit_children(node, inline_node, &inner);
+        return;
+    }
+    visit_children(node, inline_node, site);
+    if (node->kind != ND_FUNC) {
+        return;
+    }
+
+    Func *callee = lookup_func(node->v.func.name, node->v.func.len);
+    if ((callee != NULL)
+        && (should_inline(site->caller, callee, node) == true)) {
+        inline_call(node, site->block, callee);
+        // 展開した本体の変数は呼び出し元のスタックフレームに置く
+        if (callee->deffunc->v.deffunc.has_escape == true) {
+            site->caller->deffunc->v.deffunc.has_escape = true;
+        }
+    }
+}
+
+/* 呼び出される関数から順に展開する */
+static void inline_func(Func *func) {
+    if (func->visited == true) {
+        return;
+    }
+    func->visited = true;
+
+    for (int i = 0; i < func->num_callee; i++) {
+        inline_func(func->callees[i]);
+    }
+    CallSite site = {func, NULL};
+    inline_node(func->deffunc->v.deffunc.block, &site);
+}
+
+/* 関数をインライン展開する */
+void inline_functions(Node *program) {
+    if (option.inline_limit < 0) {
+        option.inline_limit = (option.size == true) ? SIZE_INLINE_LIMIT
+                                                    : DEFAULT_INLINE_LIMIT;
+    }
+
+    build_call_graph(program);
+    for (int i = 0; i < num_func; i++) {
+        inline_func(&funcs[i]);
+    }
+
+    for (int i = 0; i < num_func; i++) {
+        free(funcs[i].callees);
+    }
+    free(funcs);
+    cur_program = NULL;
+    funcs = NULL;
+    num_func = 0;
+}
@@ -0,0 +1,610 @@
+/* 関数間の解析
+
+   同じプログラム内で定義された関数 (ND_DEFFUNC) のコールグラフを使って、
+   次の最適化を行う。
+
+   - 副作用の解析: ポインタ経由の書き込みも未知の関数の呼び出しもない関数を
+     読み取り専用 (PURITY_READONLY)、さらにポインタ経由の読み込みもない関数を
+     純粋 (PURITY_PURE) とする。再帰を含むので、全ての関数を純粋と仮定して
+     変化がなくなるまで格下げする。
+   - 定数伝播: static 関数の全ての呼び出し箇所で同じ定数が渡されるパラメータを、
+     関数本体の中で定数に置き換える。
+   - 畳み込み: 定数どうしの演算と、純粋な関数を定数の引数で呼び出す式を、
+     コンパイル時に評価して定数に置き換える。関数はインタプリタで実行し、
+     実行ステップ数が上限を超えたときなどは評価をあきらめる。
+
+   -fno-ipa のときも、定数どうしの演算と組み込み関数の畳み込みだけは行う。
+ */
+#include "9cc.h"
+
+/* インタプリタの実行ステップ数の上限 */
+#define MAX_EVAL_STEP (1000000)
+
+/* インタプリタの関数呼び出しの深さの上限 */
+#define MAX_EVAL_DEPTH (1000)
+
+/* 定数伝播の繰り返し回数の上限 */
+#define MAX_IPA_ITERATION (10)
+
+/* 何かを置き換えたら true */
+static bool changed = false;
+
+/* インタプリタの残り実行ステップ数 */
+static int eval_steps = 0;
+
+/* インタプリタの関数呼び出しの深さ */
+static int eval_depth = 0;
+
+/* インタプリタの関数フレーム */
+typedef struct {
+    int64_t *vars;    // ローカル変数の値
+    bool *assigned;   // ローカル変数に値が入っているか
+    int num_var;      // ローカル変数の個数
+    bool returned;    // return したか
+    bool broken;      // break したか
+    int64_t ret;      // 戻り値
+} Frame;
+
+/* 数値ノードに置き換える */
+static void replace_with_num(Node *node, int val) {
+    memset(node, 0, sizeof(Node));
+    node->kind = ND_NUM;
+    node->type = int_type;
+    node->v.num.val = val;
+    changed = true;
+}
+
+/* 値が数値ノードで表せれば true を返す */
+static bool fits_num(int64_t val) {
+    return (INT32_MIN <= val) && (val <= INT32_MAX);
+}
+
+/* 2項演算子を計算する。計算できなければ false を返す。
+   int は 32 ビットなので、オーバーフローは 32 ビットの 2 の補数で折り返す。
+ */
+static bool eval_op2(NodeKind kind, int64_t lhs, int64_t rhs, int64_t *val) {
+    uint32_t ul = (uint32_t)lhs;
+    uint32_t ur = (uint32_t)rhs;
+
+    switch (kind) {
+    case ND_ADD:
+        *val = (int32_t)(ul + ur);
+        return true;
+    case ND_SUB:
+        *val = (int32_t)(ul - ur);
+        return true;
+    case ND_MUL:
+        *val = (int32_t)(ul * ur);
+        return true;
+    case ND_DIV:
+        if ((rhs == 0) || ((lhs == INT32_MIN) && (rhs == -1))) {
+            return false;
+        }
+        *val = lhs / rhs;
+        return true;
+    case ND_MOD:
+        if ((rhs == 0) || ((lhs == INT32_MIN) && (rhs == -1))) {
+            return false;
+        }
+        *val = lhs % rhs;
+        return true;
+    case ND_EQ:
+        *val = lhs == rhs;
+        return true;
+    case ND_NE:
+        *val = lhs != rhs;
+        return true;
+    case ND_LT:
+        *val = lhs < rhs;
+        return true;
+    case ND_LE:
+        *val = lhs <= rhs;
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool eval_func(Node *deffunc, int64_t *args, int64_t *val);
+
+/* switch の本体で、値 val のときに実行を始めるステートメントの位置。
+   一致する case も default もなければ、本体の末尾
+ */
+static int find_case(Node *body, int64_t val) {
+    int found = body->v.block.num_code;
+    for (int i = 0; i < body->v.block.num_code; i++) {
+        Node *node = body->v.block.code[i];
+        if (node->kind != ND_CASE) {
+            continue;
+        }
+        if (node->v.ccase.is_default == true) {
+            found = i;
+        } else if (node->v.ccase.val == val) {
+            return i;
+        }
+    }
+    return found;
+}
+
+/* ループの本体を実行した後、break していれば解除して true を返す */
+static bool take_break(Frame *frame) {
+    if (frame->broken == true) {
+        frame->broken = false;
+        return true;
+    }
+    return false;
+}
+
+/* ノードを実行する。実行できなければ false を返す */
+static bool eval(Node *node, Frame *frame, int64_t *val) {
+    int64_t lhs, rhs;
+
+    *val = 0;
+    if (node == NULL) {
+        return true;
+    }
+    eval_steps--;
+    if (eval_steps < 0) {
+        return false;
+    }
+
+    switch (node->kind) {
+    case ND_NULL:
+    case ND_CASE:
+        return true;
+    case ND_BREAK:
+        frame->broken = true;
+        return true;
+    case ND_NUM:
+        *val = node->v.num.val;
+        return true;
+    case ND_LVAR: {
+        int idx = node->v.lvar.var->id;
+        if (frame->assigned[idx] == false) {
+            return false;
+        }
+        *val = frame->vars[idx];
+        return true;
+    }
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        if ((eval(node->v.op2.lhs, frame, &lhs) == false)
+            || (eval(node->v.op2.rhs, frame, &rhs) == false)) {
+            return false;
+        }
+        return eval_op2(node->kind, lhs, rhs, val);
+    case ND_ASSIGN: {
+        if (node->v.op2.lhs->kind != ND_LVAR) {
+            return false;
+        }
+        if (eval(node->v.op2.rhs, frame, val) == false) {
+            return false;
+        }
+        int idx = node->v.op2.lhs->v.lvar.var->id;
+        frame->vars[idx] = *val;
+        frame->assigned[idx] = true;
+        return true;
+    }
+    case ND_RETURN:
+        if (eval(node->v.op1.expr, frame, val) == false) {
+            return false;
+        }
+        frame->returned = true;
+        frame->ret = *val;
+        return true;
+    case ND_IF:
+        if (eval(node->v.cif.test, frame, &lhs) == false) {
+            return false;
+        }
+        if (lhs != 0) {
+            return eval(node->v.cif.tbody, frame, val);
+        }
+        return eval(node->v.cif.ebody, frame, val);
+    case ND_WHILE:
+        while (1) {
+            if (eval(node->v.cwhile.test, frame, &lhs) == false) {
+                return false;
+            }
+            if (lhs == 0) {
+                return true;
+            }
+            if (eval(node->v.cwhile.body, frame, val) == false) {
+                return false;
+            }
+            if ((frame->returned == true) || (take_break(frame) == true)) {
+                return true;
+            }
+        }
+    case ND_FOR:
+        if (eval(node->v.cfor.init, frame, val) == false) {
+            return false;
+        }
+        while (1) {
+            if (node->v.cfor.test != NULL) {
+                if (eval(node->v.cfor.test, frame, &lhs) == false) {
+                    return false;
+                }
+                if (lhs == 0) {
+                    return true;
+                }
+            }
+            if (eval(node->v.cfor.body, frame, val) == false) {
+                return false;
+            }
+            if ((frame->returned == true) || (take_break(frame) == true)) {
+                return true;
+            }
+            if (eval(node->v.cfor.update, frame, val) == false) {
+                return false;
+            }
+        }
+    case ND_BLOCK:
+        for (int i = 0; i < node->v.block.num_code; i++) {
+            if (eval(node->v.block.code[i], frame, val) == false) {
+                return false;
+            }
+            if ((frame->returned == true) || (frame->broken == true)) {
+                return true;
+            }
+        }
+        return true;
+    case ND_SWITCH: {
+        if (eval(node->v.cswitch.test, frame, &lhs) == false) {
+            return false;
+        }
+        // 一致する case から本体の末尾まで、break か return まで実行する
+        Node *body = node->v.cswitch.body;
+        for (int i = find_case(body, lhs); i < body->v.block.num_code; i++) {
+            if (eval(body->v.block.code[i], frame, val) == false) {
+                return false;
+            }
+            if ((frame->returned == true) || (take_break(frame) == true)) {
+                return true;
+            }
+        }
+        return true;
+    }
+    case ND_FUNC: {
+        Node *deffunc = node->v.func.deffunc;
+        BuiltinKind builtin = node->v.func.builtin;
+        if ((builtin == BI_NONE)
+            && ((deffunc == NULL)
+                || (deffunc->v.deffunc.purity != PURITY_PURE)
+                || (node->v.func.num_param
+                    != deffunc->v.deffunc.num_param))) {
+            return false;
+        }
+        int64_t args[MAX_PARAM];
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            if (eval(node->v.func.params[i], frame, &args[i]) == false) {
+                return false;
+            }
+        }
+        if (builtin != BI_NONE) {
+            return eval_builtin(builtin, args, val);
+        }
+        return eval_func(deffunc, args, val);
+    }
+    default:
+        // アドレスを扱う式などは評価しない
+        return false;
+    }
+}
+
+/* 関数を実行する。実行できなければ false を返す */
+static bool eval_func(Node *deffunc, int64_t *args, int64_t *val) {
+    if (eval_depth >= MAX_EVAL_DEPTH) {
+        return false;
+    }
+    eval_depth++;
+
+    Frame frame = {0};
+    frame.num_var = deffunc->v.deffunc.block->v.block.total_local;
+    frame.vars = calloc(frame.num_var + 1, sizeof(int64_t));
+    frame.assigned = calloc(frame.num_var + 1, sizeof(bool));
+    for (int i = 0; i < deffunc->v.deffunc.num_param; i++) {
+        int idx = deffunc->v.deffunc.params[i]->id;
+        frame.vars[idx] = args[i];
+        frame.assigned[idx] = true;
+    }
+
+    // return せずに末尾に到達したときの戻り値は不定なので、評価しない
+    bool ok = eval(deffunc->v.deffunc.block, &frame, val)
+              && (frame.returned == true);
+    *val = frame.ret;
+
+    free(frame.vars);
+    free(frame.assigned);
+    eval_depth--;
+    return ok;
+}
+
+/* node 以下の関数呼び出しに、呼び出し先の関数定義を結び付ける */
+static void resolve_calls(Node *node, void *program) {
+    if ((node->kind == ND_FUNC) && (node->v.func.builtin == BI_NONE)) {
+        Node *prog = program;
+        int idx = find_func(prog, node->v.func.name, node->v.func.len);
+        node->v.func.deffunc = (idx >= 0) ? prog->v.block.code[idx] : NULL;
+    }
+    visit_children(node, resolve_calls, program);
+}
+
+/* 2 つの副作用のうち、強い方を返す */
+static Purity purity_min(Purity a, Purity b) {
+    return (a < b) ? a : b;
+}
+
+/* node 以下の副作用を *purity に合わせる */
+static void scan_purity(Node *node, void *arg) {
+    Purity *purity = arg;
+
+    switch (node->kind) {
+    case ND_ASSIGN:
+        if (node->v.op2.lhs->kind != ND_LVAR) {
+            // ポインタ経由の書き込み
+            *purity = PURITY_NONE;
+        }
+        break;
+    case ND_DEREF:
+        // ポインタ経由の読み込み
+        *purity = purity_min(*purity, PURITY_READONLY);
+        break;
+    case ND_FUNC:
+        if (node->v.func.builtin != BI_NONE) {
+            *purity = purity_min(*purity, builtin_purity(node->v.func.builtin));
+        } else if (node->v.func.deffunc == NULL) {
+            // 未知の関数
+            *purity = PURITY_NONE;
+        } else {
+            *purity = purity_min(*purity,
+                                 node->v.func.deffunc->v.deffunc.purity);
+        }
+        break;
+    default:
+        break;
+    }
+    visit_children(node, scan_purity, arg);
+}
+
+/* node 以下の副作用を求める */
+static Purity node_purity(Node *node) {
+    Purity purity = PURITY_PURE;
+    if (node != NULL) {
+        scan_purity(node, &purity);
+    }
+    return purity;
+}
+
+/* 全ての関数の副作用を求める */
+static void analyze_purity(Node *program) {
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        program->v.block.code[i]->v.deffunc.purity = PURITY_PURE;
+    }
+
+    bool updated = true;
+    while (updated == true) {
+        updated = false;
+        for (int i = 0; i < program->v.block.num_code; i++) {
+            Node *deffunc = program->v.block.code[i];
+            Purity purity = node_purity(deffunc->v.deffunc.block);
+            if (purity < deffunc->v.deffunc.purity) {
+                deffunc->v.deffunc.purity = purity;
+                updated = true;
+            }
+        }
+    }
+}
+
+/* 定数どうしの 2 項演算を畳み込む */
+static void fold_op2(Node *node) {
+    Node *lhs = node->v.op2.lhs;
+    Node *rhs = node->v.op2.rhs;
+    int64_t val;
+    if ((lhs->kind == ND_NUM) && (rhs->kind == ND_NUM)
+        && (eval_op2(node->kind, lhs->v.num.val, rhs->v.num.val, &val)
+            == true)
+        && (fits_num(val) == true)) {
+        replace_with_num(node, val);
+    }
+}
+
+/* 組み込み関数と純粋な関数の、定数引数での呼び出しを畳み込む */
+static void fold_call(Node *node) {
+    int64_t args[MAX_PARAM];
+    for (int i = 0; i < node->v.func.num_param; i++) {
+        if (node->v.func.params[i]->kind != ND_NUM) {
+            return;
+        }
+        args[i] = node->v.func.params[i]->v.num.val;
+    }
+
+    int64_t val;
+    if (node->v.func.builtin != BI_NONE) {
+        // 組み込み関数は演算子と同じく、-fno-ipa でも畳み込む
+        if ((eval_builtin(node->v.func.builtin, args, &val) == true)
+            && (fits_num(val) == true)) {
+            replace_with_num(node, val);
+        }
+        return;
+    }
+
+    Node *deffunc = node->v.func.deffunc;
+    if ((option.ipa == false) || (deffunc == NULL)
+        || (deffunc->v.deffunc.purity != PURITY_PURE)
+        || (node->v.func.num_param != deffunc->v.deffunc.num_param)) {
+        return;
+    }
+    eval_steps = MAX_EVAL_STEP;
+    eval_depth = 0;
+    if ((eval_func(deffunc, args, &val) == true) && (fits_num(val) == true)) {
+        replace_with_num(node, val);
+    }
+}
+
+/* 定数の式と、純粋な関数の定数引数での呼び出しを畳み込む。
+   子ノードを先に畳み込む。
+ */
+static void fold_node(Node *node, void *arg) {
+    visit_children(node, fold_node, arg);
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        fold_op2(node);
+        break;
+    case ND_FUNC:
+        fold_call(node);
+        break;
+    default:
+        break;
+    }
+}
+
+/* パラメータごとの、呼び出し箇所で渡される定数 */
+typedef struct {
+    int num_call;  // 呼び出し箇所の数
+    bool *known;   // 全ての呼び出し箇所で同じ定数が渡されるか
+    int *val;      // 渡される定数
+} CallArgs;
+
+/* 定数伝播を調べているプログラム */
+static Node *cur_program = NULL;
+
+/* node 以下の呼び出しで渡される定数を集める */
+static void collect_args(Node *node, void *arg) {
+    visit_children(node, collect_args, arg);
+    if ((node->kind != ND_FUNC) || (node->v.func.deffunc == NULL)) {
+        return;
+    }
+
+    Node *deffunc = node->v.func.deffunc;
+    int idx = 0;
+    while (cur_program->v.block.code[idx] != deffunc) {
+        idx++;
+    }
+    CallArgs *call = &((CallArgs *)arg)[idx];
+    for (int i = 0; i < deffunc->v.deffunc.num_param; i++) {
+        Node *param = (i < node->v.func.num_param) ? node->v.func.params[i]
+                                                   : NULL;
+        if ((param == NULL) || (param->kind != ND_NUM)) {
+            call->known[i] = false;
+        } else if (call->num_call == 0) {
+            call->known[i] = true;
+            call->val[i] = param->v.num.val;
+        } else if (call->val[i] != param->v.num.val) {
+            call->known[i] = false;
+        }
+    }
+    call->num_call++;
+}
+
+/* パラメータの変数の書き換えと置き換え */
+typedef struct {
+    LVar *var;       // パラメータの変数
+    int val;         // 置き換える定数
+    bool modified;   // 代入するか、アドレスを取れば true
+} ParamUse;
+
+/* node が use の変数なら true を返す */
+static bool is_param(Node *node, ParamUse *use) {
+    return (node->kind == ND_LVAR) && (node->v.lvar.var == use->var);
+}
+
+/* node 以下で変数に代入するか、アドレスを取るか調べる */
+static void find_modify(Node *node, void *arg) {
+    ParamUse *use = arg;
+    if (((node->kind == ND_ASSIGN) && (is_param(node->v.op2.lhs, use) == true))
+        || ((node->kind == ND_ADDR)
+            && (is_param(node->v.op1.expr, use) == true))) {
+        use->modified = true;
+    }
+    visit_children(node, find_modify, arg);
+}
+
+/* 変数の読み出しを定数に置き換える */
+static void replace_var(Node *node, void *arg) {
+    ParamUse *use = arg;
+    if (is_param(node, use) == true) {
+        replace_with_num(node, use->val);
+        return;
+    }
+    visit_children(node, replace_var, arg);
+}
+
+/* static 関数の定数パラメータを伝播する */
+static void propagate_args(Node *program) {
+    int num_func = program->v.block.num_code;
+    CallArgs *args = calloc(num_func, sizeof(CallArgs));
+    for (int i = 0; i < num_func; i++) {
+        args[i].known = calloc(MAX_PARAM, sizeof(bool));
+        args[i].val = calloc(MAX_PARAM, sizeof(int));
+    }
+
+    cur_program = program;
+    for (int i = 0; i < num_func; i++) {
+        collect_args(program->v.block.code[i]->v.deffunc.block, args);
+    }
+
+    for (int i = 0; i < num_func; i++) {
+        Node *deffunc = program->v.block.code[i];
+        // static でない関数は、他のプログラムから呼ばれるかもしれない
+        if ((deffunc->v.deffunc.is_static == true) && (args[i].num_call > 0)) {
+            for (int j = 0; j < deffunc->v.deffunc.num_param; j++) {
+                if (args[i].known[j] == false) {
+                    continue;
+                }
+                ParamUse use = {0};
+                use.var = deffunc->v.deffunc.params[j];
+                use.val = args[i].val[j];
+                Node *block = deffunc->v.deffunc.block;
+                find_modify(block, &use);
+                if (use.modified == false) {
+                    replace_var(block, &use);
+                }
+            }
+        }
+        free(args[i].known);
+        free(args[i].val);
+    }
+    free(args);
+}
+
+/* 関数間の定数伝播と副作用の解析を行う */
+void analyze_interprocedural(Node *program) {
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        resolve_calls(program->v.block.code[i]->v.deffunc.block, program);
+    }
+    if (option.ipa == false) {
+        // 定数どうしの演算の畳み込みだけ行う
+        for (int i = 0; i < program->v.block.num_code; i++) {
+            fold_node(program->v.block.code[i]->v.deffunc.block, NULL);
+        }
+        return;
+    }
+
+    analyze_purity(program);
+    for (int n = 0; n < MAX_IPA_ITERATION; n++) {
+        changed = false;
+        for (int i = 0; i < program->v.block.num_code; i++) {
+            fold_node(program->v.block.code[i]->v.deffunc.block, NULL);
+        }
+        propagate_args(program);
+        if (changed == false) {
+            break;
+        }
+    }
+}
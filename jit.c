@@ -0,0 +1,120 @@
+/* プログラムをこのプロセスで実行する (--run)
+
+   アセンブラで作ったイメージを mmap した領域に書き込み、書き込みを禁止
+   して実行を許可してから (W^X)、main を呼び出す。アセンブラ・リンカや
+   子プロセスを使わないので、1 回の実行が速い。
+
+   外部の関数は、jit_register で登録したもの、jit_load_library で
+   読み込んだ共有ライブラリ (--run-lib=...) のもの、下の builtin_symbols
+   の標準の関数の順に探す。
+ */
+// -std=c11 では MAP_ANONYMOUS と sysconf が宣言されないため
+#define _DEFAULT_SOURCE
+#include <dlfcn.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "9cc.h"
+
+/* 実行するプログラムから呼べる関数 */
+typedef struct {
+    const char *name;
+    void *addr;
+} JitSymbol;
+
+/* 標準で登録しておく関数 */
+static JitSymbol builtin_symbols[] = {
+    {"malloc", (void *)malloc},
+    {"free", (void *)free},
+    {"putchar", (void *)putchar},
+    {"exit", (void *)exit},
+};
+
+#define NUM_BUILTIN_SYMBOL \
+    ((int)(sizeof(builtin_symbols) / sizeof(builtin_symbols[0])))
+
+/* jit_register で登録した関数 */
+static JitSymbol *symbols = NULL;
+static int num_symbol = 0;
+
+/* 実行するプログラムから呼べる関数を登録する。
+   同じ名前の関数は、後から登録したものが優先される。
+ */
+void jit_register(const char *name, void *addr) {
+    symbols = realloc(symbols, (num_symbol + 1) * sizeof(JitSymbol));
+    symbols[num_symbol].name = name;
+    symbols[num_symbol].addr = addr;
+    num_symbol++;
+}
+
+/* jit_load_library で読み込んだ共有ライブラリ */
+static void **libraries = NULL;
+static int num_library = 0;
+
+/* 共有ライブラリを読み込み、その関数を実行するプログラムから呼べるように
+   する。後から読み込んだものが優先される。
+ */
+void jit_load_library(const char *path) {
+    void *handle = dlopen(path, RTLD_NOW);
+    if (handle == NULL) {
+        error("共有ライブラリを読み込めません: %s", dlerror());
+    }
+    libraries = realloc(libraries, (num_library + 1) * sizeof(void *));
+    libraries[num_library] = handle;
+    num_library++;
+}
+
+/* 関数のアドレスを探す。なければ NULL */
+static void *resolve_symbol(const char *name) {
+    for (int i = num_symbol - 1; i >= 0; i--) {
+        if (strcmp(symbols[i].name, name) == 0) {
+            return symbols[i].addr;
+        }
+    }
+    for (int i = num_library - 1; i >= 0; i--) {
+        void *addr = dlsym(libraries[i], name);
+        if (addr != NULL) {
+            return addr;
+        }
+    }
+    for (int i = 0; i < NUM_BUILTIN_SYMBOL; i++) {
+        if (strcmp(builtin_symbols[i].name, name) == 0) {
+            return builtin_symbols[i].addr;
+        }
+    }
+    return NULL;
+}
+
+/* 機械語にしたプログラムの main を実行し、その戻り値を返す */
+int jit_run(void) {
+    size_t size;
+    char *image = assemble_image(resolve_symbol, &size);
+    long entry = symbol_offset("main");
+    if (entry < 0) {
+        error("main 関数がありません。");
+    }
+
+    // 書き込める領域にイメージを置いてから、実行できる領域に変える
+    long page = sysconf(_SC_PAGESIZE);
+    size_t map_size = (size + page - 1) / page * page;
+    void *mem = mmap(NULL,
+                     map_size,
+                     PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1,
+                     0);
+    if (mem == MAP_FAILED) {
+        error("実行領域を確保できません。");
+    }
+    memcpy(mem, image, size);
+    free(image);
+    if (mprotect(mem, map_size, PROT_READ | PROT_EXEC) != 0) {
+        error("実行領域を実行可能にできません。");
+    }
+
+    int (*main_func)(void) = (int (*)(void))((char *)mem + entry);
+    int ret = main_func();
+
+    fflush(stdout);
+    munmap(mem, map_size);
+    return ret;
+}
@@ -0,0 +1,528 @@
+/* 基本ブロックの配置
+
+   関数のコードをラベルとジャンプで基本ブロックに分け、制御フローグラフを
+   作ってから並べ直す。
+
+   - ジャンプ先がジャンプだけのブロックなら、最終的なジャンプ先へ直接飛ぶ
+     (ジャンプのスレッディング)
+   - ジャンプ先が ret で終わる短いブロックなら、ジャンプの代わりに複製する
+     (-Os では複製せず、エピローグを共有する)
+   - どこからも到達しないブロックを削除する
+   - フォールスルー先を直後に置き、ジャンプでしか入らないブロックはジャンプ
+     元の直後に置く。直後に置いたブロックへのジャンプは削除し、条件ジャンプ
+     の飛び先が直後になるときは条件を反転する
+   - 参照されなくなったラベルを削除する
+
+   ジャンプテーブルを引いた間接ジャンプ (switch) は、テーブルの飛び先の
+   ブロックすべてへの辺として扱う。
+
+   __builtin_expect で予測を付けた条件ジャンプの、通らないと予測した側の
+   ブロックと、そこからしか入らないブロックは実行されにくい (cold)。
+   cold なブロックは関数の末尾にまとめ、よく通る側を一続きに並べる。
+ */
+#include "9cc.h"
+
+/* 複製するブロックの最大の命令数 */
+#define MAX_DUP_INSN (8)
+
+/* 基本ブロック */
+typedef struct {
+    int begin;       // 先頭の行
+    int end;         // 終端の行 (ジャンプ・ret) の次の行
+    int num_insn;    // ラベル・コメント・終端を除く命令数
+    LineKind term;   // 終端の種類。LN_INSN ならフォールスルーする
+    int target;      // ジャンプ先のブロック。なければ -1
+    int fall;        // フォールスルー先のブロック。なければ -1
+    int *targets;    // ジャンプテーブルの飛び先のブロック (LN_TABLE)
+    int dup;         // ジャンプの代わりに複製するブロック。なければ -1
+    bool reachable;  // 関数の入口から到達するか
+    bool placed;     // 配置済みか
+    bool cold;       // 実行されにくいか
+    char *label;     // ブロックを指すラベル
+    bool new_label;  // label を新しく作ったか
+} Block;
+
+/* 配置中の関数のコード */
+static Code *code;
+
+/* 基本ブロック */
+static Block *blocks = NULL;
+static int num_block = 0;
+
+/* ラベルを付けたブロックの数 (ラベル名に使う) */
+static int label_count = 0;
+
+/* ブロックの終端の行 */
+static Line *term_line(Block *block) {
+    return &code->lines[block->end - 1];
+}
+
+/* コードを基本ブロックに分ける。
+   ラベルの前とジャンプ・ret の後ろでブロックを区切る。
+ */
+static void split_blocks(void) {
+    blocks = calloc(code->num_line + 1, sizeof(Block));
+    num_block = 0;
+
+    Block *cur = NULL;
+    for (int i = 0; i < code->num_line; i++) {
+        Line *line = &code->lines[i];
+        if ((cur == NULL)
+            || ((line->kind == LN_LABEL) && (cur->num_insn > 0))) {
+            if (cur != NULL) {
+                cur->end = i;
+            }
+            cur = &blocks[num_block];
+            num_block++;
+            cur->begin = i;
+            cur->term = LN_INSN;
+        }
+        switch (line->kind) {
+        case LN_INSN:
+            cur->num_insn++;
+            break;
+        case LN_JMP:
+        case LN_JCC:
+        case LN_EXIT:
+        case LN_TABLE:
+            cur->term = line->kind;
+            cur->end = i + 1;
+            cur = NULL;
+            break;
+        default:
+            break;
+        }
+    }
+    if (cur != NULL) {
+        cur->end = code->num_line;
+    }
+}
+
+/* ラベルの付いたブロックを探す */
+static int find_block(const char *label) {
+    for (int b = 0; b < num_block; b++) {
+        for (int i = blocks[b].begin; i < blocks[b].end; i++) {
+            Line *line = &code->lines[i];
+            if ((line->kind == LN_LABEL)
+                && (strcmp(line->label, label) == 0)) {
+                return b;
+            }
+        }
+    }
+    error("ラベル %s が見つかりません。", label);
+    return -1;
+}
+
+/* ブロックの間の辺を求める */
+static void link_blocks(void) {
+    for (int b = 0; b < num_block; b++) {
+        Block *block = &blocks[b];
+        block->target = -1;
+        block->fall = -1;
+        block->dup = -1;
+        if ((block->term == LN_JMP) || (block->term == LN_JCC)) {
+            block->target = find_block(term_line(block)->label);
+        }
+        if (block->term == LN_TABLE) {
+            Line *line = term_line(block);
+            block->targets = calloc(line->num_target, sizeof(int));
+            for (int i = 0; i < line->num_target; i++) {
+                block->targets[i] = find_block(line->targets[i]);
+            }
+        }
+        if (((block->term == LN_INSN) || (block->term == LN_JCC))
+            && (b + 1 < num_block)) {
+            block->fall = b + 1;
+        }
+    }
+}
+
+/* 命令を持たないブロックなら、制御が最終的に移るブロックを返す。
+   そうでなければ b を返す。
+ */
+static int skip_empty(int b) {
+    for (int i = 0; i < num_block; i++) {
+        Block *block = &blocks[b];
+        if (block->num_insn > 0) {
+            break;
+        }
+        if (block->term == LN_JMP) {
+            b = block->target;
+        } else if ((block->term == LN_INSN) && (block->fall >= 0)) {
+            b = block->fall;
+        } else {
+            break;
+        }
+    }
+    return b;
+}
+
+/* ジャンプ先がジャンプだけのブロックなら、その先へ直接ジャンプする */
+static void thread_jumps(void) {
+    for (int b = 0; b < num_block; b++) {
+        Block *block = &blocks[b];
+        if (block->target >= 0) {
+            block->target = skip_empty(block->target);
+        }
+        if (block->term == LN_TABLE) {
+            for (int i = 0; i < term_line(block)->num_target; i++) {
+                block->targets[i] = skip_empty(block->targets[i]);
+            }
+        }
+    }
+}
+
+/* ジャンプ先が ret で終わる短いブロックなら、ジャンプの代わりに複製する */
+static void duplicate_exits(void) {
+    for (int b = 0; b < num_block; b++) {
+        Block *block = &blocks[b];
+        if (block->term != LN_JMP) {
+            continue;
+        }
+        Block *target = &blocks[block->target];
+        if ((block->target != b) && (target->term == LN_EXIT)
+            && (target->num_insn <= MAX_DUP_INSN)) {
+            block->dup = block->target;
+            block->target = -1;
+        }
+    }
+}
+
+/* 関数の入口から到達するブロックに印を付ける */
+static void mark_reachable(int b) {
+    while ((b >= 0) && (blocks[b].reachable == false)) {
+        blocks[b].reachable = true;
+        mark_reachable(blocks[b].target);
+        if (blocks[b].term == LN_TABLE) {
+            for (int i = 0; i < term_line(&blocks[b])->num_target; i++) {
+                mark_reachable(blocks[b].targets[i]);
+            }
+        }
+        b = blocks[b].fall;
+    }
+}
+
+/* b へフォールスルーする到達可能なブロックがあれば true を返す */
+static bool has_fall_pred(int b) {
+    for (int p = 0; p < num_block; p++) {
+        if ((blocks[p].reachable == true) && (blocks[p].fall == b)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 到達可能なブロック p から b への辺があれば true を返す */
+static bool has_edge(int p, int b) {
+    Block *block = &blocks[p];
+    if ((block->reachable == false) || (block->dup == b)) {
+        return false;
+    }
+    if ((block->target == b) || (block->fall == b)) {
+        return true;
+    }
+    if (block->term == LN_TABLE) {
+        for (int i = 0; i < term_line(block)->num_target; i++) {
+            if (block->targets[i] == b) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* b に入る辺がすべて cold なブロックからなら true を返す */
+static bool all_preds_cold(int b) {
+    bool found = false;
+    for (int p = 0; p < num_block; p++) {
+        if (has_edge(p, b) == true) {
+            if (blocks[p].cold == false) {
+                return false;
+            }
+            found = true;
+        }
+    }
+    return found;
+}
+
+/* b に入る辺が p からのものだけなら true を返す */
+static bool is_only_pred(int p, int b) {
+    for (int q = 0; q < num_block; q++) {
+        if ((q != p) && (has_edge(q, b) == true)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* 予測の付いた条件ジャンプから、実行されにくいブロックに印を付ける。
+   関数の入口のブロックは cold にしない。
+ */
+static void mark_cold(void) {
+    for (int b = 0; b < num_block; b++) {
+        Block *block = &blocks[b];
+        if ((block->reachable == false) || (block->term != LN_JCC)
+            || (term_line(block)->hint == HINT_NONE)
+            || (block->target == block->fall)) {
+            continue;
+        }
+        // 通らないと予測した側が、このジャンプからしか入らなければ cold
+        int c = (term_line(block)->hint == HINT_LIKELY) ? block->fall
+                                                        : block->target;
+        if ((c > 0) && (is_only_pred(b, c) == true)) {
+            blocks[c].cold = true;
+        }
+    }
+
+    // cold なブロックからしか入らないブロックも cold
+    bool changed = true;
+    while (changed == true) {
+        changed = false;
+        for (int b = 1; b < num_block; b++) {
+            if ((blocks[b].reachable == true) && (blocks[b].cold == false)
+                && (all_preds_cold(b) == true)) {
+                blocks[b].cold = true;
+                changed = true;
+            }
+        }
+    }
+}
+
+/* ブロックの並び順を決める。
+   元の並び順で未配置のブロックから始め、フォールスルー先、あるいは
+   ジャンプでしか入らないジャンプ先を続けて並べる。
+   cold でないブロックをすべて並べてから、cold なブロックを並べる。
+ */
+static int *order_blocks(int *num_order) {
+    int *order = calloc(num_block, sizeof(int));
+    int n = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        bool cold = (pass == 1);
+        for (int start = 0; start < num_block; start++) {
+            int b = start;
+            while ((b >= 0) && (blocks[b].reachable == true)
+                   && (blocks[b].placed == false)
+                   && (blocks[b].cold == cold)) {
+                Block *block = &blocks[b];
+                block->placed = true;
+                order[n] = b;
+                n++;
+
+                int next = -1;
+                if ((block->fall >= 0) && (blocks[block->fall].placed == false)
+                    && (blocks[block->fall].cold == cold)) {
+                    next = block->fall;
+                } else if ((block->target >= 0)
+                           && (blocks[block->target].placed == false)
+                           && (blocks[block->target].cold == cold)
+                           && (has_fall_pred(block->target) == false)) {
+                    next = block->target;
+                }
+                b = next;
+            }
+        }
+    }
+    *num_order = n;
+    return order;
+}
+
+/* 条件ジャンプの条件を反転する */
+static char *invert_jcc(const char *op) {
+    static const char *pairs[][2] = {
+        {"je", "jne"},
+        {"jl", "jge"},
+        {"jle", "jg"},
+        {"jb", "jae"},
+        {"jbe", "ja"},
+    };
+    for (int i = 0; i < (int)(sizeof(pairs) / sizeof(pairs[0])); i++) {
+        if (strcmp(op, pairs[i][0]) == 0) {
+            return (char *)pairs[i][1];
+        }
+        if (strcmp(op, pairs[i][1]) == 0) {
+            return (char *)pairs[i][0];
+        }
+    }
+    error("条件ジャンプ %s を反転できません。", op);
+    return NULL;
+}
+
+/* ブロックにラベルがなければ作る */
+static void block_label(int b) {
+    Block *block = &blocks[b];
+    if (block->label != NULL) {
+        return;
+    }
+    for (int i = block->begin; i < block->end; i++) {
+        if (code->lines[i].kind == LN_LABEL) {
+            block->label = code->lines[i].label;
+            return;
+        }
+    }
+    block->label = calloc(32, 1);
+    snprintf(block->label, 32, ".Lbb%d", label_count);
+    label_count++;
+    block->new_label = true;
+}
+
+/* 行をそのまま追加する */
+static void copy_line(Code *out, Line *line) {
+    *add_line(out, line->kind, NULL, NULL) = *line;
+}
+
+/* ブロックへのジャンプを追加する */
+static void add_jump(Code *out, char *op, int b) {
+    LineKind kind = (strcmp(op, "jmp") == 0) ? LN_JMP : LN_JCC;
+    add_line(out, kind, op, blocks[b].label);
+}
+
+/* ブロックの本体 (終端を除く) を追加する。
+   with_label が false ならラベルとコメントを省く。
+ */
+static void add_body(Code *out, Block *block, bool with_label) {
+    int end = block->end;
+    if (block->term != LN_INSN) {
+        end--;
+    }
+    for (int i = block->begin; i < end; i++) {
+        Line *line = &code->lines[i];
+        if ((with_label == true) || (line->kind == LN_INSN)) {
+            copy_line(out, line);
+        }
+    }
+}
+
+/* 並び順に従ってブロックを出力する。
+   直後のブロックへのジャンプは削除し、直後でないフォールスルーには
+   ジャンプを追加する。
+ */
+static void emit_blocks(Code *out, int *order, int num_order) {
+    // ジャンプを追加するときに使うラベルを、先にすべてのブロックに付ける
+    for (int i = 0; i < num_order; i++) {
+        block_label(order[i]);
+    }
+
+    for (int i = 0; i < num_order; i++) {
+        Block *block = &blocks[order[i]];
+        int next = (i + 1 < num_order) ? order[i + 1] : -1;
+
+        if (block->new_label == true) {
+            add_line(out, LN_LABEL, NULL, block->label);
+        }
+        add_body(out, block, true);
+
+        if (block->dup >= 0) {
+            // ret で終わるブロックを複製する
+            Block *dup = &blocks[block->dup];
+            add_body(out, dup, false);
+            copy_line(out, term_line(dup));
+            continue;
+        }
+
+        switch (block->term) {
+        case LN_EXIT:
+            copy_line(out, term_line(block));
+            break;
+        case LN_TABLE: {
+            // テーブルの飛び先を、並べ替えた後のブロックのラベルにする
+            Line *line = term_line(block);
+            char **targets = calloc(line->num_target, sizeof(char *));
+            for (int t = 0; t < line->num_target; t++) {
+                targets[t] = blocks[block->targets[t]].label;
+            }
+            copy_line(out, line);
+            out->lines[out->num_line - 1].targets = targets;
+            break;
+        }
+        case LN_JMP:
+            if (block->target != next) {
+                add_jump(out, "jmp", block->target);
+            }
+            break;
+        case LN_JCC: {
+            char *op = term_line(block)->op;
+            if (block->target == block->fall) {
+                if (block->fall != next) {
+                    add_jump(out, "jmp", block->fall);
+                }
+            } else if (block->fall == next) {
+                add_jump(out, op, block->target);
+            } else if (block->target == next) {
+                add_jump(out, invert_jcc(op), block->fall);
+            } else {
+                add_jump(out, op, block->target);
+                add_jump(out, "jmp", block->fall);
+            }
+            break;
+        }
+        default:
+            if ((block->fall >= 0) && (block->fall != next)) {
+                add_jump(out, "jmp", block->fall);
+            }
+            break;
+        }
+    }
+}
+
+/* ジャンプ・ジャンプテーブルから参照されるラベルなら true を返す */
+static bool is_referenced(Code *out, const char *label) {
+    for (int i = 0; i < out->num_line; i++) {
+        Line *line = &out->lines[i];
+        if (((line->kind == LN_JMP) || (line->kind == LN_JCC))
+            && (strcmp(line->label, label) == 0)) {
+            return true;
+        }
+        for (int t = 0; t < line->num_target; t++) {
+            if (strcmp(line->targets[t], label) == 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* 参照されないラベルを削除する */
+static void remove_unused_labels(Code *out) {
+    int n = 0;
+    for (int i = 0; i < out->num_line; i++) {
+        Line *line = &out->lines[i];
+        if ((line->kind == LN_LABEL)
+            && (is_referenced(out, line->label) == false)) {
+            continue;
+        }
+        out->lines[n] = *line;
+        n++;
+    }
+    out->num_line = n;
+}
+
+/* 関数のコードを基本ブロックに分け、ジャンプを減らすように並べ替える */
+void layout_blocks(Code *func_code) {
+    code = func_code;
+
+    split_blocks();
+    link_blocks();
+    thread_jumps();
+    if (option.size == false) {
+        duplicate_exits();
+    }
+    mark_reachable(0);
+    mark_cold();
+
+    int num_order;
+    int *order = order_blocks(&num_order);
+
+    Code out = {NULL, 0, 0};
+    emit_blocks(&out, order, num_order);
+    remove_unused_labels(&out);
+
+    free(code->lines);
+    *code = out;
+    free(order);
+    for (int b = 0; b < num_block; b++) {
+        free(blocks[b].targets);
+    }
+    free(blocks);
+    blocks = NULL;
+}
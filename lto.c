@@ -0,0 +1,889 @@
+/* リンク時最適化 (LTO) のための中間表現モジュール
+
+   -flto では、アセンブリの代わりに、パースした関数を次の形式のバイナリで
+   出力する。複数のモジュールを入力にすると、それらを結合して
+   プログラム全体を最適化してからアセンブリを出力する。
+
+     ヘッダ      LtoHeader
+     シンボル表  LtoSymbol × num_symbol
+     呼び出し先  (名前の位置, 長さ) × シンボル表の num_callee の合計
+     関数本体    可変長整数で符号化した構文木
+     文字列表    関数名・変数名
+
+   整数はリトルエンディアン。関数本体の整数は LEB128 (符号付きは
+   zigzag 符号化) で符号化する。
+
+   読み込みはファイルを mmap し、シンボル表と呼び出し先のリストだけから
+   使われる関数を求めて、その関数の本体だけを復元する。
+   名前はファイル上の文字列表を直接指すのでコピーしない。
+ */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "9cc.h"
+
+/* ファイルの先頭のマジックナンバー */
+static const char LTO_MAGIC[8] = "9ccLTO\r\n";
+
+/* 形式のバージョン。
+   2: int を 4 バイトにし、ポインタの加減算を要素の大きさ倍した構文木
+   3: switch・case・break のノード
+ */
+#define LTO_VERSION (3)
+
+/* シンボルのフラグ */
+#define LTO_STATIC (1)          // static 関数
+#define LTO_ESCAPE (2)          // アドレスを取られた変数がある
+#define LTO_INLINE_SHIFT (2)    // インライン展開の指定 (InlineAttr) の位置
+
+/* ヘッダ */
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_symbol;
+    uint32_t symbol_offset;  // シンボル表の位置
+    uint32_t callee_offset;  // 呼び出し先のリストの位置
+    uint32_t body_offset;    // 関数本体の位置
+    uint32_t string_offset;  // 文字列表の位置
+    uint32_t string_size;    // 文字列表の大きさ
+    uint32_t reserved;
+} LtoHeader;
+
+/* シンボル表のエントリ (関数定義) */
+typedef struct {
+    uint32_t name;        // 名前の文字列表での位置
+    uint32_t len;         // 名前の長さ
+    uint32_t flags;       // LTO_STATIC など
+    uint32_t body;        // 関数本体の位置 (関数本体の先頭から)
+    uint32_t body_size;   // 関数本体の大きさ
+    uint32_t callee;      // 呼び出し先のリストでの位置 (要素数)
+    uint32_t num_callee;  // 呼び出す関数の数 (重複なし)
+} LtoSymbol;
+
+/* 書き出し用のバイト列 */
+typedef struct {
+    uint8_t *data;
+    int size;
+    int cap;
+} Buffer;
+
+/* バイト列の末尾に追加する */
+static void buf_write(Buffer *buf, const void *data, int size) {
+    if (buf->size + size > buf->cap) {
+        while (buf->size + size > buf->cap) {
+            buf->cap = (buf->cap == 0) ? 256 : buf->cap * 2;
+        }
+        buf->data = realloc(buf->data, buf->cap);
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+/* 符号なし整数を LEB128 で追加する */
+static void buf_uint(Buffer *buf, uint64_t val) {
+    do {
+        uint8_t byte = val & 0x7f;
+        val >>= 7;
+        if (val != 0) {
+            byte |= 0x80;
+        }
+        buf_write(buf, &byte, 1);
+    } while (val != 0);
+}
+
+/* 符号付き整数を zigzag 符号化して追加する */
+static void buf_int(Buffer *buf, int64_t val) {
+    buf_uint(buf, ((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+/* 文字列表。同じ文字列は 1 度だけ格納する */
+static Buffer strings;
+
+/* 文字列表の索引のエントリ */
+typedef struct {
+    uint32_t pos;  // 文字列表での位置
+    int len;       // 長さ
+    bool used;     // 文字列が入っていれば true
+} StringEntry;
+
+/* 文字列表の索引のハッシュ表 (オープンアドレス法) */
+static StringEntry *string_index = NULL;
+static int num_string = 0;
+static int max_string = 0;
+
+/* 文字列のハッシュ値 (FNV-1a) */
+static uint32_t hash_string(const char *str, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)str[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* 文字列を索引から探す。なければ、追加する場所を返す */
+static StringEntry *find_string(const char *str, int len) {
+    uint32_t i = hash_string(str, len) & (max_string - 1);
+    while ((string_index[i].used == true)
+           && ((string_index[i].len != len)
+               || (memcmp(strings.data + string_index[i].pos, str, len)
+                   != 0))) {
+        i = (i + 1) & (max_string - 1);
+    }
+    return &string_index[i];
+}
+
+/* 文字列を文字列表に追加し、その位置を返す */
+static uint32_t add_string(const char *str, int len) {
+    if ((num_string + 1) * 2 > max_string) {
+        StringEntry *old = string_index;
+        int old_max = max_string;
+        max_string = (max_string == 0) ? 256 : max_string * 2;
+        string_index = calloc(max_string, sizeof(StringEntry));
+        for (int i = 0; i < old_max; i++) {
+            if (old[i].used == true) {
+                *find_string((char *)strings.data + old[i].pos, old[i].len)
+                    = old[i];
+            }
+        }
+        free(old);
+    }
+
+    StringEntry *entry = find_string(str, len);
+    if (entry->used == false) {
+        entry->pos = strings.size;
+        entry->len = len;
+        entry->used = true;
+        buf_write(&strings, str, len);
+        num_string++;
+    }
+    return entry->pos;
+}
+
+/* 文字列を書き出す: 文字列表での位置と長さ */
+static void write_string(Buffer *buf, const char *str, int len) {
+    buf_uint(buf, add_string(str, len));
+    buf_uint(buf, len);
+}
+
+/* 型を書き出す: ポインタの段数と基本型 */
+static void write_type(Buffer *buf, Type *type) {
+    int depth = 0;
+    while (type->ty == TY_PTR) {
+        depth++;
+        type = type->ptr_to;
+    }
+    buf_uint(buf, depth);
+    buf_uint(buf, type->ty);
+}
+
+/* 関数のローカル変数を番号順に集める */
+static void collect_vars(Node *node, void *vars) {
+    if (node->kind == ND_BLOCK) {
+        for (LVar *var = node->v.block.locals; var != NULL; var = var->next) {
+            ((LVar **)vars)[var->id] = var;
+        }
+    }
+    visit_children(node, collect_vars, vars);
+}
+
+/* 関数が呼び出す関数 (名前ごとに最初の呼び出し) */
+typedef struct {
+    Node **calls;
+    int num;
+} Callees;
+
+/* 関数が呼び出す関数の名前を集める (重複なし) */
+static void collect_callees(Node *node, void *arg) {
+    Callees *callees = arg;
+
+    // 組み込み関数はシンボルを参照しない
+    if ((node->kind == ND_FUNC) && (node->v.func.builtin == BI_NONE)) {
+        bool found = false;
+        for (int i = 0; i < callees->num; i++) {
+            Node *callee = callees->calls[i];
+            if ((callee->v.func.len == node->v.func.len)
+                && (memcmp(callee->v.func.name,
+                           node->v.func.name,
+                           node->v.func.len)
+                    == 0)) {
+                found = true;
+                break;
+            }
+        }
+        if (found == false) {
+            callees->calls = realloc(callees->calls,
+                                     (callees->num + 1) * sizeof(Node *));
+            callees->calls[callees->num] = node;
+            callees->num++;
+        }
+    }
+    visit_children(node, collect_callees, arg);
+}
+
+/* 構文木を書き出す。ノードの種類は +1 して、0 を NULL にする */
+static void write_node(Buffer *buf, Node *node) {
+    if (node == NULL) {
+        buf_uint(buf, 0);
+        return;
+    }
+
+    buf_uint(buf, node->kind + 1);
+    switch (node->kind) {
+    case ND_NULL:
+        break;
+    case ND_NUM:
+        buf_int(buf, node->v.num.val);
+        break;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_ASSIGN:
+        write_node(buf, node->v.op2.lhs);
+        write_node(buf, node->v.op2.rhs);
+        break;
+    case ND_RETURN:
+    case ND_ADDR:
+    case ND_DEREF:
+        write_node(buf, node->v.op1.expr);
+        break;
+    case ND_IF:
+        write_node(buf, node->v.cif.test);
+        write_node(buf, node->v.cif.tbody);
+        write_node(buf, node->v.cif.ebody);
+        break;
+    case ND_WHILE:
+        write_node(buf, node->v.cwhile.test);
+        write_node(buf, node->v.cwhile.body);
+        break;
+    case ND_FOR:
+        write_node(buf, node->v.cfor.init);
+        write_node(buf, node->v.cfor.test);
+        write_node(buf, node->v.cfor.update);
+        write_node(buf, node->v.cfor.body);
+        break;
+    case ND_SWITCH:
+        write_node(buf, node->v.cswitch.test);
+        write_node(buf, node->v.cswitch.body);
+        break;
+    case ND_LVAR:
+        buf_uint(buf, node->v.lvar.var->id);
+        break;
+    case ND_FUNC:
+        write_string(buf, node->v.func.name, node->v.func.len);
+        buf_uint(buf, node->v.func.num_param);
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            write_node(buf, node->v.func.params[i]);
+        }
+        break;
+    case ND_BLOCK:
+        buf_uint(buf, node->v.block.num_local);
+        for (LVar *var = node->v.block.locals; var != NULL; var = var->next) {
+            buf_uint(buf, var->id);
+        }
+        buf_uint(buf, node->v.block.total_local);
+        buf_uint(buf, node->v.block.num_code);
+        for (int i = 0; i < node->v.block.num_code; i++) {
+            write_node(buf, node->v.block.code[i]);
+        }
+        break;
+    case ND_INLINE:
+        write_string(buf, node->v.inl.name, node->v.inl.len);
+        write_node(buf, node->v.inl.block);
+        break;
+    case ND_CASE:
+        buf_int(buf, node->v.ccase.val);
+        buf_uint(buf, node->v.ccase.is_default);
+        break;
+    case ND_BREAK:
+        break;
+    default:
+        error("モジュールに書き出せないノードです。");
+        break;
+    }
+}
+
+/* 関数本体を書き出す: 変数表、戻り値の型、パラメータ、ブロック */
+static void write_func(Buffer *buf, Node *deffunc) {
+    Node *block = deffunc->v.deffunc.block;
+    int num_var = block->v.block.total_local;
+    LVar **vars = calloc(num_var + 1, sizeof(LVar *));
+    collect_vars(block, vars);
+
+    buf_uint(buf, num_var);
+    for (int i = 0; i < num_var; i++) {
+        write_string(buf, vars[i]->name, vars[i]->len);
+        write_type(buf, vars[i]->type);
+    }
+    free(vars);
+
+    write_type(buf, deffunc->v.deffunc.rettype);
+    buf_uint(buf, deffunc->v.deffunc.num_param);
+    for (int i = 0; i < deffunc->v.deffunc.num_param; i++) {
+        buf_uint(buf, deffunc->v.deffunc.params[i]->id);
+    }
+    write_node(buf, block);
+}
+
+/* プログラムを中間表現モジュールとして書き出す */
+void write_module(Node *program, FILE *out) {
+    int num_symbol = program->v.block.num_code;
+    LtoSymbol *symbols = calloc(num_symbol + 1, sizeof(LtoSymbol));
+    Buffer callees = {NULL, 0, 0};
+    Buffer bodies = {NULL, 0, 0};
+    int num_callee = 0;
+
+    for (int i = 0; i < num_symbol; i++) {
+        Node *deffunc = program->v.block.code[i];
+        LtoSymbol *sym = &symbols[i];
+        sym->name = add_string(deffunc->v.deffunc.name, deffunc->v.deffunc.len);
+        sym->len = deffunc->v.deffunc.len;
+        sym->flags = (deffunc->v.deffunc.is_static ? LTO_STATIC : 0)
+                     | (deffunc->v.deffunc.has_escape ? LTO_ESCAPE : 0)
+                     | (deffunc->v.deffunc.inline_attr << LTO_INLINE_SHIFT);
+
+        Callees calls = {NULL, 0};
+        collect_callees(deffunc->v.deffunc.block, &calls);
+        sym->callee = num_callee;
+        sym->num_callee = calls.num;
+        for (int j = 0; j < calls.num; j++) {
+            Node *call = calls.calls[j];
+            uint32_t ref[2];
+            ref[0] = add_string(call->v.func.name, call->v.func.len);
+            ref[1] = call->v.func.len;
+            buf_write(&callees, ref, sizeof(ref));
+        }
+        num_callee += calls.num;
+        free(calls.calls);
+
+        sym->body = bodies.size;
+        write_func(&bodies, deffunc);
+        sym->body_size = bodies.size - sym->body;
+    }
+
+    LtoHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LTO_MAGIC, sizeof(header.magic));
+    header.version = LTO_VERSION;
+    header.num_symbol = num_symbol;
+    header.symbol_offset = sizeof(LtoHeader);
+    header.callee_offset = header.symbol_offset
+                           + num_symbol * sizeof(LtoSymbol);
+    header.body_offset = header.callee_offset + callees.size;
+    header.string_offset = header.body_offset + bodies.size;
+    header.string_size = strings.size;
+
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(symbols, sizeof(LtoSymbol), num_symbol, out);
+    fwrite(callees.data, 1, callees.size, out);
+    fwrite(bodies.data, 1, bodies.size, out);
+    fwrite(strings.data, 1, strings.size, out);
+
+    free(symbols);
+    free(callees.data);
+    free(bodies.data);
+}
+
+/* mmap したモジュール */
+typedef struct {
+    const char *path;
+    const uint8_t *data;
+    size_t size;
+    const LtoHeader *header;
+    const LtoSymbol *symbols;
+    const uint32_t *callees;
+    const char *strings;
+    char **names;     // リンク後の関数名 (static 関数の名前は変わりうる)
+    int *name_lens;
+    bool *used;       // プログラムから使われる関数か
+} Module;
+
+/* 読み込んだモジュール */
+static Module *modules = NULL;
+static int num_module = 0;
+
+/* 関数本体を読むときの位置 */
+typedef struct {
+    Module *mod;
+    const uint8_t *pos;
+    const uint8_t *end;
+    LVar **vars;  // 関数の変数表
+    int num_var;
+} Reader;
+
+/* モジュールが壊れている */
+static void corrupt(Module *mod) {
+    error("%s: モジュールが壊れています。", mod->path);
+}
+
+/* LEB128 の符号なし整数を読む */
+static uint64_t read_uint(Reader *r) {
+    uint64_t val = 0;
+    int shift = 0;
+    while (1) {
+        if ((r->pos >= r->end) || (shift >= 64)) {
+            corrupt(r->mod);
+        }
+        uint8_t byte = *r->pos;
+        r->pos++;
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return val;
+        }
+        shift += 7;
+    }
+}
+
+/* zigzag 符号化された符号付き整数を読む */
+static int64_t read_int(Reader *r) {
+    uint64_t val = read_uint(r);
+    return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+/* 文字列を読む。文字列表を直接指す */
+static char *read_string(Reader *r, int *len) {
+    uint64_t pos = read_uint(r);
+    *len = read_uint(r);
+    if (pos + *len > r->mod->header->string_size) {
+        corrupt(r->mod);
+    }
+    return (char *)r->mod->strings + pos;
+}
+
+/* 型を読む */
+static Type *read_type(Reader *r) {
+    int depth = read_uint(r);
+    uint64_t ty = read_uint(r);
+    if (ty > TY_LONG) {
+        corrupt(r->mod);
+    }
+    Type *type = calloc(1, sizeof(Type));
+    type->ty = ty;
+    for (int i = 0; i < depth; i++) {
+        Type *ptr = calloc(1, sizeof(Type));
+        ptr->ty = TY_PTR;
+        ptr->ptr_to = type;
+        type = ptr;
+    }
+    return type;
+}
+
+/* 変数の番号を読む */
+static LVar *read_var(Reader *r) {
+    uint64_t idx = read_uint(r);
+    if (idx >= (uint64_t)r->num_var) {
+        corrupt(r->mod);
+    }
+    return r->vars[idx];
+}
+
+/* 関数呼び出しの名前を、リンク後の名前に置き換える。
+   同じモジュールの static 関数は、名前が変わっていることがある。
+ */
+static void link_name(Module *mod, char **name, int *len) {
+    for (uint32_t i = 0; i < mod->header->num_symbol; i++) {
+        const LtoSymbol *sym = &mod->symbols[i];
+        if ((sym->len == (uint32_t)*len)
+            && (memcmp(mod->strings + sym->name, *name, *len) == 0)) {
+            *name = mod->names[i];
+            *len = mod->name_lens[i];
+            return;
+        }
+    }
+}
+
+static Node *read_node(Reader *r, Node *pblock);
+
+/* ブロックを読む */
+static Node *read_block(Reader *r, Node *node, Node *pblock) {
+    node->v.block.pblock = pblock;
+    node->v.block.num_local = read_uint(r);
+
+    // 書き出したときと同じ順にリストをつなぐ
+    LVar **tail = &node->v.block.locals;
+    for (int i = 0; i < node->v.block.num_local; i++) {
+        LVar *var = read_var(r);
+        var->next = NULL;
+        *tail = var;
+        tail = &var->next;
+    }
+    node->v.block.total_local = read_uint(r);
+
+    int num_code = read_uint(r);
+    node->v.block.max_code = num_code;
+    node->v.block.num_code = num_code;
+    node->v.block.code = calloc(num_code + 1, sizeof(Node *));
+    for (int i = 0; i < num_code; i++) {
+        node->v.block.code[i] = read_node(r, node);
+    }
+    return node;
+}
+
+/* 構文木を読む */
+static Node *read_node(Reader *r, Node *pblock) {
+    uint64_t kind = read_uint(r);
+    if (kind == 0) {
+        return NULL;
+    }
+    if (kind > ND_BREAK + 1) {
+        corrupt(r->mod);
+    }
+
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = kind - 1;
+    switch (node->kind) {
+    case ND_NULL:
+        break;
+    case ND_NUM:
+        node->v.num.val = read_int(r);
+        break;
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_ASSIGN:
+        node->v.op2.lhs = read_node(r, pblock);
+        node->v.op2.rhs = read_node(r, pblock);
+        break;
+    case ND_RETURN:
+    case ND_ADDR:
+    case ND_DEREF:
+        node->v.op1.expr = read_node(r, pblock);
+        break;
+    case ND_IF:
+        node->v.cif.test = read_node(r, pblock);
+        node->v.cif.tbody = read_node(r, pblock);
+        node->v.cif.ebody = read_node(r, pblock);
+        break;
+    case ND_WHILE:
+        node->v.cwhile.test = read_node(r, pblock);
+        node->v.cwhile.body = read_node(r, pblock);
+        break;
+    case ND_FOR:
+        node->v.cfor.init = read_node(r, pblock);
+        node->v.cfor.test = read_node(r, pblock);
+        node->v.cfor.update = read_node(r, pblock);
+        node->v.cfor.body = read_node(r, pblock);
+        break;
+    case ND_SWITCH:
+        node->v.cswitch.test = read_node(r, pblock);
+        node->v.cswitch.body = read_node(r, pblock);
+        break;
+    case ND_LVAR: {
+        LVar *var = read_var(r);
+        node->v.lvar.var = var;
+        node->v.lvar.name = var->name;
+        node->v.lvar.len = var->len;
+        break;
+    }
+    case ND_FUNC: {
+        node->v.func.name = read_string(r, &node->v.func.len);
+        link_name(r->mod, &node->v.func.name, &node->v.func.len);
+        node->v.func.builtin
+            = find_builtin(node->v.func.name, node->v.func.len);
+        int num_param = read_uint(r);
+        node->v.func.max_param = num_param;
+        node->v.func.num_param = num_param;
+        node->v.func.params = calloc(num_param + 1, sizeof(Node *));
+        for (int i = 0; i < num_param; i++) {
+            node->v.func.params[i] = read_node(r, pblock);
+        }
+        break;
+    }
+    case ND_BLOCK:
+        read_block(r, node, pblock);
+        break;
+    case ND_INLINE:
+        node->v.inl.name = read_string(r, &node->v.inl.len);
+        node->v.inl.block = read_node(r, pblock);
+        break;
+    case ND_CASE:
+        node->v.ccase.val = read_int(r);
+        node->v.ccase.is_default = (read_uint(r) != 0);
+        break;
+    case ND_BREAK:
+        break;
+    default:
+        corrupt(r->mod);
+        break;
+    }
+    return node;
+}
+
+/* 関数本体を読んで関数定義のノードを作る */
+static Node *read_func(Module *mod, int idx) {
+    const LtoSymbol *sym = &mod->symbols[idx];
+    Reader r;
+    r.mod = mod;
+    r.pos = mod->data + mod->header->body_offset + sym->body;
+    r.end = r.pos + sym->body_size;
+    if (r.end > mod->data + mod->header->string_offset) {
+        corrupt(mod);
+    }
+
+    r.num_var = read_uint(&r);
+    r.vars = calloc(r.num_var + 1, sizeof(LVar *));
+    for (int i = 0; i < r.num_var; i++) {
+        LVar *var = calloc(1, sizeof(LVar));
+        var->name = read_string(&r, &var->len);
+        var->type = read_type(&r);
+        var->id = i;
+        r.vars[i] = var;
+    }
+
+    Node *deffunc = calloc(1, sizeof(Node));
+    deffunc->kind = ND_DEFFUNC;
+    deffunc->v.deffunc.name = mod->names[idx];
+    deffunc->v.deffunc.len = mod->name_lens[idx];
+    deffunc->v.deffunc.is_static = (sym->flags & LTO_STATIC) != 0;
+    deffunc->v.deffunc.has_escape = (sym->flags & LTO_ESCAPE) != 0;
+    deffunc->v.deffunc.inline_attr = sym->flags >> LTO_INLINE_SHIFT;
+    deffunc->v.deffunc.rettype = read_type(&r);
+
+    int num_param = read_uint(&r);
+    deffunc->v.deffunc.max_param = num_param;
+    deffunc->v.deffunc.num_param = num_param;
+    deffunc->v.deffunc.params = calloc(num_param + 1, sizeof(LVar *));
+    for (int i = 0; i < num_param; i++) {
+        deffunc->v.deffunc.params[i] = read_var(&r);
+    }
+
+    Node *block = read_node(&r, NULL);
+    if ((block == NULL) || (block->kind != ND_BLOCK)) {
+        corrupt(mod);
+    }
+    deffunc->v.deffunc.block = block;
+    free(r.vars);
+    return deffunc;
+}
+
+/* モジュールを mmap して検査する */
+static void open_module(Module *mod, const char *path) {
+    mod->path = path;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        error("%s を開けません。", path);
+    }
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)sizeof(LtoHeader))) {
+        error("%s: モジュールではありません。", path);
+    }
+    mod->size = st.st_size;
+    mod->data = mmap(NULL, mod->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mod->data == MAP_FAILED) {
+        error("%s を mmap できません。", path);
+    }
+
+    mod->header = (const LtoHeader *)mod->data;
+    const LtoHeader *h = mod->header;
+    if (memcmp(h->magic, LTO_MAGIC, sizeof(h->magic)) != 0) {
+        error("%s: モジュールではありません。", path);
+    }
+    if (h->version != LTO_VERSION) {
+        error("%s: モジュールのバージョン %u は読めません。", path, h->version);
+    }
+    if ((h->symbol_offset + (uint64_t)h->num_symbol * sizeof(LtoSymbol)
+         > h->callee_offset)
+        || (h->callee_offset > h->body_offset)
+        || (h->body_offset > h->string_offset)
+        || ((uint64_t)h->string_offset + h->string_size > mod->size)) {
+        corrupt(mod);
+    }
+    mod->symbols = (const LtoSymbol *)(mod->data + h->symbol_offset);
+    mod->callees = (const uint32_t *)(mod->data + h->callee_offset);
+    mod->strings = (const char *)(mod->data + h->string_offset);
+
+    int n = h->num_symbol;
+    mod->names = calloc(n + 1, sizeof(char *));
+    mod->name_lens = calloc(n + 1, sizeof(int));
+    mod->used = calloc(n + 1, sizeof(bool));
+    for (int i = 0; i < n; i++) {
+        const LtoSymbol *sym = &mod->symbols[i];
+        if (((uint64_t)sym->name + sym->len > h->string_size)
+            || ((uint64_t)sym->callee + sym->num_callee
+                > (h->body_offset - h->callee_offset) / 8)
+            || ((uint64_t)sym->body + sym->body_size
+                > h->string_offset - h->body_offset)) {
+            corrupt(mod);
+        }
+        mod->names[i] = (char *)mod->strings + sym->name;
+        mod->name_lens[i] = sym->len;
+    }
+}
+
+/* 名前の一致するシンボルを探す。
+   m が 0 以上ならそのモジュールだけを、負なら全モジュールの非 static
+   関数を探す。見つかれば true を返し、モジュールと番号をセットする。
+ */
+static bool find_symbol(int m,
+                        const char *name,
+                        int len,
+                        int *found_mod,
+                        int *found_idx) {
+    for (int i = 0; i < num_module; i++) {
+        if ((m >= 0) && (i != m)) {
+            continue;
+        }
+        Module *mod = &modules[i];
+        for (uint32_t j = 0; j < mod->header->num_symbol; j++) {
+            const LtoSymbol *sym = &mod->symbols[j];
+            if ((m < 0) && ((sym->flags & LTO_STATIC) != 0)) {
+                continue;
+            }
+            if ((sym->len == (uint32_t)len)
+                && (memcmp(mod->strings + sym->name, name, len) == 0)) {
+                *found_mod = i;
+                *found_idx = j;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* 関数を使われる関数とし、その関数が呼び出す関数もたどる */
+static void mark_used(int m, int idx) {
+    Module *mod = &modules[m];
+    if (mod->used[idx] == true) {
+        return;
+    }
+    mod->used[idx] = true;
+
+    const LtoSymbol *sym = &mod->symbols[idx];
+    for (uint32_t i = 0; i < sym->num_callee; i++) {
+        const uint32_t *ref = &mod->callees[(sym->callee + i) * 2];
+        if ((uint64_t)ref[0] + ref[1] > mod->header->string_size) {
+            corrupt(mod);
+        }
+        const char *name = mod->strings + ref[0];
+        int found_mod, found_idx;
+        // 同じモジュールの関数 (static を含む) を優先する
+        if ((find_symbol(m, name, ref[1], &found_mod, &found_idx) == true)
+            || (find_symbol(-1, name, ref[1], &found_mod, &found_idx)
+                == true)) {
+            mark_used(found_mod, found_idx);
+        }
+    }
+}
+
+/* static 関数の名前が他のモジュールの関数と重なれば、名前を変える。
+   非 static 関数が重なればエラーにする。
+ */
+static void rename_symbols(void) {
+    for (int m = 0; m < num_module; m++) {
+        Module *mod = &modules[m];
+        for (uint32_t i = 0; i < mod->header->num_symbol; i++) {
+            bool is_static = (mod->symbols[i].flags & LTO_STATIC) != 0;
+            for (int n = 0; n < num_module; n++) {
+                if (n == m) {
+                    continue;
+                }
+                int found_mod, found_idx;
+                if (find_symbol(n,
+                                mod->names[i],
+                                mod->name_lens[i],
+                                &found_mod,
+                                &found_idx)
+                    == false) {
+                    continue;
+                }
+                bool other_static
+                    = (modules[n].symbols[found_idx].flags & LTO_STATIC) != 0;
+                if ((is_static == false) && (other_static == false)) {
+                    error("関数 %.*s が多重定義されました: %s, %s",
+                          mod->name_lens[i],
+                          mod->names[i],
+                          modules[n].path,
+                          mod->path);
+                }
+                if (is_static == true) {
+                    int len = mod->name_lens[i] + 16;
+                    char *name = calloc(len, 1);
+                    snprintf(name,
+                             len,
+                             "%.*s.%d",
+                             mod->name_lens[i],
+                             mod->names[i],
+                             m);
+                    mod->names[i] = name;
+                    mod->name_lens[i] = strlen(name);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/* path が中間表現モジュールなら true を返す */
+bool is_module_file(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return false;
+    }
+    char magic[sizeof(LTO_MAGIC)];
+    bool match = (fread(magic, 1, sizeof(magic), fp) == sizeof(magic))
+                 && (memcmp(magic, LTO_MAGIC, sizeof(magic)) == 0);
+    fclose(fp);
+    return match;
+}
+
+/* 中間表現モジュールを読み込み、1 つのプログラムに結合する。
+   main があれば main から、なければ非 static 関数から呼ばれる関数だけを
+   読み込む。
+ */
+Node *link_modules(char **paths, int num_path) {
+    num_module = num_path;
+    modules = calloc(num_module, sizeof(Module));
+    for (int i = 0; i < num_module; i++) {
+        open_module(&modules[i], paths[i]);
+    }
+    rename_symbols();
+
+    int m, idx;
+    if (find_symbol(-1, "main", 4, &m, &idx) == true) {
+        mark_used(m, idx);
+    } else {
+        for (m = 0; m < num_module; m++) {
+            for (idx = 0; idx < (int)modules[m].header->num_symbol; idx++) {
+                if ((modules[m].symbols[idx].flags & LTO_STATIC) == 0) {
+                    mark_used(m, idx);
+                }
+            }
+        }
+    }
+
+    Node *program = calloc(1, sizeof(Node));
+    program->kind = ND_BLOCK;
+    for (m = 0; m < num_module; m++) {
+        Module *mod = &modules[m];
+        for (idx = 0; idx < (int)mod->header->num_symbol; idx++) {
+            if (mod->used[idx] == false) {
+                continue;
+            }
+            if (program->v.block.max_code == program->v.block.num_code) {
+                program->v.block.max_code += MAX_CODE;
+                program->v.block.code
+                    = realloc(program->v.block.code,
+                              program->v.block.max_code * sizeof(Node *));
+            }
+            program->v.block.code[program->v.block.num_code]
+                = read_func(mod, idx);
+            program->v.block.num_code++;
+        }
+    }
+    // 中間表現には式の型を書き出さないので、読み込んだ後に付ける
+    add_type(program);
+    return program;
+}
@@ -1,20 +1,194 @@
 #include "9cc.h"
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
+/* コンパイルオプション */
+Option option = {
+    .inline_limit = -1,  // 指定がなければインライン展開側で決める
+    .dce = true,
+    .ipa = true,
+    .layout = true,
+    .vectorize = true,
+    .peephole = true,
+    .stack_reuse = true,
+    .schedule = true,
+    .isa = ISA_SSE2,
+};
+
+/* 文字列が prefix で始まっていれば、その後ろの文字列を返す。
+   違っていれば NULL を返す。
+ */
+static const char *option_value(const char *arg, const char *prefix) {
+    int len = strlen(prefix);
+    if (strncmp(arg, prefix, len) != 0) {
+        return NULL;
+    }
+    return arg + len;
+}
+
+/* -march=... の CPU で使える命令をオプションにセットする。
+   x86-64-v2 から popcnt を、x86-64-v3 から AVX2 と lzcnt・tzcnt を使う。
+ */
+static void parse_march(const char *arch) {
+    if (strcmp(arch, "x86-64") == 0) {
+        option.isa = ISA_SSE2;
+        option.popcnt = false;
+        option.lzcnt = false;
+    } else if (strcmp(arch, "x86-64-v2") == 0) {
+        option.isa = ISA_SSE2;
+        option.popcnt = true;
+        option.lzcnt = false;
+    } else if ((strcmp(arch, "x86-64-v3") == 0)
+               || (strcmp(arch, "x86-64-v4") == 0)
+               || (strcmp(arch, "haswell") == 0)) {
+        option.isa = ISA_AVX2;
+        option.popcnt = true;
+        option.lzcnt = true;
+    } else if (strcmp(arch, "native") == 0) {
+        __builtin_cpu_init();
+        option.isa = __builtin_cpu_supports("avx2") ? ISA_AVX2 : ISA_SSE2;
+        option.popcnt = __builtin_cpu_supports("popcnt");
+        option.lzcnt = __builtin_cpu_supports("lzcnt")
+                       && __builtin_cpu_supports("bmi");
+    } else {
+        error("不明なアーキテクチャです: %s", arch);
+    }
+}
+
+/* -mtune=... のモデルをオプションにセットする */
+static void parse_mtune(const char *cpu) {
+    if (strcmp(cpu, "generic") == 0) {
+        option.tune = TUNE_GENERIC;
+    } else if ((strcmp(cpu, "skylake") == 0)
+               || (strcmp(cpu, "haswell") == 0)) {
+        option.tune = TUNE_SKYLAKE;
+    } else if ((strcmp(cpu, "znver3") == 0)
+               || (strcmp(cpu, "znver2") == 0)) {
+        option.tune = TUNE_ZNVER3;
+    } else {
+        error("不明な CPU です: %s", cpu);
+    }
+}
+
+/* 入力 (プログラムか、中間表現モジュールのファイル名) */
+static char **inputs = NULL;
+static int num_input = 0;
+
+/* --run で読み込む共有ライブラリ */
+static char **libraries = NULL;
+static int num_library = 0;
+
+/* コマンドライン引数を解析して、入力を inputs にセットする */
+static void parse_args(int argc, char **argv) {
+    const char *value;
+
+    for (int i = 1; i < argc; i++) {
+        if ((value = option_value(argv[i], "-finline-limit=")) != NULL) {
+            option.inline_limit = atoi(value);
+        } else if (strcmp(argv[i], "-fno-dce") == 0) {
+            option.dce = false;
+        } else if (strcmp(argv[i], "-fno-ipa") == 0) {
+            option.ipa = false;
+        } else if (strcmp(argv[i], "-fno-layout") == 0) {
+            option.layout = false;
+        } else if (strcmp(argv[i], "-fno-vectorize") == 0) {
+            option.vectorize = false;
+        } else if ((value = option_value(argv[i], "-march=")) != NULL) {
+            parse_march(value);
+        } else if ((value = option_value(argv[i], "-mtune=")) != NULL) {
+            parse_mtune(value);
+        } else if (strcmp(argv[i], "-fno-schedule-insns") == 0) {
+            option.schedule = false;
+        } else if (strcmp(argv[i], "-fsched-stats") == 0) {
+            option.sched_stats = true;
+        } else if (strcmp(argv[i], "-flto") == 0) {
+            option.lto = true;
+        } else if (strcmp(argv[i], "-fverbose-asm") == 0) {
+            option.verbose_asm = true;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            option.obj = true;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            option.run = true;
+        } else if ((value = option_value(argv[i], "--run-lib=")) != NULL) {
+            libraries = realloc(libraries, (num_library + 1) * sizeof(char *));
+            libraries[num_library] = (char *)value;
+            num_library++;
+        } else if (strcmp(argv[i], "-fno-stack-reuse") == 0) {
+            option.stack_reuse = false;
+        } else if (strcmp(argv[i], "-fomit-frame-pointer") == 0) {
+            option.omit_frame_pointer = true;
+        } else if (strcmp(argv[i], "-fno-omit-frame-pointer") == 0) {
+            option.omit_frame_pointer = false;
+        } else if (strcmp(argv[i], "-fno-peephole") == 0) {
+            option.peephole = false;
+        } else if (strcmp(argv[i], "-fpeephole-stats") == 0) {
+            option.peephole_stats = true;
+        } else if (strcmp(argv[i], "-Os") == 0) {
+            // ループを複製するベクトル化は行わない
+            option.size = true;
+            option.vectorize = false;
+        } else if (strcmp(argv[i], "-fsize-report") == 0) {
+            option.size_report = true;
+        } else if (argv[i][0] == '-') {
+            error("不明なオプションです: %s", argv[i]);
+        } else {
+            inputs = realloc(inputs, (num_input + 1) * sizeof(char *));
+            inputs[num_input] = argv[i];
+            num_input++;
+        }
+    }
+    if (num_input == 0) {
         error("引数の個数が間違っています。");
-        return 1;
     }
+}
 
-    // 式をトークナイズしてパースする
-    user_input = argv[1];
-    tokenize(argv[1]);
-    Node *program = parse();
+int main(int argc, char **argv) {
+    Node *program;
+
+    parse_args(argc, argv);
+    if (is_module_file(inputs[0]) == true) {
+        // 中間表現モジュールを結合して、プログラム全体を最適化する
+        program = link_modules(inputs, num_input);
+    } else {
+        if (num_input != 1) {
+            error("引数の個数が間違っています。");
+        }
+        // 式をトークナイズしてパースする
+        user_input = inputs[0];
+        tokenize(inputs[0]);
+        program = parse();
+    }
+
+    if (option.lto == true) {
+        // 最適化はリンク時に行う
+        write_module(program, stdout);
+        return 0;
+    }
+
+    // 最適化
+    analyze_interprocedural(program);
+    inline_functions(program);
+    eliminate_dead_code(program);
+    promote_locals(program);
+    vectorize_loops(program);
+    assign_stack_slots(program);
+    choose_conventions(program);
 
     // コード出力
-    printf(".intel_syntax noprefix\n");
-    printf(".global main\n");
-    gen(program);
+    gen_program(program);
+    if (option.peephole_stats == true) {
+        print_peephole_stats(stderr);
+    }
+    if (option.sched_stats == true) {
+        print_sched_stats(stderr);
+    }
+    if (option.size_report == true) {
+        print_text_sizes(stderr);
+    }
+    if (option.run == true) {
+        for (int i = 0; i < num_library; i++) {
+            jit_load_library(libraries[i]);
+        }
+        return jit_run();
+    }
 
     return 0;
 }
@@ -0,0 +1,92 @@
+/* 抽象構文木の走査
+
+   最適化の各パスで共通に使う、子ノードの走査と関数定義の検索。
+   各パスは自分が関心のあるノードだけを処理し、残りは visit_children で
+   子ノードへ進む。
+ */
+#include "9cc.h"
+
+/* NULL でなければ visit(child, arg) を呼ぶ */
+static void visit_child(Node *child, NodeVisitor visit, void *arg) {
+    if (child != NULL) {
+        visit(child, arg);
+    }
+}
+
+/* node の直接の子ノードについて、ソース上の順に visit(子, arg) を呼ぶ。
+   NULL の子ノードは飛ばす。
+ */
+void visit_children(Node *node, NodeVisitor visit, void *arg) {
+    if (node == NULL) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_ASSIGN:
+        visit_child(node->v.op2.lhs, visit, arg);
+        visit_child(node->v.op2.rhs, visit, arg);
+        break;
+    case ND_RETURN:
+    case ND_ADDR:
+    case ND_DEREF:
+        visit_child(node->v.op1.expr, visit, arg);
+        break;
+    case ND_IF:
+        visit_child(node->v.cif.test, visit, arg);
+        visit_child(node->v.cif.tbody, visit, arg);
+        visit_child(node->v.cif.ebody, visit, arg);
+        break;
+    case ND_WHILE:
+        visit_child(node->v.cwhile.test, visit, arg);
+        visit_child(node->v.cwhile.body, visit, arg);
+        break;
+    case ND_FOR:
+        visit_child(node->v.cfor.init, visit, arg);
+        visit_child(node->v.cfor.test, visit, arg);
+        visit_child(node->v.cfor.update, visit, arg);
+        visit_child(node->v.cfor.body, visit, arg);
+        break;
+    case ND_SWITCH:
+        visit_child(node->v.cswitch.test, visit, arg);
+        visit_child(node->v.cswitch.body, visit, arg);
+        break;
+    case ND_BLOCK:
+        for (int i = 0; i < node->v.block.num_code; i++) {
+            visit_child(node->v.block.code[i], visit, arg);
+        }
+        break;
+    case ND_FUNC:
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            visit_child(node->v.func.params[i], visit, arg);
+        }
+        break;
+    case ND_INLINE:
+        visit_child(node->v.inl.block, visit, arg);
+        break;
+    default:
+        break;
+    }
+}
+
+/* 名前から関数定義を探し、プログラム内での番号を返す。
+   見つからなければ -1 を返す。
+ */
+int find_func(Node *program, const char *name, int len) {
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        Node *deffunc = program->v.block.code[i];
+        if ((deffunc->v.deffunc.len == len)
+            && (memcmp(deffunc->v.deffunc.name, name, len) == 0)) {
+            return i;
+        }
+    }
+    return -1;
+}
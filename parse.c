@@ -1,20 +1,25 @@
 /* BNF:
    program    = deffunc*
-   deffunc    = "int" ("*")? ident "(" ((defvar ",")* defvar)? ")" "{" stmt* "}"
+   deffunc    = "static"? ("noinline" | "always_inline")?
+                "int" ("*")? ident "(" ((defvar ",")* defvar)? ")" "{" stmt* "}"
    stmt       = expr ";"
               | "{" stmt* "}"
               | "if" "(" expr ")" stmt ("else" stmt)?
               | "while" "(" expr ")" stmt
               | "for" "(" expr? ";" expr? ";" expr? ")" stmt
+              | "switch" "(" expr ")" "{" (case | stmt)* "}"
+              | "break" ";"
               | return expr ";"
               | defvar ";"
+   case       = "case" "-"? num ":"
+              | "default" ":"
    expr       = assign
    defvar     = "int" ("*")? ident
    assign     = equality ("=" assign)?
    equality   = relational ("==" relational | "!=" relational)*
    relational = add ("<" add | "<=" add | ">" add | ">=" add)*
    add        = mul ("+" mul | "-" mul)*
-   mul        = unary ("*" unary | "/" unary)*
+   mul        = unary ("*" unary | "/" unary | "%" unary)*
    unary      = ("+" | "-")? term
               | ("*" | "&") unary
    term       = num
@@ -26,8 +31,15 @@
  */
 #include "9cc.h"
 
+/* 解析中の関数 */
+static Node *cur_deffunc = NULL;
+
 /* ローカル関数 */
 static Node *expr(Node *pblock);
+static Node *stmt(Node *pblock);
+
+/* break で抜けられるループ・switch の入れ子の深さ */
+static int break_depth = 0;
 
 /* トークンの種類を文字列に変換する */
 static const char *tokenKind_to_str(TokenKind kind) {
@@ -57,6 +69,7 @@ static Node *new_node_op1(NodeKind kind, Node *expr) {
 
     node->kind = kind;
     node->v.op1.expr = expr;
+    add_type(node);
     return node;
 }
 
@@ -67,6 +80,7 @@ static Node *new_node_op2(NodeKind kind, Node *lhs, Node *rhs) {
     node->kind = kind;
     node->v.op2.lhs = lhs;
     node->v.op2.rhs = rhs;
+    add_type(node);
     return node;
 }
 
@@ -103,15 +117,88 @@ static Node *new_node_for(Node *init, Node *test, Node *update, Node *body) {
     return node;
 }
 
+/* switch 文のノードを作成する */
+static Node *new_node_switch(Node *test, Node *body) {
+    Node *node = calloc(1, sizeof(Node));
+
+    node->kind = ND_SWITCH;
+    node->v.cswitch.test = test;
+    node->v.cswitch.body = body;
+    return node;
+}
+
+/* break のノードを作成する */
+static Node *new_node_break(void) {
+    Node *node = calloc(1, sizeof(Node));
+
+    node->kind = ND_BREAK;
+    return node;
+}
+
+/* case・default のノードを作成する */
+static Node *new_node_case(int val, bool is_default) {
+    Node *node = calloc(1, sizeof(Node));
+
+    node->kind = ND_CASE;
+    node->v.ccase.val = val;
+    node->v.ccase.is_default = is_default;
+    return node;
+}
+
 /* 数値ノードを作成する */
 static Node *new_node_num(int val) {
     Node *node = calloc(1, sizeof(Node));
 
     node->kind = ND_NUM;
     node->v.num.val = val;
+    add_type(node);
     return node;
 }
 
+/* 整数の式をポインタ型 type の指す先の大きさ倍する */
+static Node *scale_index(Node *node, Type *type) {
+    int size = size_of(type->ptr_to);
+    if (node->kind == ND_NUM) {
+        node->v.num.val *= size;
+        return node;
+    }
+    return new_node_op2(ND_MUL, node, new_node_num(size));
+}
+
+/* 加算のノードを作成する。
+   ポインタに整数を足すときは、整数を指す先の大きさ倍する。
+ */
+static Node *new_node_add(Node *lhs, Node *rhs) {
+    if ((is_pointer(lhs->type) == false) && (is_pointer(rhs->type) == true)) {
+        Node *tmp = lhs;
+        lhs = rhs;
+        rhs = tmp;
+    }
+    if (is_pointer(lhs->type) == true) {
+        if (is_pointer(rhs->type) == true) {
+            error("ポインタ同士は足せません。");
+        }
+        rhs = scale_index(rhs, lhs->type);
+    }
+    return new_node_op2(ND_ADD, lhs, rhs);
+}
+
+/* 減算のノードを作成する。
+   ポインタから整数を引くときは、整数を指す先の大きさ倍する。
+   ポインタ同士の差は、バイト数を指す先の大きさで割った要素の数にする。
+ */
+static Node *new_node_sub(Node *lhs, Node *rhs) {
+    if (is_pointer(lhs->type) == true) {
+        if (is_pointer(rhs->type) == true) {
+            Node *diff = new_node_op2(ND_SUB, lhs, rhs);
+            return new_node_op2(
+                ND_DIV, diff, new_node_num(size_of(lhs->type->ptr_to)));
+        }
+        rhs = scale_index(rhs, lhs->type);
+    }
+    return new_node_op2(ND_SUB, lhs, rhs);
+}
+
 /* ブロックノードを作成する */
 static Node *new_node_block(Node *pblock) {
     Node *node = calloc(1, sizeof(Node));
@@ -259,10 +346,45 @@ static Node *var(Node *pblock, const Token *tok) {
     node->kind = ND_LVAR;
     node->v.lvar.name = var->name;
     node->v.lvar.len = var->len;
-    node->v.lvar.offset = var->offset;
+    node->v.lvar.var = var;
+    add_type(node);
     return node;
 }
 
+/* 組み込み関数の呼び出しなら、種類をセットして引数を確かめる */
+static void check_builtin(Node *func) {
+    BuiltinKind kind = find_builtin(func->v.func.name, func->v.func.len);
+    func->v.func.builtin = kind;
+    if (kind == BI_NONE) {
+        return;
+    }
+
+    int min, max;
+    builtin_params(kind, &min, &max);
+    if ((func->v.func.num_param < min) || (func->v.func.num_param > max)) {
+        error_at(func->v.func.name,
+                 "%.*s の引数の数が間違っています。",
+                 func->v.func.len,
+                 func->v.func.name);
+    }
+    // 分岐の予測に使う値と、prefetch の rw・locality は定数に限る
+    for (int i = 1; i < func->v.func.num_param; i++) {
+        if (func->v.func.params[i]->kind != ND_NUM) {
+            error_at(func->v.func.name,
+                     "%.*s の第 %d 引数は定数にしてください。",
+                     func->v.func.len,
+                     func->v.func.name,
+                     i + 1);
+        }
+    }
+    if ((kind == BI_PREFETCH) && (func->v.func.num_param == 3)
+        && ((func->v.func.params[2]->v.num.val < 0)
+            || (func->v.func.params[2]->v.num.val > 3))) {
+        error_at(func->v.func.name,
+                 "__builtin_prefetch の locality は 0～3 にしてください。");
+    }
+}
+
 /* パーサ: term */
 static Node *term(Node *pblock) {
     if (consume("(") == true) {
@@ -285,10 +407,12 @@ static Node *term(Node *pblock) {
                         }
                     }
                 }
-                if (func->v.func.max_param > MAX_PARAM) {
+                if (func->v.func.num_param > MAX_PARAM) {
                     error("パラメータが %d 個以上設定されています。",
                           MAX_PARAM);
                 }
+                check_builtin(func);
+                add_type(func);
                 return func;
             }
             // 変数
@@ -308,7 +432,11 @@ static Node *unary(Node *pblock) {
     } else if (consume("-") == true) {
         return new_node_op2(ND_SUB, new_node_num(0), term(pblock));
     } else if (consume("&") == true) {
-        return new_node_op1(ND_ADDR, unary(pblock));
+        Node *node = new_node_op1(ND_ADDR, unary(pblock));
+        if (node->v.op1.expr->kind == ND_LVAR) {
+            cur_deffunc->v.deffunc.has_escape = true;
+        }
+        return node;
     } else if (consume("*") == true) {
         return new_node_op1(ND_DEREF, unary(pblock));
     } else {
@@ -325,6 +453,8 @@ static Node *mul(Node *pblock) {
             node = new_node_op2(ND_MUL, node, unary(pblock));
         } else if (consume("/") == true) {
             node = new_node_op2(ND_DIV, node, unary(pblock));
+        } else if (consume("%") == true) {
+            node = new_node_op2(ND_MOD, node, unary(pblock));
         } else {
             break;
         }
@@ -338,9 +468,9 @@ static Node *add(Node *pblock) {
 
     while (1) {
         if (consume("+") == true) {
-            node = new_node_op2(ND_ADD, node, mul(pblock));
+            node = new_node_add(node, mul(pblock));
         } else if (consume("-") == true) {
-            node = new_node_op2(ND_SUB, node, mul(pblock));
+            node = new_node_sub(node, mul(pblock));
         } else {
             break;
         }
@@ -442,7 +572,7 @@ static LVar *defvar_lvar(Node *pblock, Type *type) {
             var->name = (char *)tok->str;
             var->len = tok->len;
             var->type = type;
-            var->offset = (block_total_local(pblock) + 1) * 8;
+            var->id = block_total_local(pblock);
             block_add_local(pblock, var);
         } else {
             error_at(tok->str,
@@ -462,6 +592,68 @@ static LVar *defvar(Node *pblock) {
     return defvar_lvar(pblock, type);
 }
 
+/* 本体のブロックに、同じ値の case (is_default なら default) があれば
+   true を返す
+ */
+static bool has_case(Node *body, int val, bool is_default) {
+    for (int i = 0; i < body->v.block.num_code; i++) {
+        Node *node = body->v.block.code[i];
+        if ((node->kind == ND_CASE)
+            && (node->v.ccase.is_default == is_default)
+            && ((is_default == true) || (node->v.ccase.val == val))) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* パーサ: case */
+static Node *case_label(Node *body) {
+    Token *tok = peek();
+    if (consume_with_kind(TK_DEFAULT) != NULL) {
+        if (has_case(body, 0, true) == true) {
+            error_at(tok->str, "default が重複しています。");
+        }
+        expect(":");
+        return new_node_case(0, true);
+    }
+
+    (void)expect_with_kind(TK_CASE);
+    tok = peek();
+    int sign = (consume("-") == true) ? -1 : 1;
+    int val = sign * expect_with_kind(TK_NUM)->num;
+    if (has_case(body, val, false) == true) {
+        error_at(tok->str, "case %d が重複しています。", val);
+    }
+    expect(":");
+    return new_node_case(val, false);
+}
+
+/* switch の本体。case・default はこの直下にだけ書ける */
+static Node *switch_body(Node *pblock) {
+    Node *body = new_node_block(pblock);
+    expect("{");
+    break_depth++;
+    while (consume("}") == false) {
+        TokenKind kind = peek()->kind;
+        if ((kind == TK_CASE) || (kind == TK_DEFAULT)) {
+            block_add_node(body, case_label(body));
+        } else {
+            block_add_node(body, stmt(body));
+        }
+    }
+    break_depth--;
+    return body;
+}
+
+/* ループの本体。中では break でループを抜けられる */
+static Node *loop_body(Node *pblock) {
+    break_depth++;
+    Node *body = stmt(pblock);
+    break_depth--;
+    return body;
+}
+
 /* パーサ: stmt */
 static Node *stmt(Node *pblock) {
     Token *tok = NULL;
@@ -483,7 +675,7 @@ static Node *stmt(Node *pblock) {
         expect("(");
         Node *test = expr(pblock);
         expect(")");
-        node = new_node_while(test, stmt(pblock));
+        node = new_node_while(test, loop_body(pblock));
     } else if (consume_with_kind(TK_FOR) != NULL) {
         Node *init = NULL;
         Node *test = NULL;
@@ -501,7 +693,21 @@ static Node *stmt(Node *pblock) {
             update = expr(pblock);
             expect(")");
         }
-        node = new_node_for(init, test, update, stmt(pblock));
+        node = new_node_for(init, test, update, loop_body(pblock));
+    } else if (consume_with_kind(TK_SWITCH) != NULL) {
+        expect("(");
+        Node *test = expr(pblock);
+        expect(")");
+        node = new_node_switch(test, switch_body(pblock));
+    } else if ((tok = consume_with_kind(TK_BREAK)) != NULL) {
+        if (break_depth == 0) {
+            error_at(tok->str, "break がループ・switch の外にあります。");
+        }
+        node = new_node_break();
+        expect(";");
+    } else if ((peek()->kind == TK_CASE) || (peek()->kind == TK_DEFAULT)) {
+        error_at(peek()->str,
+                 "case・default は switch の本体の直下にしか書けません。");
     } else if (consume("{") == true) {
         Node *block = new_node_block(pblock);
         while (consume("}") == false) {
@@ -521,11 +727,23 @@ static Node *stmt(Node *pblock) {
 
 /* パーサ: deffunc */
 static Node *deffunc(void) {
+    bool is_static = consume_with_kind(TK_STATIC) != NULL;
+
+    InlineAttr inline_attr = INLINE_DEFAULT;
+    if (consume_with_kind(TK_NOINLINE) != NULL) {
+        inline_attr = INLINE_NEVER;
+    } else if (consume_with_kind(TK_ALWAYS_INLINE) != NULL) {
+        inline_attr = INLINE_ALWAYS;
+    }
+
     Type *type = defvar_get_type();
     Token *tok = expect_with_kind(TK_IDENT);
     Node *deffunc = new_node_deffunc(tok);
+    cur_deffunc = deffunc;
 
     deffunc->v.deffunc.rettype = type;
+    deffunc->v.deffunc.inline_attr = inline_attr;
+    deffunc->v.deffunc.is_static = is_static;
 
     Node *block = new_node_block(NULL);
     deffunc->v.deffunc.block = block;
@@ -542,8 +760,10 @@ static Node *deffunc(void) {
             }
         }
     }
-    if (deffunc->v.deffunc.max_param > MAX_PARAM) {
-        error("パラメータが %d 個以上設定されています。", MAX_PARAM);
+    // System V ABI で呼ばれる関数は、引数をレジスタで受け取れる数まで
+    int max_param = (is_static == true) ? MAX_PARAM : MAX_ABI_PARAM;
+    if (deffunc->v.deffunc.num_param > max_param) {
+        error("パラメータが %d 個以上設定されています。", max_param);
     }
 
     // block
@@ -0,0 +1,321 @@
+/* 覗き穴最適化
+
+   関数のコード (命令名とオペランドに分けた行の並び) を先頭から見ていき、
+   連続する数命令 (コメントは飛ばす) がパターンに一致すれば書き換える。
+   書き換えると、1 つ前の命令から始まる並びが新しくパターンに一致する
+   ことがあるので、1 命令戻ってから続ける。
+
+   - mov A, A                   => (削除)
+   - mov A, B; mov B, A         => mov A, B
+   - mov [M], R; mov R2, [M]    => mov [M], R; mov R2, R
+   - push A; pop B              => mov B, A (A と B が同じなら削除)
+                                   -Os では、A が即値なら書き換えない
+   - jmp L; L:                  => L:
+   - cmp R, 0                   => test R, R
+   - add R, 0 / sub R, 0        => (フラグを使わなければ削除)
+   - imul R, R, 1               => (フラグを使わなければ削除)
+   - mov R, 0                   => xor R32, R32 (フラグを使わなければ)
+ */
+#include "9cc.h"
+
+/* 最適化中の関数のコード */
+static Code *code;
+
+/* 書き換えのパターン */
+typedef struct {
+    const char *name;         // パターンの名前
+    const char *op;           // 先頭の命令名。NULL ならジャンプ
+    bool (*rewrite)(int i);   // 行 i から始まる並びを書き換えたら true
+    int count;                // 書き換えた回数
+} Pattern;
+
+/* 行 i の次の、コメントでない行。なければ -1 */
+static int next_line(int i) {
+    for (i++; i < code->num_line; i++) {
+        if (code->lines[i].kind != LN_COMMENT) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* 行 i の前の、コメントでない行。なければ 0 */
+static int prev_line(int i) {
+    for (i--; i > 0; i--) {
+        if (code->lines[i].kind != LN_COMMENT) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* 行 i を削除する */
+static void remove_line(int i) {
+    memmove(&code->lines[i],
+            &code->lines[i + 1],
+            (code->num_line - i - 1) * sizeof(Line));
+    code->num_line--;
+}
+
+/* 行 i が命令 op なら true を返す */
+static bool is_insn(int i, const char *op, int num_operand) {
+    return (i >= 0) && (code->lines[i].kind == LN_INSN)
+           && (strcmp(code->lines[i].op, op) == 0)
+           && (code->lines[i].num_operand == num_operand);
+}
+
+/* 行 i のオペランド n */
+static char *operand(int i, int n) {
+    return code->lines[i].operands[n];
+}
+
+/* 行 i の解析したオペランド n */
+static Opr *opr(int i, int n) {
+    return &code->lines[i].oprs[n];
+}
+
+/* 行 j のオペランド n を、行 i のオペランド m で置き換える */
+static void copy_operand(int j, int n, int i, int m) {
+    code->lines[j].operands[n] = code->lines[i].operands[m];
+    code->lines[j].oprs[n] = code->lines[i].oprs[m];
+}
+
+/* 64 ビットか 32 ビットの汎用レジスタなら true を返す */
+static bool is_reg(Opr *o) {
+    return (o->kind == OPR_REG) && (o->size >= 4);
+}
+
+/* 即値 val なら true を返す */
+static bool is_imm(Opr *o, int64_t val) {
+    return (o->kind == OPR_IMM) && (o->imm == val);
+}
+
+/* o がレジスタ reg そのものか、reg をアドレスに使うメモリなら true を返す */
+static bool uses_reg(Opr *o, int reg) {
+    return ((o->kind == OPR_REG) && (o->reg == reg))
+           || ((o->kind == OPR_MEM) && ((o->base == reg) || (o->index == reg)));
+}
+
+/* 命令名が prefix で始まれば true を返す */
+static bool starts_with(const char *op, const char *prefix) {
+    return strncmp(op, prefix, strlen(prefix)) == 0;
+}
+
+/* 行 i の後で、行 i が書き込むフラグが読まれなければ true を返す。
+   フラグを読まずに書き換える命令か、関数の出口・呼び出しまでに
+   フラグを読む命令がなければよい。ラベルやジャンプがあれば、
+   その先が分からないので false にする。
+ */
+static bool flags_dead(int i) {
+    static const char *writers[] = {"add", "sub", "cmp", "test", "and",
+                                    "or",  "xor", "imul", "neg", "sar",
+                                    "shr", "shl", "idiv", "call"};
+
+    for (i = next_line(i); i >= 0; i = next_line(i)) {
+        Line *line = &code->lines[i];
+        if (line->kind == LN_EXIT) {
+            return true;
+        }
+        if (line->kind != LN_INSN) {
+            return false;
+        }
+        if ((starts_with(line->op, "set") == true)
+            || (starts_with(line->op, "cmov") == true)
+            || (strcmp(line->op, "adc") == 0)
+            || (strcmp(line->op, "sbb") == 0)) {
+            return false;
+        }
+        for (int w = 0; w < (int)(sizeof(writers) / sizeof(writers[0]));
+             w++) {
+            if (strcmp(line->op, writers[w]) == 0) {
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+/* mov A, A => (削除) */
+static bool rewrite_mov_self(int i) {
+    if ((is_insn(i, "mov", 2) == false)
+        || (strcmp(operand(i, 0), operand(i, 1)) != 0)) {
+        return false;
+    }
+    remove_line(i);
+    return true;
+}
+
+/* mov A, B; mov B, A => mov A, B
+   mov rdi, [rdi] のように、A が B のアドレスに使われていれば書き換えない。
+ */
+static bool rewrite_mov_back(int i) {
+    int j = next_line(i);
+    if ((is_insn(i, "mov", 2) == false) || (is_insn(j, "mov", 2) == false)
+        || ((opr(i, 0)->kind == OPR_REG)
+            && (uses_reg(opr(i, 1), opr(i, 0)->reg) == true))
+        || (strcmp(operand(i, 0), operand(j, 1)) != 0)
+        || (strcmp(operand(i, 1), operand(j, 0)) != 0)) {
+        return false;
+    }
+    remove_line(j);
+    return true;
+}
+
+/* mov [M], R; mov R2, [M] => mov [M], R; mov R2, R */
+static bool rewrite_store_load(int i) {
+    int j = next_line(i);
+    if ((is_insn(i, "mov", 2) == false) || (is_insn(j, "mov", 2) == false)
+        || (opr(i, 0)->kind != OPR_MEM) || (opr(i, 1)->kind == OPR_MEM)
+        || (strcmp(operand(i, 0), operand(j, 1)) != 0)) {
+        return false;
+    }
+    copy_operand(j, 1, i, 1);
+    return true;
+}
+
+/* push A; pop B => mov B, A */
+static bool rewrite_push_pop(int i) {
+    int j = next_line(i);
+    if ((is_insn(i, "push", 1) == false) || (is_insn(j, "pop", 1) == false)
+        || ((opr(i, 0)->kind == OPR_MEM) && (opr(j, 0)->kind == OPR_MEM))) {
+        return false;
+    }
+    if (strcmp(operand(i, 0), operand(j, 0)) == 0) {
+        remove_line(j);
+        remove_line(i);
+        return true;
+    }
+    // -Os の push imm8; pop R は mov R, imm32 より短い
+    if ((option.size == true) && (opr(i, 0)->kind == OPR_IMM)) {
+        return false;
+    }
+    Line *line = &code->lines[j];
+    line->op = "mov";
+    copy_operand(j, 1, i, 0);
+    line->num_operand = 2;
+    remove_line(i);
+    return true;
+}
+
+/* jmp L; L: => L: */
+static bool rewrite_jump_next(int i) {
+    Line *jump = &code->lines[i];
+    if ((jump->kind != LN_JMP) && (jump->kind != LN_JCC)) {
+        return false;
+    }
+    for (int j = next_line(i); j >= 0; j = next_line(j)) {
+        Line *line = &code->lines[j];
+        if (line->kind != LN_LABEL) {
+            return false;
+        }
+        if (strcmp(line->label, jump->label) == 0) {
+            remove_line(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* cmp R, 0 => test R, R */
+static bool rewrite_cmp_zero(int i) {
+    if ((is_insn(i, "cmp", 2) == false) || (is_reg(opr(i, 0)) == false)
+        || (is_imm(opr(i, 1), 0) == false)) {
+        return false;
+    }
+    code->lines[i].op = "test";
+    copy_operand(i, 1, i, 0);
+    return true;
+}
+
+/* add R, 0 / sub R, 0 / imul R, R, 1 => (削除) */
+static bool rewrite_identity(int i) {
+    bool add = ((is_insn(i, "add", 2) == true)
+                || (is_insn(i, "sub", 2) == true))
+               && (is_imm(opr(i, 1), 0) == true);
+    bool mul = (is_insn(i, "imul", 3) == true)
+               && (strcmp(operand(i, 0), operand(i, 1)) == 0)
+               && (is_imm(opr(i, 2), 1) == true);
+    if (((add == false) && (mul == false)) || (flags_dead(i) == false)) {
+        return false;
+    }
+    remove_line(i);
+    return true;
+}
+
+/* mov R, 0 => xor R32, R32 */
+static bool rewrite_mov_zero(int i) {
+    if ((is_insn(i, "mov", 2) == false) || (is_reg(opr(i, 0)) == false)
+        || (is_imm(opr(i, 1), 0) == false) || (flags_dead(i) == false)) {
+        return false;
+    }
+    Line *line = &code->lines[i];
+    line->op = "xor";
+    line->oprs[0].size = 4;
+    line->operands[0] = (char *)reg_name(line->oprs[0].reg, 4);
+    copy_operand(i, 1, i, 0);
+    return true;
+}
+
+/* 書き換えのパターン。前から順に試す */
+static Pattern patterns[] = {
+    {"mov-self", "mov", rewrite_mov_self, 0},
+    {"mov-back", "mov", rewrite_mov_back, 0},
+    {"store-load", "mov", rewrite_store_load, 0},
+    {"push-pop", "push", rewrite_push_pop, 0},
+    {"jump-next", NULL, rewrite_jump_next, 0},
+    {"cmp-zero", "cmp", rewrite_cmp_zero, 0},
+    {"identity", "add", rewrite_identity, 0},
+    {"identity", "sub", rewrite_identity, 0},
+    {"identity", "imul", rewrite_identity, 0},
+    {"mov-zero", "mov", rewrite_mov_zero, 0},
+};
+
+#define NUM_PATTERN ((int)(sizeof(patterns) / sizeof(patterns[0])))
+
+/* 行がパターンの先頭の命令に一致すれば true を返す */
+static bool match_first(Pattern *pattern, Line *line) {
+    if (pattern->op == NULL) {
+        return (line->kind == LN_JMP) || (line->kind == LN_JCC);
+    }
+    return (line->kind == LN_INSN) && (line->op[0] == pattern->op[0])
+           && (strcmp(line->op, pattern->op) == 0);
+}
+
+/* 関数のコードに覗き穴最適化を行う */
+void peephole(Code *func_code) {
+    if (option.peephole == false) {
+        return;
+    }
+    code = func_code;
+
+    int i = 0;
+    while (i < code->num_line) {
+        bool rewritten = false;
+        for (int p = 0; p < NUM_PATTERN; p++) {
+            if ((match_first(&patterns[p], &code->lines[i]) == true)
+                && (patterns[p].rewrite(i) == true)) {
+                patterns[p].count++;
+                rewritten = true;
+                break;
+            }
+        }
+        i = (rewritten == true) ? prev_line(i) : i + 1;
+    }
+}
+
+/* パターンごとの書き換えの回数を出力する */
+void print_peephole_stats(FILE *fp) {
+    int total = 0;
+    for (int p = 0; p < NUM_PATTERN; p++) {
+        // 先頭の命令ごとに分けたパターンは、まとめて出力する
+        int count = patterns[p].count;
+        while ((p + 1 < NUM_PATTERN)
+               && (strcmp(patterns[p].name, patterns[p + 1].name) == 0)) {
+            p++;
+            count += patterns[p].count;
+        }
+        fprintf(fp, "peephole: %-12s %d\n", patterns[p].name, count);
+        total += count;
+    }
+    fprintf(fp, "peephole: %-12s %d\n", "total", total);
+}
@@ -0,0 +1,120 @@
+/* ローカル変数のレジスタへの昇格
+
+   アドレスを取られない (& の対象にならない) ローカル変数は、ポインタ経由で
+   読み書きされることがないので、スタック上の領域ではなく呼び出し先保存
+   レジスタに置ける。
+   関数ごとにアドレスを取られる変数を調べ (エスケープ解析)、残りの変数を
+   使用回数の多い順に NUM_VAR_REG 個までレジスタに割り当てる。
+   ループ内での使用は、ループの深さに応じて重みを付けて数える。
+ */
+#include "9cc.h"
+
+/* ループ 1 段あたりの使用回数の重み */
+#define LOOP_WEIGHT (8)
+
+/* ループの重みを付ける最大の深さ */
+#define MAX_LOOP_DEPTH (4)
+
+/* 解析中の関数の変数 (添字は変数の番号) */
+static LVar **vars = NULL;
+
+/* 変数の使用回数 */
+static int *uses = NULL;
+
+/* アドレスを取られた変数 */
+static bool *escapes = NULL;
+
+/* ループの深さに応じた使用回数の重み */
+static int loop_weight(int depth) {
+    int weight = 1;
+    for (int i = 0; (i < depth) && (i < MAX_LOOP_DEPTH); i++) {
+        weight *= LOOP_WEIGHT;
+    }
+    return weight;
+}
+
+static void scan_node(Node *node, void *depth);
+
+/* ループの中の node を、1 段深いループの中として調べる */
+static void scan_loop(Node *node, int depth) {
+    int inner = depth + 1;
+    if (node != NULL) {
+        scan_node(node, &inner);
+    }
+}
+
+/* node 以下の変数の使用回数を数え、アドレスを取られた変数を探す。
+   *depth は node を囲むループの深さ。
+ */
+static void scan_node(Node *node, void *depth) {
+    switch (node->kind) {
+    case ND_LVAR: {
+        int idx = node->v.lvar.var->id;
+        vars[idx] = node->v.lvar.var;
+        uses[idx] += loop_weight(*(int *)depth);
+        break;
+    }
+    case ND_ADDR:
+        if (node->v.op1.expr->kind == ND_LVAR) {
+            escapes[node->v.op1.expr->v.lvar.var->id] = true;
+        }
+        break;
+    case ND_WHILE:
+        scan_loop(node->v.cwhile.test, *(int *)depth);
+        scan_loop(node->v.cwhile.body, *(int *)depth);
+        return;
+    case ND_FOR:
+        // 初期化式はループの前に 1 回だけ実行する
+        if (node->v.cfor.init != NULL) {
+            scan_node(node->v.cfor.init, depth);
+        }
+        scan_loop(node->v.cfor.test, *(int *)depth);
+        scan_loop(node->v.cfor.update, *(int *)depth);
+        scan_loop(node->v.cfor.body, *(int *)depth);
+        return;
+    default:
+        break;
+    }
+    visit_children(node, scan_node, depth);
+}
+
+/* 関数のローカル変数をレジスタに割り当てる */
+static void promote_func(Node *deffunc) {
+    int num_var = deffunc->v.deffunc.block->v.block.total_local;
+    vars = calloc(num_var + 1, sizeof(LVar *));
+    uses = calloc(num_var + 1, sizeof(int));
+    escapes = calloc(num_var + 1, sizeof(bool));
+
+    int depth = 0;
+    scan_node(deffunc->v.deffunc.block, &depth);
+
+    // 使用回数の多い変数から割り当てる
+    int num_reg = 0;
+    while (num_reg < NUM_VAR_REG) {
+        int best = -1;
+        for (int i = 0; i < num_var; i++) {
+            if ((vars[i] != NULL) && (vars[i]->reg == 0)
+                && (escapes[i] == false)
+                && ((best < 0) || (uses[i] > uses[best]))) {
+                best = i;
+            }
+        }
+        if (best < 0) {
+            break;
+        }
+        num_reg++;
+        vars[best]->reg = num_reg;
+    }
+    deffunc->v.deffunc.num_var_reg = num_reg;
+
+    free(vars);
+    free(uses);
+    free(escapes);
+}
+
+/* ローカル変数をレジスタに昇格する */
+void promote_locals(Node *program) {
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        promote_func(program->v.block.code[i]);
+    }
+}
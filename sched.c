@@ -0,0 +1,534 @@
+/* 命令スケジューリング
+
+   コード生成は式の木をたどった順に命令を出すので、ロードの直後にその値を
+   使い、imul・idiv の結果を次の命令ですぐ使う。基本ブロックの中で命令の
+   依存グラフ (DAG) を作り、リストスケジューリングで並べ直して、
+   レイテンシの長い命令の後ろに独立した命令を挟む。
+
+   - 基本ブロックは、ラベル・ジャンプ・関数の出口で区切った命令の並び。
+     call・push・pop や rsp・rbp を書き換える命令、ベクトル命令など、
+     モデルにない命令 (バリア) でも区切り、バリアは動かさない
+   - 依存は、レジスタとフラグの書き込み→読み出し (RAW)・読み出し→
+     書き込み (WAR)・書き込み→書き込み (WAW) と、メモリの依存。
+     rbp・rsp からの同じベースで重ならない領域のアクセスは独立とし、
+     それ以外はストアとほかのアクセスの順を守る
+   - すべての依存の順を守るので、ブロックの出口のレジスタとフラグの値は
+     変わらない (jcc が読むフラグも、最後にフラグを書く命令のまま)
+   - 優先度は、命令から依存グラフの末端までのレイテンシの和の最大
+     (クリティカルパスの長さ)。サイクルごとに発行幅まで、準備のできた
+     命令から優先度の高い順に発行する。同じなら元の順を保つ
+   - レイテンシと発行幅は -mtune=... のモデルで決める
+   - コメントは直後の命令と一緒に動かす
+   - MAX_SCHED_INSN 命令より長いブロックは分けてスケジュールする
+
+   -fsched-stats では、関数ごとに、元の順と並べ直した順で発行したときの
+   見積もりのサイクル数 (ブロックごとの和) を出力する。
+ */
+#include "9cc.h"
+
+/* マイクロアーキテクチャのモデル */
+typedef struct {
+    const char *name;
+    int issue_width;    // 1 サイクルに発行できる命令の数
+    int alu;            // add・lea・mov reg, reg などのレイテンシ
+    int load;           // メモリからの読み出しに加わるレイテンシ
+    int store_forward;  // ストアした値をロードできるまで
+    int imul;
+    int idiv;           // 32 ビットの idiv (64 ビットはこの 1.5 倍)
+    int bitcount;       // popcnt・lzcnt・tzcnt・bsr・bsf
+} Model;
+
+static const Model models[] = {
+    [TUNE_GENERIC] = {"generic", 4, 1, 5, 5, 3, 24, 3},
+    [TUNE_SKYLAKE] = {"skylake", 4, 1, 5, 5, 3, 26, 3},
+    [TUNE_ZNVER3] = {"znver3", 6, 1, 4, 7, 3, 12, 1},
+};
+
+/* 並べ直すブロックの最大の命令数。依存グラフの大きさを抑えるため、
+   長いブロックは分けてスケジュールする
+ */
+#define MAX_SCHED_INSN (128)
+
+/* 資源の番号。0～15 は汎用レジスタ (オペランドのレジスタ番号) */
+#define RES_FLAGS (16)
+
+/* 特別に扱うレジスタの番号 */
+#define REG_RAX (0)
+#define REG_RDX (2)
+#define REG_RSP (4)
+#define REG_RBP (5)
+
+/* メモリのアクセス */
+typedef struct {
+    bool load;   // 読み出すか
+    bool store;  // 書き込むか
+    int base;    // rbp・rsp からの領域ならそのレジスタ。分からなければ -1
+    int disp;    // base からのオフセット
+    int size;    // バイト数
+} MemAccess;
+
+/* 依存グラフのノード (命令 1 つ) */
+typedef struct {
+    int line;         // 命令の行
+    int first;        // 命令と一緒に動かす行 (直前のコメント) の先頭
+    uint32_t uses;    // 読む資源
+    uint32_t defs;    // 書く資源
+    MemAccess mem;
+    int latency;      // 結果が使えるまでのサイクル数
+    int height;       // 依存グラフの末端までのレイテンシの和の最大
+    int succ;         // 後続への辺の succs での先頭
+    int num_succ;     // 後続への辺の数
+    int num_pred;     // まだ発行していない先行ノードの数
+    int ready;        // 発行できる最も早いサイクル
+    bool issued;
+} SchedNode;
+
+/* 依存の辺 */
+typedef struct {
+    int from;
+    int to;
+    int latency;
+} Edge;
+
+/* スケジュール中の関数のコードとモデル */
+static Code *code;
+static const Model *model;
+
+/* ブロックのノードと辺 */
+static SchedNode *nodes = NULL;
+static int num_node = 0;
+static int max_node = 0;
+static Edge *edges = NULL;
+static int num_edge = 0;
+static int max_edge = 0;
+static Edge *succs = NULL;  // 辺を先行ノードごとに並べたもの
+static int max_succ = 0;
+
+/* 関数ごとの見積もり (-fsched-stats) */
+typedef struct {
+    char *name;
+    int before;  // 元の順のサイクル数
+    int after;   // 並べ直した順のサイクル数
+} SchedStat;
+
+static SchedStat *stats = NULL;
+static int num_stat = 0;
+
+/* 資源のビット */
+static uint32_t bit(int res) {
+    return (uint32_t)1 << res;
+}
+
+/* メモリのオペランドのアドレスに使うレジスタを *uses に加え、
+   *mem にアクセスする領域をセットする
+ */
+static void mem_access(Opr *opr, uint32_t *uses, MemAccess *mem) {
+    if (opr->base >= 0) {
+        *uses |= bit(opr->base);
+    }
+    if (opr->index >= 0) {
+        *uses |= bit(opr->index);
+    }
+    mem->size = opr->size;
+    mem->disp = opr->disp;
+    mem->base = -1;
+    if ((opr->index < 0) && (opr->sym == NULL)
+        && ((opr->base == REG_RBP) || (opr->base == REG_RSP))) {
+        mem->base = opr->base;
+    }
+}
+
+/* 命令が読み書きする資源、メモリ、レイテンシを求める。
+   モデルにない命令ならバリアとして false を返す。
+ */
+static bool analyze_insn(Line *line, SchedNode *node) {
+    const char *op = line->op;
+    int num = line->num_operand;
+    uint32_t regs[MAX_OPERAND] = {0};  // オペランドのレジスタ
+    int sizes[MAX_OPERAND] = {0};      // レジスタのバイト数
+    bool is_mem[MAX_OPERAND] = {false};
+    uint32_t addr_uses = 0;
+
+    node->uses = 0;
+    node->defs = 0;
+    node->mem = (MemAccess){false, false, -1, 0, 0};
+
+    for (int i = 0; i < num; i++) {
+        Opr *opr = &line->oprs[i];
+        switch (opr->kind) {
+        case OPR_REG:
+            regs[i] = bit(opr->reg);
+            sizes[i] = opr->size;
+            break;
+        case OPR_MEM:
+            mem_access(opr, &addr_uses, &node->mem);
+            is_mem[i] = true;
+            break;
+        case OPR_IMM:
+            break;
+        default:
+            // ベクトルレジスタやラベル
+            return false;
+        }
+    }
+    node->uses |= addr_uses;
+    if ((num > 0) && (node->mem.size == 0)) {
+        // 大きさの指定がなければ、レジスタのオペランドと同じ
+        for (int i = 0; i < num; i++) {
+            if (sizes[i] > node->mem.size) {
+                node->mem.size = sizes[i];
+            }
+        }
+        if (node->mem.size == 0) {
+            node->mem.size = 8;
+        }
+    }
+
+    // dst (オペランド 0) を書くか、読むか。8・16 ビットのレジスタへの
+    // 書き込みは上位を残すので、読み出しにもなる
+    bool write_dst = true;
+    bool read_dst = true;
+    int latency = model->alu;
+
+    if ((strcmp(op, "mov") == 0) || (strcmp(op, "movsxd") == 0)
+        || (strcmp(op, "movzx") == 0) || (strcmp(op, "movsx") == 0)) {
+        read_dst = false;
+    } else if (strcmp(op, "lea") == 0) {
+        // アドレスを計算するだけで、メモリは読まない
+        read_dst = false;
+        is_mem[1] = false;
+    } else if ((strcmp(op, "add") == 0) || (strcmp(op, "sub") == 0)
+               || (strcmp(op, "and") == 0) || (strcmp(op, "or") == 0)
+               || (strcmp(op, "xor") == 0)) {
+        node->defs |= bit(RES_FLAGS);
+        if (((strcmp(op, "xor") == 0) || (strcmp(op, "sub") == 0))
+            && (strcmp(line->operands[0], line->operands[1]) == 0)) {
+            // xor r, r は前の値に依存しない
+            read_dst = false;
+            regs[1] = 0;
+        }
+    } else if ((strcmp(op, "cmp") == 0) || (strcmp(op, "test") == 0)) {
+        write_dst = false;
+        node->defs |= bit(RES_FLAGS);
+    } else if ((strcmp(op, "imul") == 0) && (num == 1)) {
+        // edx:eax = eax * オペランド
+        write_dst = false;
+        node->uses |= bit(REG_RAX);
+        node->defs |= bit(REG_RAX) | bit(REG_RDX) | bit(RES_FLAGS);
+        latency = model->imul + 1;
+    } else if (strcmp(op, "imul") == 0) {
+        node->defs |= bit(RES_FLAGS);
+        read_dst = (num == 2);
+        latency = model->imul;
+    } else if ((strcmp(op, "neg") == 0) || (strcmp(op, "sar") == 0)
+               || (strcmp(op, "shr") == 0) || (strcmp(op, "shl") == 0)) {
+        node->defs |= bit(RES_FLAGS);
+    } else if (strcmp(op, "bswap") == 0) {
+        // dst を読んで書く
+    } else if ((strcmp(op, "popcnt") == 0) || (strcmp(op, "lzcnt") == 0)
+               || (strcmp(op, "tzcnt") == 0)) {
+        node->defs |= bit(RES_FLAGS);
+        read_dst = false;
+        latency = model->bitcount;
+    } else if ((strcmp(op, "bsr") == 0) || (strcmp(op, "bsf") == 0)) {
+        // 入力が 0 なら dst は変わらない
+        node->defs |= bit(RES_FLAGS);
+        latency = model->bitcount;
+    } else if (strncmp(op, "set", 3) == 0) {
+        node->uses |= bit(RES_FLAGS);
+    } else if (strncmp(op, "cmov", 4) == 0) {
+        node->uses |= bit(RES_FLAGS);
+    } else if ((strcmp(op, "cdq") == 0) || (strcmp(op, "cqo") == 0)) {
+        node->uses |= bit(REG_RAX);
+        node->defs |= bit(REG_RDX);
+    } else if (strcmp(op, "idiv") == 0) {
+        write_dst = false;
+        node->uses |= bit(REG_RAX) | bit(REG_RDX);
+        node->defs |= bit(REG_RAX) | bit(REG_RDX) | bit(RES_FLAGS);
+        latency = (sizes[0] == 8) ? model->idiv * 3 / 2 : model->idiv;
+    } else {
+        return false;
+    }
+
+    // オペランドの読み書き
+    for (int i = 0; i < num; i++) {
+        if (i == 0) {
+            if ((write_dst == true) && (is_mem[0] == false)) {
+                node->defs |= regs[0];
+                if (sizes[0] < 4) {
+                    node->uses |= regs[0];
+                }
+            }
+            if (read_dst == true) {
+                node->uses |= regs[0];
+            }
+        } else {
+            node->uses |= regs[i];
+        }
+        if (is_mem[i] == true) {
+            bool store = (i == 0) && (write_dst == true);
+            node->mem.store |= store;
+            node->mem.load |= (store == false) || (read_dst == true);
+        }
+    }
+
+    // rsp・rbp を書き換えると、それを基準にした領域の意味が変わる
+    if ((node->defs & (bit(REG_RSP) | bit(REG_RBP))) != 0) {
+        return false;
+    }
+    if (node->mem.load == true) {
+        latency += model->load;
+    }
+    node->latency = latency;
+    return true;
+}
+
+/* 2 つのメモリのアクセスの順を守る必要があれば true を返す */
+static bool mem_conflict(MemAccess *a, MemAccess *b) {
+    if (((a->load == false) && (a->store == false))
+        || ((b->load == false) && (b->store == false))) {
+        return false;
+    }
+    if ((a->store == false) && (b->store == false)) {
+        return false;
+    }
+    if ((a->base >= 0) && (a->base == b->base)) {
+        // 同じベースからの重ならない領域なら独立
+        return (a->disp < b->disp + b->size) && (b->disp < a->disp + a->size);
+    }
+    return true;
+}
+
+/* 辺を追加する */
+static void add_edge(int from, int to, int latency) {
+    if (num_edge == max_edge) {
+        max_edge = (max_edge == 0) ? 64 : max_edge * 2;
+        edges = realloc(edges, max_edge * sizeof(Edge));
+    }
+    edges[num_edge] = (Edge){from, to, latency};
+    num_edge++;
+    nodes[from].num_succ++;
+}
+
+/* ブロックのノードの依存グラフを作る。
+   辺は後続のノードの順に追加されるので、最後に先行ノードごとにまとめる。
+ */
+static void build_dag(void) {
+    num_edge = 0;
+    for (int i = 0; i < num_node; i++) {
+        nodes[i].num_succ = 0;
+    }
+    for (int j = 0; j < num_node; j++) {
+        SchedNode *b = &nodes[j];
+        for (int i = 0; i < j; i++) {
+            SchedNode *a = &nodes[i];
+            int latency = -1;
+            if ((a->defs & b->uses) != 0) {
+                latency = a->latency;  // RAW
+            } else if (((a->uses & b->defs) != 0)
+                       || ((a->defs & b->defs) != 0)) {
+                latency = 0;  // WAR・WAW
+            }
+            if (mem_conflict(&a->mem, &b->mem) == true) {
+                int mem_latency = ((a->mem.store == true)
+                                   && (b->mem.load == true))
+                                      ? model->store_forward
+                                      : 0;
+                if (mem_latency > latency) {
+                    latency = mem_latency;
+                }
+            }
+            if (latency >= 0) {
+                add_edge(i, j, latency);
+            }
+        }
+    }
+
+    // 先行ノードごとに後続の辺を succs に並べる
+    if (num_edge > max_succ) {
+        max_succ = num_edge;
+        succs = realloc(succs, max_succ * sizeof(Edge));
+    }
+    int pos = 0;
+    for (int i = 0; i < num_node; i++) {
+        nodes[i].succ = pos;
+        pos += nodes[i].num_succ;
+        nodes[i].num_succ = 0;
+    }
+    for (int e = 0; e < num_edge; e++) {
+        SchedNode *from = &nodes[edges[e].from];
+        succs[from->succ + from->num_succ] = edges[e];
+        from->num_succ++;
+    }
+
+    // 末端から優先度 (クリティカルパスの長さ) を求める
+    for (int i = num_node - 1; i >= 0; i--) {
+        SchedNode *node = &nodes[i];
+        node->height = node->latency;
+        for (int e = node->succ; e < node->succ + node->num_succ; e++) {
+            int height = succs[e].latency + nodes[succs[e].to].height;
+            if (height > node->height) {
+                node->height = height;
+            }
+        }
+    }
+}
+
+/* 発行したノードの後続の準備を進める */
+static void issue(int n, int cycle) {
+    SchedNode *node = &nodes[n];
+    node->issued = true;
+    for (int e = node->succ; e < node->succ + node->num_succ; e++) {
+        SchedNode *to = &nodes[succs[e].to];
+        to->num_pred--;
+        if (cycle + succs[e].latency > to->ready) {
+            to->ready = cycle + succs[e].latency;
+        }
+    }
+}
+
+/* ノードを発行する。in_order なら元の順のまま発行する。
+   発行した順を order に入れ、最後の結果が出るまでのサイクル数を返す。
+ */
+static int simulate(bool in_order, int *order) {
+    for (int i = 0; i < num_node; i++) {
+        nodes[i].num_pred = 0;
+        nodes[i].ready = 0;
+        nodes[i].issued = false;
+    }
+    for (int e = 0; e < num_edge; e++) {
+        nodes[edges[e].to].num_pred++;
+    }
+
+    int cycle = 0;
+    int width = 0;  // このサイクルに発行した数
+    int finish = 0;
+    for (int k = 0; k < num_node;) {
+        int best = -1;
+        for (int i = 0; i < num_node; i++) {
+            SchedNode *node = &nodes[i];
+            if ((node->issued == true) || (node->num_pred > 0)) {
+                continue;
+            }
+            if (in_order == true) {
+                best = i;
+                break;
+            }
+            if ((node->ready <= cycle)
+                && ((best < 0) || (node->height > nodes[best].height))) {
+                best = i;
+            }
+        }
+        if ((best < 0) || (nodes[best].ready > cycle)
+            || (width == model->issue_width)) {
+            cycle++;
+            width = 0;
+            continue;
+        }
+        issue(best, cycle);
+        order[k] = best;
+        k++;
+        width++;
+        if (cycle + nodes[best].latency > finish) {
+            finish = cycle + nodes[best].latency;
+        }
+    }
+    return finish;
+}
+
+/* 集めたノード (行 begin から end の手前まで) を並べ直す */
+static void schedule_block(int begin, int end, int *before, int *after) {
+    if (num_node < 2) {
+        return;
+    }
+
+    build_dag();
+    int *order = calloc(num_node, sizeof(int));
+    *before += simulate(true, order);
+    *after += simulate(false, order);
+
+    // 並べ直した順に、コメントと命令の行をコピーする
+    Line *lines = malloc((end - begin) * sizeof(Line));
+    int n = 0;
+    for (int k = 0; k < num_node; k++) {
+        SchedNode *node = &nodes[order[k]];
+        for (int i = node->first; i <= node->line; i++) {
+            lines[n] = code->lines[i];
+            n++;
+        }
+    }
+    // 末尾のコメントは末尾のまま
+    for (int i = nodes[num_node - 1].line + 1; i < end; i++) {
+        lines[n] = code->lines[i];
+        n++;
+    }
+    memcpy(&code->lines[begin], lines, n * sizeof(Line));
+    free(lines);
+    free(order);
+}
+
+/* 関数のコードの基本ブロックごとに命令を並べ直す */
+void schedule_insns(Code *func_code, const char *name, int len) {
+    code = func_code;
+    model = &models[option.tune];
+
+    int before = 0;
+    int after = 0;
+    int begin = 0;  // 集めているブロックの先頭の行
+    num_node = 0;
+    for (int i = 0; i < code->num_line; i++) {
+        Line *line = &code->lines[i];
+        if (line->kind == LN_COMMENT) {
+            continue;
+        }
+        if (num_node == MAX_SCHED_INSN) {
+            int end = nodes[num_node - 1].line + 1;
+            schedule_block(begin, end, &before, &after);
+            begin = end;
+            num_node = 0;
+        }
+        if (num_node == max_node) {
+            max_node = (max_node == 0) ? 64 : max_node * 2;
+            nodes = realloc(nodes, max_node * sizeof(SchedNode));
+        }
+        SchedNode *node = &nodes[num_node];
+        if ((line->kind == LN_INSN) && (analyze_insn(line, node) == true)) {
+            node->line = i;
+            node->first = (num_node == 0) ? begin
+                                          : nodes[num_node - 1].line + 1;
+            num_node++;
+            continue;
+        }
+        // ラベル・ジャンプ・バリアでブロックを区切る
+        schedule_block(begin, i, &before, &after);
+        begin = i + 1;
+        num_node = 0;
+    }
+    schedule_block(begin, code->num_line, &before, &after);
+
+    if (option.sched_stats == true) {
+        stats = realloc(stats, (num_stat + 1) * sizeof(SchedStat));
+        stats[num_stat].name = calloc(len + 1, 1);
+        memcpy(stats[num_stat].name, name, len);
+        stats[num_stat].before = before;
+        stats[num_stat].after = after;
+        num_stat++;
+    }
+}
+
+/* 関数ごとの見積もりのサイクル数を出力する */
+void print_sched_stats(FILE *fp) {
+    int before = 0;
+    int after = 0;
+    for (int i = 0; i < num_stat; i++) {
+        fprintf(fp,
+                "sched: %6d => %6d cycles %s\n",
+                stats[i].before,
+                stats[i].after,
+                stats[i].name);
+        before += stats[i].before;
+        after += stats[i].after;
+    }
+    fprintf(fp, "sched: %6d => %6d cycles total (-mtune=%s)\n",
+            before, after, models[option.tune].name);
+}
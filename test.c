@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 
 int func0(void) {
     printf("func0\n");
@@ -39,4 +40,22 @@ int func6(int p1, int p2, int p3, int p4, int p5, int p6) {
            p5,
            p6);
     return p1 + p2 + p3 + p4 + p5 + p6;
-}
\ No newline at end of file
+}
+
+/* 要素 k が start + k の配列を確保する */
+int *alloc_seq(int n, int start) {
+    int *a = malloc(n * sizeof(int));
+    for (int k = 0; k < n; k++) {
+        a[k] = start + k;
+    }
+    return a;
+}
+
+/* 配列の要素の合計 */
+int sum_array(int *a, int n) {
+    int s = 0;
+    for (int k = 0; k < n; k++) {
+        s += a[k];
+    }
+    return s;
+}
@@ -1,23 +1,187 @@
 #!/bin/bash
 
+# 末尾呼び出しのテストで、再帰が深いとスタックが溢れることを確認するため
+ulimit -s 8192
+
+# RUN=1 ./test.sh なら、try のプログラムを --run でその場で実行する
 try() {
     expected="$1"
     input="$2"
+    options="$3"
+
+    if [ -n "$RUN" ]; then
+        ./9cc --run --run-lib=./libtest.so $options "$input"
+        actual="$?"
+    else
+        gcc -c test.c
+        ./9cc $options "$input" > app.s
+        gcc -o app app.s test.o
+        ./app
+        actual="$?"
+    fi
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$options $input => $actual"
+    else
+        echo "$options $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# 各プログラムを -flto で中間表現モジュールにしてから、結合してコンパイルする
+try_lto() {
+    expected="$1"
+    shift
 
     gcc -c test.c
-    ./9cc "$input" > app.s
+    modules=()
+    for input in "$@"; do
+        module="app${#modules[@]}.lto"
+        ./9cc -flto "$input" > "$module" || exit 1
+        modules+=("$module")
+    done
+    ./9cc "${modules[@]}" > app.s
     gcc -o app app.s test.o
     ./app
     actual="$?"
 
     if [ "$actual" = "$expected" ]; then
-        echo "$input => $actual"
+        echo "-flto $* => $actual"
+    else
+        echo "-flto $* => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# -c でオブジェクトファイルを出力して実行し、.text・.rodata と再配置が
+# as でアセンブルしたものと同じことを確認する
+try_obj() {
+    expected="$1"
+    input="$2"
+    options="$3"
+
+    gcc -c test.c
+    ./9cc $options "$input" > app.s
+    as -o app_as.o app.s || exit 1
+    ./9cc -c $options "$input" > app.o || exit 1
+    objcopy -O binary -j .text app_as.o app_as.bin
+    objcopy -O binary -j .text app.o app.bin
+    objcopy -O binary -j .rodata app_as.o app_as_rodata.bin
+    objcopy -O binary -j .rodata app.o app_rodata.bin
+    relocs_as=$(readelf -rW app_as.o | awk '/R_X86/ { print $1, $3, $5, $7 }' | sort)
+    relocs=$(readelf -rW app.o | awk '/R_X86/ { print $1, $3, $5, $7 }' | sort)
+    if ! cmp -s app_as.bin app.bin || ! cmp -s app_as_rodata.bin app_rodata.bin \
+        || [ "$relocs_as" != "$relocs" ]; then
+        echo "-c $options $input => object differs from as"
+        exit 1
+    fi
+    gcc -o app app.o test.o
+    ./app
+    actual="$?"
+
+    if [ "$actual" = "$expected" ]; then
+        echo "-c $options $input => $actual"
     else
-        echo "$input => $expected expected, but got $actual"
+        echo "-c $options $input => $expected expected, but got $actual"
         exit 1
     fi
 }
 
+# main のないプログラムをコンパイルし、C のドライバ (main) からその関数を
+# System V ABI で呼び出して実行する
+try_abi() {
+    expected="$1"
+    input="$2"
+    driver="$3"
+    options="$4"
+
+    ./9cc $options "$input" > app.s || exit 1
+    echo "$driver" | gcc -o app app.s -x c -
+    ./app
+    actual="$?"
+
+    if [ "$actual" = "$expected" ]; then
+        echo "$options $input <= $driver => $actual"
+    else
+        echo "$options $input <= $driver => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# -fsize-report の合計が、as でアセンブルした .text のバイト数と同じことを
+# 確認する
+try_size() {
+    input="$1"
+    options="$2"
+
+    ./9cc -fsize-report $options "$input" > app.s 2> app_size.txt || exit 1
+    as -o app_as.o app.s || exit 1
+    expected=$(size -A app_as.o | awk '$1 == ".text" { print $2 }')
+    actual=$(awk '$3 == "total" { print $2 }' app_size.txt)
+
+    if [ "$actual" = "$expected" ]; then
+        echo "-fsize-report $options $input => $actual"
+    else
+        echo "-fsize-report $options $input => $expected expected, but got $actual"
+        exit 1
+    fi
+}
+
+# -fsched-stats の見積もりで、命令スケジューリングによってサイクル数が
+# 減ることを確認する。llvm-mca があれば、-mcpu=$3 での見積もりが
+# 増えないことも確認する
+try_sched() {
+    input="$1"
+    options="$2"
+    mcpu="$3"
+
+    ./9cc -fsched-stats $options "$input" > app.s 2> app_sched.txt || exit 1
+    before=$(awk '$6 == "total" { print $2 }' app_sched.txt)
+    after=$(awk '$6 == "total" { print $4 }' app_sched.txt)
+    if [ "$after" -ge "$before" ]; then
+        echo "-fsched-stats $options $input => $before => $after cycles, expected fewer"
+        exit 1
+    fi
+
+    if command -v llvm-mca > /dev/null; then
+        ./9cc -fno-schedule-insns $options "$input" > app_unsched.s || exit 1
+        mca_before=$(llvm-mca -mcpu=$mcpu app_unsched.s 2> /dev/null | awk '/Total Cycles/ { print $3 }')
+        mca_after=$(llvm-mca -mcpu=$mcpu app.s 2> /dev/null | awk '/Total Cycles/ { print $3 }')
+        if [ "$mca_after" -gt "$mca_before" ]; then
+            echo "-fsched-stats $options $input => llvm-mca $mca_before => $mca_after cycles, expected no more"
+            exit 1
+        fi
+        before="$before (llvm-mca $mca_before)"
+        after="$after (llvm-mca $mca_after)"
+    fi
+    echo "-fsched-stats $options $input => $before => $after cycles"
+}
+
+# --run でその場で実行した結果と、リンクして実行した結果を比べる
+try_run() {
+    expected="$1"
+    input="$2"
+    options="$3"
+
+    gcc -c test.c
+    ./9cc $options "$input" > app.s
+    gcc -o app app.s test.o
+    ./app > /dev/null
+    linked="$?"
+    ./9cc --run --run-lib=./libtest.so $options "$input"
+    actual="$?"
+
+    if [ "$actual" = "$expected" ] && [ "$linked" = "$expected" ]; then
+        echo "--run $options $input => $actual"
+    else
+        echo "--run $options $input => $expected expected, but got $actual (linked: $linked)"
+        exit 1
+    fi
+}
+
+# --run のプログラムは test.c の関数を共有ライブラリから呼ぶ
+gcc -shared -fPIC -o libtest.so test.c || exit 1
+
 try 0 "int main(){ return 0; }"
 try 42 "int main(){ return 42; }"
 try 21 "int main(){ return 5+20-4; }"
@@ -133,7 +297,151 @@ try 34 "int fib(int n){ if(n==0){return 0;} if(n==1){return 1;} return fib(n-1)
 try 55 "int fib(int n){ if(n==0){return 0;} if(n==1){return 1;} return fib(n-1) + fib(n-2); } int main(){ fib(10); }"
 try 0 "int func_a(){ func0(); } int main(){ func_a(); return 0; }"
 try 10 "int f(){ return func1(1); } int main(){int a; int i; a=0; for(i=0;i<10;i=i+1){ a=a+f(); func1(a); } return a;}"
-try 123 "int main(){ int x; int y; int z; x=123; y=&x; z=func1(*y); return z; }"
+try 123 "int main(){ int x; int *y; int z; x=123; y=&x; z=func1(*y); return z; }"
 try 123 "int main(){ int x; int *y; y=&x; *y=123; return x; }"
+try 7 "int add(int a, int b){ return a+b; } int main(){ return add(3, 4); }"
+try 7 "int add(int a, int b){ return a+b; } int main(){ return add(3, 4); }" -finline-limit=0
+try 12 "int sq(int x){ int y; y=x*x; return y; } int main(){ int y; y=2; return sq(y+1)+y+1; }"
+try 5 "int max(int a, int b){ if(a<b) return b; return a; } int main(){ return max(5,2)*max(0,1); }"
+try 35 "int f(int n){ int s; int i; s=0; for(i=0;i<n;i=i+1){ if(i==5) return s; s=s+i*i; } return s; } int main(){ return f(5)+f(3)+f(10)-f(5); }"
+try 22 "int g(int x){ return x*2; } int f(int x){ return g(x)+g(x+1); } int main(){ return f(5); }"
+try 6 "int g(int x){ return x*2; } int f(int x){ return g(x)+g(x+1); } int main(){ return f(1)+0*f(2); }" -finline-limit=1
+try 55 "int fib(int n){ if(n<2) return n; return fib(n-1)+fib(n-2); } int f(int n){ return fib(n); } int main(){ return f(10); }"
+try 10 "noinline int f(int x){ return func1(x); } int main(){ return f(10); }"
+try 10 "always_inline int f(int x){ int a; int b; int c; a=x; b=a; c=b; return func1(c); } int main(){ return f(10); }" -finline-limit=0
+try 3 "int f(int *p){ *p = *p + 1; return 0; } int main(){ int x; x=1; f(&x); f(&x); return x; }"
+try 1 "int f(){ if (0) {} return 1; } int main(){ return f(); }"
+try 55 "int sum(int n, int acc){ if(n==0) return acc; return sum(n-1, acc+n); } int main(){ return sum(10, 0); }"
+try 32 "int sum(int n, int acc){ if(n==0) return acc; return sum(n-1, acc+n); } int main(){ return sum(1000000, 0); }"
+try 1 "int even(int n){ if(n==0) return 1; return odd(n-1); } int odd(int n){ if(n==0) return 0; return even(n-1); } int main(){ return even(1000000); }"
+try 120 "int fact(int n, int acc){ int t; t=acc*n; if(n<=1) return acc; return fact(n-1, t); } int main(){ return fact(5, 1); }"
+try 10 "int f(int x){ return func1(x); } int main(){ return f(10)+0*f(1); }" -finline-limit=0
+try 21 "int f(int a, int b, int c, int d, int e, int g){ if(a==0) return func6(a+1,b,c,d,e,g); return f(a-1,b,c,d,e,g); } int main(){ return f(1000000,2,3,4,5,6); }"
+try 41 "int g(int *p){ return *p; } int f(){ int x; x=41; return g(&x); } int main(){ return f(); }" -finline-limit=0
+try 3 "static int f(int x){ return x+1; } int main(){ return f(2); }"
+try 3 "static int unused(){ return no_such_func(); } int main(){ return 3; }"
+try 4 "int main(){ if (0) no_such_func(); while (0) no_such_func(); for (;0;) no_such_func(); return 4; }"
+try 5 "int main(){ return 5; no_such_func(); }"
+try 6 "int main(){ if (1) { return 6; no_such_func(); } else { return no_such_func(); } }"
+try 1 "int main(){ int x; x = func1(3); return 1; }"
+try 2 "int main(){ int x; x = 1; x = 2; return x; }"
+try 45 "int main(){ int i; int s; int t; s = 0; i = 0; while (i < 10) { t = s; s = s + i; i = i + 1; } return s; }"
+try 7 "int main(){ int x; int *p; x = 1; p = &x; *p = 7; return x; }"
+try 9 "int main(){ int x; x = 9; x + 1; func0(); x; }"
+try 3 "int main(){ int a; int b; a = 1; b = a + 2; b; }"
+try 3 "int main(){ 1 + 2; }" -fno-dce
+try 55 "int fib(int n){ if(n<2) return n; return fib(n-1)+fib(n-2); } int main(){ return fib(10); }" -fno-ipa
+try 89 "int fib(int n){ if(n<2) return n; return fib(n-1)+fib(n-2); } int main(){ if (fib(11) == 89) return 89; return no_such_func(); }"
+try 30 "static int scale(int x, int k){ return x * k; } int main(){ return scale(func1(5), 3) + scale(func1(5), 3); }"
+try 12 "static int mode(int m){ if (m == 1) return 12; return no_such_func(); } int main(){ return mode(1) + 0 * mode(1); }" -finline-limit=0
+try 6 "int sum(int n){ int s; int i; s=0; for(i=1;i<=n;i=i+1) s=s+i; return s; } int main(){ return sum(3); }"
+try 2 "int get(int *p){ return *p; } int main(){ int x; x = 2; return get(&x); }"
+try 4 "int pure(int x){ return x + 1; } int main(){ int a; a = func1(3); pure(a); return pure(a); }"
+try 7 "int f(int x){ if (x) return 7; } int main(){ return f(1); }"
+try 3 "int main(){ 1 + 2; }"
+try 36 "int main(){ int a; int b; int c; int d; int e; int f; int g; int h; a=1; b=2; c=3; d=4; e=5; f=6; g=7; h=8; return a+b+c+d+e+f+g+h; }"
+try 42 "int main(){ int a; int b; int *p; a=1; b=2; p=&a; *p=40; return a+b; }"
+try 15 "int main(){ int a; int b; int c; int d; int e; int f; a=1; b=2; c=3; d=4; e=5; func0(); f=func5(a,b,c,d,e); return f; }"
+try 100 "int main(){ int i; int j; int s; s=0; for(i=0;i<10;i=i+1) for(j=0;j<10;j=j+1) s=s+1; return s; }"
+try 6 "int f(int a, int b, int c){ int *x; x = &a; return *x + b + c; } int main(){ return f(1, 2, 3); }" -fno-ipa
+try 1 "int main(){ return 7 % 3; }"
+try 3 "int main(){ int x; x = func1(100); return (x / 7 == 14) + (x % 7 == 2) + (x / 16 == 6); }"
+try 4 "int main(){ int x; x = 0-func1(100); return (x / 7 == 0-14) + (x % 7 == 0-2) + (x / 16 == 0-6) + (x % 16 == 0-4); }"
+try 3 "int main(){ int x; x = 0-func1(9); return (x / (0-4) == 2) + (x % (0-4) == 0-1) + (x / (0-3) == 3); }"
+try 2 "int main(){ int x; x = func1(123456789); return (x / 1000 == 123456) + (x % 1000 == 789); }"
+try 10 "int main(){ int i; i = 0; while (1) { i = i + 1; if (i == 10) return i; } }"
+try 10 "int main(){ int i; for (i = 0; ; i = i + 1) if (i == 10) return i; }"
+try 5 "int main(){ int x; x = func1(5); if (x == 5) x; }"
+try 0 "int main(){ int x; x = func1(5); if (x == 4) 9; }"
+try 100 "int main(){ int i; int j; int s; s=0; for(i=0;i<10;i=i+1) for(j=0;j<10;j=j+1) s=s+1; return s; }" -fno-layout
+try 27 "int f(int x){ if (x < 10) { if (x < 5) return 1; return 2; } else if (x < 20) return 3; return 4; } int main(){ int i; int s; s = 0; i = 0; while (i < 30) { s = s + f(i); i = i + 3; } return s; }"
+try 1 "int main(){ int *a; int *b; int *d; int i; int n; int k; n = 11; k = 3; a = alloc_seq(11, 1); b = alloc_seq(11, 100); d = alloc_seq(11, 0); for (i = 0; i < n; i = i + 1) *(d + i) = *(a + i) + *(b + i) - k; return sum_array(d, 11) == 1188; }"
+try 1 "int main(){ int *a; int *b; int *d; int i; int n; int k; n = 11; k = 3; a = alloc_seq(11, 1); b = alloc_seq(11, 100); d = alloc_seq(11, 0); for (i = 0; i < n; i = i + 1) *(d + i) = *(a + i) + *(b + i) - k; return sum_array(d, 11) == 1188; }" -march=x86-64-v3
+try 1 "int main(){ int *a; int *d; int i; a = alloc_seq(11, 1); d = a + 1; for (i = 0; i < 10; i = i + 1) *(d + i) = *(a + i) + *(a + i); return *(a + 10) == 1024; }"
+try 1 "int main(){ int *a; int *d; int i; a = alloc_seq(11, 1); d = a + 1; for (i = 0; i < 10; i = i + 1) *(d + i) = *(a + i) + *(a + i); return *(a + 10) == 1024; }" -march=x86-64-v3
+try 1 "int main(){ int *a; int i; int n; a = alloc_seq(9, 0); n = 9; for (i = 0; i < n; i = i + 1) { *(a + i) = 5 - *(i + a); } return sum_array(a, 9) == 9; }"
+try 1 "int main(){ int *d; int i; int k; k = 2; d = alloc_seq(7, 0); for (i = 1; i < 7; i = i + 1) *(d + i) = k * 3 + 1; return sum_array(d, 7) == 42; }" -march=x86-64-v3
+try 1 "int main(){ int *a; int *b; int i; a = alloc_seq(5, 1); b = alloc_seq(5, 1); for (i = 0; i < 5; i = i + 1) *(b + i) = *(a + i) + 1; return sum_array(b, 5) == 20; }" -fno-vectorize
+try 60 "int f(int a, int b, int c, int d, int e, int g){ return a + b + c + d + e + g; } int main(){ int x; int y; x = 3; y = 2; return f(1, 2, 3, 4, 5, ((x + y) * (x - y)) * ((x + 1) * (y + 1)) - 15); }" -finline-limit=0
+try 4 "int main(){ int a; a = 5; return func2(1, func1(a - 2)) + func3(1, 2, func1(a - 2)) - a - 1; }"
+try 15 "int main(){ int a; int r; a = 3; r = 0; if (a == 3) r = r + 1; if (a != 3) r = r + 100; if (a < 4) r = r + 2; if (a <= 2) r = r + 100; if (4 <= a) r = r + 100; if (a <= 3) r = r + 4; if (a < 3) r = r + 100; else r = r + 8; return r; }"
+try 110 "int main(){ int *a; int *b; int i; int s; a = alloc_seq(11, 1); b = alloc_seq(11, 0); s = 0; for (i = 0; i < 10; i = i + 1) { *(b + i) = *(a + i + 1) + 1; s = s + *(b + i) - *(2 + a - 1) + *(a + (i + 1) - 1); } return s; }"
+try 13 "int main(){ int *a; int **p; int i; a = alloc_seq(4, 1); p = &a; i = 2; *(*p + i + 1) = 8; return *(a + 3) + *(*p + i - 1) + *(a + (i - 1) + 1); }"
+try 14 "int sq(int x){ int y; int *p; p = &y; *p = x * x; return y + 0 * sq2(x); } int sq2(int x){ return x; } int leaf(int a, int b){ int c; int *q; c = a - b; q = &c; return *q * 2; } int main(){ return sq(3) + leaf(5, 3) + 1; }" "-fomit-frame-pointer -finline-limit=0"
+try 2 "int get(int *p){ return *p; } int main(){ int x; x = 2; return get(&x); }" "-fomit-frame-pointer -finline-limit=0"
+try 8 "int main(){ int s; s = 0; { int a; int *p; p = &a; a = 1; s = s + *p; } { int b; int *q; q = &b; b = 2; s = s + *q; } if (s == 3) { int c; int *r; r = &c; c = 4; s = s + *r; } else { int d; int *t; t = &d; d = 100; s = s + *t; } for (s = s; s < 8; s = s + 1) { int e; int *u; u = &e; e = s; s = *u; } return s; }"
+try 80 "int f(int x){ int y; int *p; p = &y; *p = x * 2; return y + 1; } int main(){ int s; s = f(1) + f(2) + f(3) + f(4) + f(5) + f(6) + f(7) + f(8); return s; }"
+try 80 "int f(int x){ int y; int *p; p = &y; *p = x * 2; return y + 1; } int main(){ int s; s = f(1) + f(2) + f(3) + f(4) + f(5) + f(6) + f(7) + f(8); return s; }" -fno-stack-reuse
+try 35 "int f(int a, int b){ return a * 10 + b; } int main(){ int x; x = 2; return f(x, f(x + 1, 4) - f(3, x)) + (x + f(1, 1)) * (f(0, 3) - x); }" -finline-limit=0
+try 6 "int main(){ int a; a = 2; if (a == 2) { a = a * 3; } return a; }" -fverbose-asm
+try 28 "int f(int a, int b){ int c; int *p; c = a; p = &c; *p = *p + b; a = c; c = a; return c * 1 + 0; } int main(){ int i; int s; s = 0; for (i = 0; i < 8; i = i + 1) { s = f(s, i) % 1000; if (s == 0) s = 0; } return s; }" -finline-limit=0
+try 28 "int f(int a, int b){ int c; int *p; c = a; p = &c; *p = *p + b; a = c; c = a; return c * 1 + 0; } int main(){ int i; int s; s = 0; for (i = 0; i < 8; i = i + 1) { s = f(s, i) % 1000; if (s == 0) s = 0; } return s; }" -fno-peephole
+try 1 "int main(){ int x; x = 2147483647; x = x + 1; return x < 0; }"
+try 1 "int f(int x){ return x + 1 < 0; } int g(int x){ return x / 3 == 0 - 715827882; } int main(){ return f(2147483647) * g(0 - 2147483647); }" -finline-limit=0
+try 43 "int main(){ int *a; a = alloc_seq(4, 40); return *(a + 3); }"
+try 67 "int main(){ int x; int *p; int **pp; p = &x; pp = &p; **pp = 67; return x; }"
+try 5 "int main(){ int *a; int *b; a = alloc_seq(8, 0); b = a + 5; return b - a; }"
+try 23 "int main(){ int *a; int *p; a = alloc_seq(4, 10); p = 3 + a; return *(p - 2) + *(p + -1); }"
+try 40 "int f(int x){ int r; r = 0; switch (x) { case 0: r = 10; break; case 1: r = 11; break; case 2: r = 12; case 3: r = r + 13; break; case 5: r = 15; break; case -2: return 7; default: r = 99; } return r; } int main(){ int i; int s; s = 0; for (i = -5; i < 10; i = i + 1) s = s + f(i) * (i + 6); return s % 251; }"
+try 40 "int f(int x){ int r; r = 0; switch (x) { case 0: r = 10; break; case 1: r = 11; break; case 2: r = 12; case 3: r = r + 13; break; case 5: r = 15; break; case -2: return 7; default: r = 99; } return r; } int main(){ int i; int s; s = 0; for (i = -5; i < 10; i = i + 1) s = s + f(i) * (i + 6); return s % 251; }" -finline-limit=0
+try 177 "int f(int x){ switch (x) { case 1: return 1; case 10: return 2; case 100: return 3; case 1000: return 4; case 10000: return 5; case -5: return 6; case 2147483647: return 7; case -2147483647: return 8; } return 9; } int main(){ return f(1) + f(10) * 10 + f(100000) * 100 + f(-5) + f(2147483647) + f(-2147483647) + f(10000) + f(1000) + f(100) - f(3); }"
+try 127 "int f(int x){ int r; r = 0; switch (x) { case 0: case 1: r = 1; break; case 2: case 3: r = 2; break; case 4: case 5: r = 3; break; case 1000: r = 4; break; case 1001: r = 5; break; case 1002: case 1003: r = 6; break; case 50: r = 7; } return r; } int main(){ int i; int s; s = 0; for (i = -1; i < 1010; i = i + 1) s = s + f(i) * (i % 7 + 1); return s % 256; }"
+try 127 "int f(int x){ int r; r = 0; switch (x) { case 0: case 1: r = 1; break; case 2: case 3: r = 2; break; case 4: case 5: r = 3; break; case 1000: r = 4; break; case 1001: r = 5; break; case 1002: case 1003: r = 6; break; case 50: r = 7; } return r; } int main(){ int i; int s; s = 0; for (i = -1; i < 1010; i = i + 1) s = s + f(i) * (i % 7 + 1); return s % 256; }" -fno-layout
+try 228 "int main(){ int i; int n; n = 0; i = 0; while (1) { if (i == 5) break; switch (i) { case 2: n = n + 10; break; default: n = n + 1; } i = i + 1; } for (i = 0; i < 100; i = i + 1) { if (i * i > 50) break; n = n + 1; } return n * 10 + i; }"
+try 6 "int main(){ int *a; int *p; int r; a = alloc_seq(8, 0); p = a + 6; r = 1; switch (p - a) { case 4: r = 4; break; case 5: r = 5; break; case 6: r = 6; break; case 7: r = 7; break; } return r; }"
+try 157 "int main(){ int k; int x; int s; s = 0; for (k = 0; k < 4; k = k + 1) { x = 5; switch (k) { case 1: break; case 3: x = 9; default: x = x + 2; } s = s * 10 + x; } return s % 256; }"
+try 60 "int g(int x){ switch (x) { case 1: return 10; case 2: return 20; case 3: return 30; case 4: return 40; } return 0; } int main(){ return g(2) + g(4) + g(7); }"
+try 108 "int main(){ int i; int s; s = 0; for (i = 0; i < 8; i = i + 1) { switch (i % 4) { case 0: { int t; int *p; p = &t; t = i; s = s + *p; break; } case 1: s = s + 100; case 2: s = s + 1000; break; } } return s % 256; }"
+try 60 "int g(int x){ switch (x) { case 1: return 10; case 2: return 20; case 3: return 30; case 4: return 40; } return 0; } int main(){ return g(2) + g(4) + g(7); }" -finline-limit=0
+try 248 "int main(){ int x; x = func1(240); return __builtin_popcount(x) + __builtin_clz(x) * 10 + __builtin_ctz(x); }" -march=x86-64
+try 248 "int main(){ int x; x = func1(240); return __builtin_popcount(x) + __builtin_clz(x) * 10 + __builtin_ctz(x); }" -march=x86-64-v2
+try 248 "int main(){ int x; x = func1(240); return __builtin_popcount(x) + __builtin_clz(x) * 10 + __builtin_ctz(x); }" -march=x86-64-v3
+try 45 "int main(){ return __builtin_popcount(255) + __builtin_clz(1) + __builtin_ctz(8) + __builtin_expect(3, 1); }" -fno-ipa
+try 32 "int main(){ return __builtin_popcount(func1(-1)); }"
+try 7 "int main(){ int x; int *p; p = &x; x = func1(305419896); __builtin_prefetch(p); __builtin_prefetch(p, 1, 0); return (__builtin_bswap32(x) == 2018915346) + (__builtin_bswap64(__builtin_bswap64(x)) == x) * 2 + (__rdtsc() > 0) * 4; }"
+try 3 "int main(){ int x; int *p; p = &x; x = 3; __builtin_prefetch(p, 0, 2); return x + __builtin_prefetch(p); }"
+try 77 "int main(){ int i; int s; s = 0; for (i = 0; i < 20; i = i + 1) { if (__builtin_expect(i % 7 == 3, 0)) s = s + func1(i); else s = s + 1; if (__builtin_expect(i < 15, 1)) s = s + 2; } return s; }"
+try 77 "int main(){ int i; int s; s = 0; for (i = 0; i < 20; i = i + 1) { if (__builtin_expect(i % 7 == 3, 0)) s = s + func1(i); else s = s + 1; if (__builtin_expect(i < 15, 1)) s = s + 2; } return s; }" -fno-layout
+try 28 "static int f(int a, int b, int c, int d, int e, int g, int h){ return a + b + c + d + e + g + h; } int main(){ return f(1, 2, 3, 4, 5, 6, 7); }" -finline-limit=0
+try 43 "static int f(int a, int u, int c, int d){ return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" -finline-limit=0
+try 10 "static int f(int n, int u, int acc){ if (n == 0) return acc; return f(n - 1, 5, acc + n); } int main(){ return f(4, 0, 0); }" -finline-limit=0
+try 2 "int f(int a, int b, int c, int d){ return a * b - c * d; } int main(){ return f(func1(3), 4, func1(2), 5); }" "-finline-limit=0 -fno-ipa"
+try_obj 43 "static int f(int a, int u, int c, int d){ return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" -finline-limit=0
+try_abi 26 "int g(int a, int u, int c){ return a - c; } int f(int a, int b, int c, int d, int e, int h){ return g(a, b, c) + d * e - h; }" "int f(int, int, int, int, int, int); int g(int, int, int); int main(){ return f(9, 0, 2, 4, 5, 3) + g(7, 1, 5); }" -finline-limit=0
+try 43 "static int f(int a, int u, int c, int d){ if (a < 0) return -1; if (c > 100) return 127; return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" "-Os -finline-limit=0"
+try 12 "int leaf(int a){ int c; int *q; c = a - 3; q = &c; return *q * 2 + 5 - 1; } int main(){ return leaf(func1(3)) + leaf(2) + 6; }" "-Os -fomit-frame-pointer -finline-limit=0"
+try_obj 43 "static int f(int a, int u, int c, int d){ if (a < 0) return -1; if (c > 100) return 127; return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" "-Os -finline-limit=0"
+try_size "int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(10); }"
+try_size "static int f(int a, int u, int c, int d){ if (a < 0) return -1; if (c > 100) return 127; return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" "-Os -finline-limit=0"
+try 9 "int f(int *p, int a, int b){ int x; int y; x = *p / a; y = *(p + 1) * b; return x + y * 3 + a * b; } int main(){ return f(alloc_seq(2, 40), 3, 2); }"
+try 9 "int f(int *p, int a, int b){ int x; int y; x = *p / a; y = *(p + 1) * b; return x + y * 3 + a * b; } int main(){ return f(alloc_seq(2, 40), 3, 2); }" -fno-schedule-insns
+try 9 "int f(int *p, int a, int b){ int x; int y; x = *p / a; y = *(p + 1) * b; return x + y * 3 + a * b; } int main(){ return f(alloc_seq(2, 40), 3, 2); }" "-mtune=znver3 -fomit-frame-pointer -finline-limit=0"
+try 3 "int main(){ int x; x = func1(100); return (x / 7 == 14) + (x % 7 == 2) + (x / 16 == 6); }" -mtune=skylake
+try 27 "int main(){ int *a; int x; int y; a = alloc_seq(4, 3); x = *a * *(a + 1); *(a + 1) = x; y = *(a + 1) + *(a + 2) / 2 + *(a + 3) % 5; return y + x; }" -mtune=skylake
+try_obj 27 "int main(){ int *a; int x; int y; a = alloc_seq(4, 3); x = *a * *(a + 1); *(a + 1) = x; y = *(a + 1) + *(a + 2) / 2 + *(a + 3) % 5; return y + x; }" -mtune=znver3
+try_sched "int f(int *p, int a, int b){ int x; int y; x = *p / a; y = *(p + 1) * b; return x + y * 3 + a * b; } int main(){ return f(alloc_seq(2, 40), 3, 2); }" "" x86-64
+try_sched "int main(){ int x; x = func1(100); return (x / 7 == 14) + (x % 7 == 2) + (x / 16 == 6); }" -mtune=skylake skylake
+try_sched "int poly(int x, int y){ return (x * x + y) * (x - y * 3) + (x + 1) * (y + 2) * (x + y); } int main(){ return poly(func1(3), 4); }" -mtune=znver3 znver3
+try_obj 55 "int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(10); }"
+try_obj 3 "static int f(int x){ return func1(x) + x / 7 - x % -3; } int g(int x){ return f(x) * 2; } int main(){ return g(3) - f(3); }" -finline-limit=0
+try_obj 45 "int main(){ int i; int s; s = 0; for (i = 0; i < 10; i = i + 1) { if (i == 3) s = s + i * 100000; s = s - i * 100000; s = s + i * 100000; s = s + i; s = s - i; s = s + i * 7; s = s - i * 7; s = s + i * 11; s = s - i * 11; s = s + i * 13; s = s - i * 13; s = s + i; } return s - 300000; }"
+try_obj 1 "int main(){ int *a; int *b; int i; a = alloc_seq(11, 1); b = alloc_seq(11, 0); for (i = 0; i < 11; i = i + 1) *(b + i) = *(a + i) + *(a + i) - 1; return sum_array(b, 11) == 121; }" -march=x86-64-v3
+try_obj 127 "int f(int x){ int r; r = 0; switch (x) { case 0: case 1: r = 1; break; case 2: case 3: r = 2; break; case 4: case 5: r = 3; break; case 1000: r = 4; break; case 1001: r = 5; break; case 1002: case 1003: r = 6; break; case 50: r = 7; } return r; } int main(){ int i; int s; s = 0; for (i = -1; i < 1010; i = i + 1) s = s + f(i) * (i % 7 + 1); return s % 256; }"
+try_obj 177 "int f(int x){ switch (x) { case 1: return 1; case 10: return 2; case 100: return 3; case 1000: return 4; case 10000: return 5; case -5: return 6; case 2147483647: return 7; case -2147483647: return 8; } return 9; } int main(){ return f(1) + f(10) * 10 + f(100000) * 100 + f(-5) + f(2147483647) + f(-2147483647) + f(10000) + f(1000) + f(100) - f(3); }" -finline-limit=0
+try_obj 248 "int main(){ int x; x = func1(240); return __builtin_popcount(x) + __builtin_clz(x) * 10 + __builtin_ctz(x); }" -march=x86-64
+try_obj 248 "int main(){ int x; x = func1(240); return __builtin_popcount(x) + __builtin_clz(x) * 10 + __builtin_ctz(x); }" -march=x86-64-v3
+try_obj 7 "int main(){ int x; int *p; p = &x; x = func1(305419896); __builtin_prefetch(p); __builtin_prefetch(p, 1, 0); return (__builtin_bswap32(x) == 2018915346) + (__builtin_bswap64(__builtin_bswap64(x)) == x) * 2 + (__rdtsc() > 0) * 4; }"
+try_run 127 "int f(int x){ int r; r = 0; switch (x) { case 0: case 1: r = 1; break; case 2: case 3: r = 2; break; case 4: case 5: r = 3; break; case 1000: r = 4; break; case 1001: r = 5; break; case 1002: case 1003: r = 6; break; case 50: r = 7; } return r; } int main(){ int i; int s; s = 0; for (i = -1; i < 1010; i = i + 1) s = s + f(i) * (i % 7 + 1); return s % 256; }" -fno-layout
+try_run 21 "int main(){ return func6(1, 2, 3, 4, 5, 6); }" -finline-limit=0
+try_run 43 "static int f(int a, int u, int c, int d){ return a + c * d; } int g(int a, int u, int c){ return a - c; } int main(){ return f(func1(1), func2(2, 3), 3, func1(4)) + g(30, 6, func1(8)) + g(func1(12), 0, 4); }" -finline-limit=0
+try_run 55 "static int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(10); }" -Os
+try_run 55 "static int fib(int n){ if (n < 2) return n; return fib(n - 1) + fib(n - 2); } int main(){ return fib(10); }" -finline-limit=0
+try_run 1 "int main(){ int *a; int *b; int i; a = alloc_seq(11, 1); b = alloc_seq(11, 0); for (i = 0; i < 11; i = i + 1) *(b + i) = *(a + i) + *(a + i) - 1; return sum_array(b, 11) == 121; }" -march=x86-64-v3
+try_lto 3 "int main(){ return add(1, 2); }" "int add(int a, int b){ return a + b; }"
+try_lto 21 "static int f(){ return 1; } int g(int x){ return f() + x; } int unused(){ return no_such_func(); }" "static int f(){ return 2; } int main(){ return f() * 10 + g(0); }"
+try_lto 41 "noinline int g(int *p){ return *p; }" "noinline int f(){ int x; x = 41; return g(&x); } int main(){ return f(); }"
+try_lto 6 "int sum(int n){ int s; int i; s = 0; for (i = 1; i <= n; i = i + 1) { s = s + i; } return s; }" "int main(){ int *p; int x; x = func1(3); p = &x; return sum(*p); }"
+try_lto 52 "int op(int k, int a, int b){ switch (k) { case 0: return a + b; case 1: return a - b; case 2: return a * b; case 3: return a / b; case 4: return a % b; } return 0; }" "int main(){ return op(2, 5, 7) + op(1, 9, 2) + op(3, 10, 2) - op(5, 1, 1) + op(4, 7, 5) + op(0, 1, 2); }"
+try_lto 12 "int bits(int x){ return __builtin_popcount(x); }" "int main(){ return bits(func1(255)) + __builtin_ctz(func1(16)); }"
 
 echo OK
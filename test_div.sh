@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# 定数除算の網羅テスト
+#
+# 9cc は定数での割り算・剰余を、idiv ではなく乗算とシフトで計算する。
+# int32 の範囲の全ての値について、その結果を gcc で計算した結果と比べる。
+#
+#   ./test_div.sh [step]
+#
+# step を指定すると、step 個おきの値だけを調べる。
+
+step="${1:-1}"
+divisors=(2 3 7 10 16 641 1000000007 2147483647 -1 -3 -8 -1000)
+
+# 除数ごとに、割り算と剰余の関数を 9cc でコンパイルする
+program=""
+decls=""
+table=""
+for i in "${!divisors[@]}"; do
+    d="${divisors[$i]}"
+    if [ "$d" -lt 0 ]; then
+        d="(0-${d#-})"
+    fi
+    program="$program int q$i(int x){ return x / $d; } int r$i(int x){ return x % $d; }"
+    decls="$decls int q$i(int); int r$i(int);"
+    table="$table { ${divisors[$i]}L, q$i, r$i },"
+done
+
+./9cc -finline-limit=0 "$program" > div.s || exit 1
+
+cat > div_main.c <<END
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+$decls
+
+static const struct {
+    long d;
+    int (*q)(int);
+    int (*r)(int);
+} divs[] = { $table };
+
+int main(void) {
+    long step = $step;
+    int failed = 0;
+    for (int i = 0; i < sizeof(divs) / sizeof(divs[0]); i++) {
+        long d = divs[i].d;
+        int ng = 0;
+        for (long x = INT32_MIN; x <= INT32_MAX; x += step) {
+            // INT32_MIN / -1 は 32 ビットで折り返す
+            int q = divs[i].q((int)x);
+            int r = divs[i].r((int)x);
+            if ((q != (int)(x / d)) || (r != (int)(x % d))) {
+                printf("%ld / %ld => %d, %d expected, but got %d, %d\n",
+                       x, d, (int)(x / d), (int)(x % d), q, r);
+                ng = 1;
+                failed = 1;
+                break;
+            }
+        }
+        printf("x / %ld, x %% %ld => %s\n", d, d, ng ? "NG" : "OK");
+    }
+    return failed;
+}
+END
+
+gcc -O2 -o div_test div_main.c div.s || exit 1
+./div_test
+result=$?
+rm -f div.s div_main.c div_test
+if [ "$result" != 0 ]; then
+    exit 1
+fi
+echo OK
@@ -52,6 +52,7 @@ static int is_exp_reserved(const char *exp) {
     case '*':  // fall down
     case '&':  // fall down
     case '/':  // fall down
+    case '%':  // fall down
     case '(':  // fall down
     case ')':  // fall down
     case '>':  // fall down
@@ -61,6 +62,7 @@ static int is_exp_reserved(const char *exp) {
     case '{':  // fall down
     case '}':  // fall down
     case ',':  // fall down
+    case ':':  // fall down
         return 1;
     }
     return 0;
@@ -156,6 +158,41 @@ void tokenize(char *exp) {
             cur = new_token(TK_FOR, exp, len, cur);
             exp += len;
         }
+        // noinline
+        else if ((len = is_exp_reserved_as(exp, "noinline")) > 0) {
+            cur = new_token(TK_NOINLINE, exp, len, cur);
+            exp += len;
+        }
+        // always_inline
+        else if ((len = is_exp_reserved_as(exp, "always_inline")) > 0) {
+            cur = new_token(TK_ALWAYS_INLINE, exp, len, cur);
+            exp += len;
+        }
+        // static
+        else if ((len = is_exp_reserved_as(exp, "static")) > 0) {
+            cur = new_token(TK_STATIC, exp, len, cur);
+            exp += len;
+        }
+        // switch
+        else if ((len = is_exp_reserved_as(exp, "switch")) > 0) {
+            cur = new_token(TK_SWITCH, exp, len, cur);
+            exp += len;
+        }
+        // case
+        else if ((len = is_exp_reserved_as(exp, "case")) > 0) {
+            cur = new_token(TK_CASE, exp, len, cur);
+            exp += len;
+        }
+        // default
+        else if ((len = is_exp_reserved_as(exp, "default")) > 0) {
+            cur = new_token(TK_DEFAULT, exp, len, cur);
+            exp += len;
+        }
+        // break
+        else if ((len = is_exp_reserved_as(exp, "break")) > 0) {
+            cur = new_token(TK_BREAK, exp, len, cur);
+            exp += len;
+        }
         // 変数
         else if ((len = is_exp_variable(exp)) > 0) {
             cur = new_token(TK_IDENT, exp, len, cur);
@@ -213,7 +250,7 @@ void expect(const char *op) {
  */
 Token *expect_with_kind(TokenKind kind) {
     if (token->kind != kind) {
-        const char *str[] = { "記号", "return", "if", "else", "while", "for", "変数", "整数", "型", "EOF" };
+        const char *str[] = { "記号", "return", "if", "else", "while", "for", "変数", "整数", "型", "noinline", "always_inline", "static", "EOF" };
         error_at(token->str, "%sではありません", str[kind]);
     }
     Token *tok = token;
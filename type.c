@@ -0,0 +1,177 @@
+/* 式の型
+
+   int は 4 バイト、ポインタは 8 バイト。ポインタ同士の差は 8 バイトの
+   整数 (TY_LONG) になる。
+   パーサは式のノードを作るたびに型を付け、ポインタの加減算では整数を
+   指す先の大きさ倍する。式のノードを作る最適化も、その場で型を付ける。
+   中間表現モジュールには型を書き出さないので、読み込んだ後に add_type で
+   まとめて付ける。
+ */
+#include "9cc.h"
+
+static Type int_type_body = {TY_INT, NULL};
+static Type long_type_body = {TY_LONG, NULL};
+
+/* int 型 */
+Type *int_type = &int_type_body;
+
+/* ポインタの差の型 */
+static Type *long_type = &long_type_body;
+
+/* 型の大きさ (バイト) */
+int size_of(Type *type) {
+    return (type->ty == TY_INT) ? 4 : 8;
+}
+
+/* ポインタ型なら true を返す */
+bool is_pointer(Type *type) {
+    return type->ty == TY_PTR;
+}
+
+/* type へのポインタ型を作る */
+Type *pointer_to(Type *type) {
+    Type *ptr = calloc(1, sizeof(Type));
+    ptr->ty = TY_PTR;
+    ptr->ptr_to = type;
+    return ptr;
+}
+
+/* 算術演算の結果の型。どちらかが 8 バイトなら TY_LONG */
+static Type *arith_type(Node *lhs, Node *rhs) {
+    if ((size_of(lhs->type) == 8) || (size_of(rhs->type) == 8)) {
+        return long_type;
+    }
+    return int_type;
+}
+
+/* node の型を、子の型から決める */
+static Type *node_type(Node *node) {
+    Node *lhs;
+    Node *rhs;
+
+    switch (node->kind) {
+    case ND_NUM:
+        return int_type;
+    case ND_LVAR:
+        return node->v.lvar.var->type;
+    case ND_ADD:
+        lhs = node->v.op2.lhs;
+        rhs = node->v.op2.rhs;
+        if (is_pointer(lhs->type) == true) {
+            return lhs->type;
+        }
+        if (is_pointer(rhs->type) == true) {
+            return rhs->type;
+        }
+        return arith_type(lhs, rhs);
+    case ND_SUB:
+        lhs = node->v.op2.lhs;
+        rhs = node->v.op2.rhs;
+        if (is_pointer(lhs->type) == true) {
+            return (is_pointer(rhs->type) == true) ? long_type : lhs->type;
+        }
+        return arith_type(lhs, rhs);
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+        return arith_type(node->v.op2.lhs, node->v.op2.rhs);
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+        return int_type;
+    case ND_ASSIGN:
+        return node->v.op2.lhs->type;
+    case ND_ADDR:
+        return pointer_to(node->v.op1.expr->type);
+    case ND_DEREF:
+        // ポインタでない値の参照外しは int を読む
+        if (is_pointer(node->v.op1.expr->type) == true) {
+            return node->v.op1.expr->type->ptr_to;
+        }
+        return int_type;
+    case ND_FUNC:
+        if ((node->v.func.builtin == BI_BSWAP64)
+            || (node->v.func.builtin == BI_RDTSC)) {
+            return long_type;
+        }
+        // 定義の分からない関数は int を返すものとする
+        if (node->v.func.deffunc != NULL) {
+            return node->v.func.deffunc->v.deffunc.rettype;
+        }
+        return int_type;
+    case ND_INLINE:
+        return int_type;
+    default:
+        return NULL;
+    }
+}
+
+/* node 以下の、型が決まっていない式に型を付ける。
+   型の付いた式は、その中の式にも型が付いているものとする。
+ */
+void add_type(Node *node) {
+    if ((node == NULL) || (node->type != NULL)) {
+        return;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+    case ND_DIV:
+    case ND_MOD:
+    case ND_EQ:
+    case ND_NE:
+    case ND_LT:
+    case ND_LE:
+    case ND_ASSIGN:
+        add_type(node->v.op2.lhs);
+        add_type(node->v.op2.rhs);
+        break;
+    case ND_ADDR:
+    case ND_RETURN:
+    case ND_DEREF:
+        add_type(node->v.op1.expr);
+        break;
+    case ND_IF:
+        add_type(node->v.cif.test);
+        add_type(node->v.cif.tbody);
+        add_type(node->v.cif.ebody);
+        break;
+    case ND_WHILE:
+        add_type(node->v.cwhile.test);
+        add_type(node->v.cwhile.body);
+        break;
+    case ND_FOR:
+        add_type(node->v.cfor.init);
+        add_type(node->v.cfor.test);
+        add_type(node->v.cfor.update);
+        add_type(node->v.cfor.body);
+        break;
+    case ND_SWITCH:
+        add_type(node->v.cswitch.test);
+        add_type(node->v.cswitch.body);
+        break;
+    case ND_BLOCK:
+        for (int i = 0; i < node->v.block.num_code; i++) {
+            add_type(node->v.block.code[i]);
+        }
+        break;
+    case ND_DEFFUNC:
+        add_type(node->v.deffunc.block);
+        break;
+    case ND_FUNC:
+        for (int i = 0; i < node->v.func.num_param; i++) {
+            add_type(node->v.func.params[i]);
+        }
+        break;
+    case ND_INLINE:
+        add_type(node->v.inl.block);
+        break;
+    default:
+        break;
+    }
+
+    node->type = node_type(node);
+}
@@ -0,0 +1,251 @@
+/* ループのベクトル化
+
+   次の形の for ループをベクトル化する。
+
+     for (init; i < n; i = i + 1) *(dst + i) = (式);
+
+   - dst は int へのポインタ (要素は 4 バイト)
+   - i はアドレスを取られない変数、n はループ不変の式
+   - 式は +, - と、*(src + i) の読み出しと、ループ不変の式だけからなる
+   - ループ不変の式は、アドレスを取られない i 以外の変数と整数の +, -, *
+
+   本体は配列の要素ごとに独立なので、ベクトル 1 つ分ずつ処理するループと、
+   残りを処理する元のループ (スカラーのエピローグ) に分けられる。
+   ただし dst と src が別の変数なら、同じ配列の少し前を指している
+   (ある反復の格納を後の反復で読む) かもしれないので、実行時に
+   dst - src を調べ、重なっていれば元のループだけを実行する。
+   dst と src が同じ変数なら、同じ要素を読んでから書くだけなので重ならない。
+ */
+#include "9cc.h"
+
+/* 要素 (int) の大きさ (バイト) */
+#define ELEM_SIZE (4)
+
+/* 解析中の関数のローカル変数の個数 */
+static int num_var = 0;
+
+/* アドレスを取られた変数 */
+static bool *addr_taken = NULL;
+
+/* node が変数 var なら true を返す */
+static bool is_var(Node *node, LVar *var) {
+    return (node->kind == ND_LVAR) && (node->v.lvar.var == var);
+}
+
+/* ループ内で値が変わらない式なら true を返す。
+   ループ内で書き込むのは格納先のメモリだけなので、アドレスを取られない
+   変数は誘導変数を除いて変わらない。
+ */
+static bool is_invariant(Node *node, LVar *iv) {
+    switch (node->kind) {
+    case ND_NUM:
+        return true;
+    case ND_LVAR:
+        return (node->v.lvar.var != iv)
+               && (addr_taken[node->v.lvar.var->id] == false);
+    case ND_ADD:
+    case ND_SUB:
+    case ND_MUL:
+        return is_invariant(node->v.op2.lhs, iv)
+               && is_invariant(node->v.op2.rhs, iv);
+    default:
+        return false;
+    }
+}
+
+/* node が int の配列の要素 *(base + iv) なら base を返す。
+   base はループ不変の変数に限る。
+   パーサは iv を要素の大きさ倍するので、アドレスは base + iv * 4 になる。
+ */
+static Node *match_access(Node *node, LVar *iv) {
+    if ((node->kind != ND_DEREF) || (size_of(node->type) != ELEM_SIZE)
+        || (node->v.op1.expr->kind != ND_ADD)) {
+        return NULL;
+    }
+    Node *base = node->v.op1.expr->v.op2.lhs;
+    Node *index = node->v.op1.expr->v.op2.rhs;
+    if ((index->kind != ND_MUL) || (is_var(index->v.op2.lhs, iv) == false)
+        || (index->v.op2.rhs->kind != ND_NUM)
+        || (index->v.op2.rhs->v.num.val != ELEM_SIZE)
+        || (base->kind != ND_LVAR) || (is_invariant(base, iv) == false)) {
+        return NULL;
+    }
+    return base;
+}
+
+/* 配列に node を追加する */
+static void push_node(Node ***nodes, int *num, Node *node) {
+    *nodes = realloc(*nodes, (*num + 1) * sizeof(Node *));
+    (*nodes)[*num] = node;
+    (*num)++;
+}
+
+/* 2 項演算子のノードを作る */
+static Node *new_op2(NodeKind kind, Node *lhs, Node *rhs) {
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = kind;
+    node->v.op2.lhs = lhs;
+    node->v.op2.rhs = rhs;
+    add_type(node);
+    return node;
+}
+
+/* 整数のノードを作る */
+static Node *new_num(int val) {
+    Node *node = calloc(1, sizeof(Node));
+    node->kind = ND_NUM;
+    node->v.num.val = val;
+    add_type(node);
+    return node;
+}
+
+/* 格納する値の式を調べ、ループ不変の式と実行時の重なりの検査を集める。
+   ベクトル化できない式なら false を返す。
+ */
+static bool check_value(Node *node, VecLoop *vec, Node *dst) {
+    LVar *iv = vec->iv->v.lvar.var;
+
+    if (is_invariant(node, iv) == true) {
+        push_node(&vec->invariants, &vec->num_invariant, node);
+        return true;
+    }
+
+    Node *src = match_access(node, iv);
+    if (src != NULL) {
+        if (src->v.lvar.var == dst->v.lvar.var) {
+            return true;
+        }
+        for (int i = 0; i < vec->num_check; i++) {
+            Node *check = vec->checks[i];
+            if (check->v.op2.rhs->v.lvar.var == src->v.lvar.var) {
+                return true;
+            }
+        }
+        push_node(&vec->checks, &vec->num_check, new_op2(ND_SUB, dst, src));
+        return true;
+    }
+
+    switch (node->kind) {
+    case ND_ADD:
+    case ND_SUB:
+        return check_value(node->v.op2.lhs, vec, dst)
+               && check_value(node->v.op2.rhs, vec, dst);
+    default:
+        return false;
+    }
+}
+
+/* ループ不変の式なら true を返す */
+static bool is_hoisted(Node *node, VecLoop *vec) {
+    for (int i = 0; i < vec->num_invariant; i++) {
+        if (vec->invariants[i] == node) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* 値の式の計算に必要な一時ベクトルレジスタの数 */
+static int count_regs(Node *node, VecLoop *vec) {
+    if ((is_hoisted(node, vec) == true) || (node->kind == ND_DEREF)) {
+        return 1;
+    }
+    int lhs = count_regs(node->v.op2.lhs, vec);
+    int rhs = 0;
+    if (is_hoisted(node->v.op2.rhs, vec) == false) {
+        rhs = 1 + count_regs(node->v.op2.rhs, vec);
+    }
+    return (lhs > rhs) ? lhs : rhs;
+}
+
+/* for ループをベクトル化できれば、その情報を返す */
+static VecLoop *vectorize_for(Node *node) {
+    Node *test = node->v.cfor.test;
+    Node *update = node->v.cfor.update;
+    Node *body = node->v.cfor.body;
+
+    // i = i + 1
+    if ((update == NULL) || (update->kind != ND_ASSIGN)
+        || (update->v.op2.lhs->kind != ND_LVAR)) {
+        return NULL;
+    }
+    Node *iv = update->v.op2.lhs;
+    LVar *var = iv->v.lvar.var;
+    Node *step = update->v.op2.rhs;
+    if ((addr_taken[var->id] == true) || (step->kind != ND_ADD)
+        || (is_var(step->v.op2.lhs, var) == false)
+        || (step->v.op2.rhs->kind != ND_NUM)
+        || (step->v.op2.rhs->v.num.val != 1)) {
+        return NULL;
+    }
+
+    // i < n
+    if ((test == NULL) || (test->kind != ND_LT)
+        || (is_var(test->v.op2.lhs, var) == false)
+        || (is_invariant(test->v.op2.rhs, var) == false)) {
+        return NULL;
+    }
+
+    // *(dst + i) = (式)
+    if ((body != NULL) && (body->kind == ND_BLOCK)
+        && (body->v.block.num_code == 1)) {
+        body = body->v.block.code[0];
+    }
+    if ((body == NULL) || (body->kind != ND_ASSIGN)) {
+        return NULL;
+    }
+    Node *dst = match_access(body->v.op2.lhs, var);
+    if (dst == NULL) {
+        return NULL;
+    }
+
+    VecLoop *vec = calloc(1, sizeof(VecLoop));
+    vec->iv = iv;
+    vec->store = body->v.op2.lhs;
+    vec->value = body->v.op2.rhs;
+    vec->bytes = (option.isa == ISA_AVX2) ? 32 : 16;
+    if ((check_value(vec->value, vec, dst) == false)
+        || (count_regs(vec->value, vec) + vec->num_invariant
+            > NUM_VEC_REG)) {
+        free(vec->invariants);
+        free(vec->checks);
+        free(vec);
+        return NULL;
+    }
+
+    // i + (ベクトルの最後の要素の番号) < n
+    int width = vec->bytes / ELEM_SIZE;
+    vec->vtest = new_op2(
+        ND_LT, new_op2(ND_ADD, iv, new_num(width - 1)), test->v.op2.rhs);
+    // i = i + (ベクトルの要素数)
+    vec->vupdate
+        = new_op2(ND_ASSIGN, iv, new_op2(ND_ADD, iv, new_num(width)));
+    return vec;
+}
+
+/* node 以下の for ループをベクトル化する */
+static void vectorize_node(Node *node, void *arg) {
+    if (node->kind == ND_FOR) {
+        node->v.cfor.vec = vectorize_for(node);
+    }
+    visit_children(node, vectorize_node, arg);
+}
+
+/* 単純なループをベクトル化する */
+void vectorize_loops(Node *program) {
+    if (option.vectorize == false) {
+        return;
+    }
+
+    for (int i = 0; i < program->v.block.num_code; i++) {
+        Node *block = program->v.block.code[i]->v.deffunc.block;
+        num_var = block->v.block.total_local;
+        addr_taken = calloc(num_var + 1, sizeof(bool));
+        find_addr_taken(block, addr_taken);
+
+        vectorize_node(block, NULL);
+
+        free(addr_taken);
+        addr_taken = NULL;
+    }
+}